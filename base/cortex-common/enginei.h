@@ -7,6 +7,12 @@
 
 // Interface for inference engine.
 // Note: only append new function to keep the compatibility.
+//
+// Callbacks receive (status, result). status carries is_done, has_error,
+// is_stream and status_code. When a request sets "raw_response" and the
+// engine supports it for that call, status also has is_raw = true and
+// content_type, and result is a string holding the serialized response
+// body, to be sent as is.
 class EngineI {
  public:
   virtual ~EngineI() {}
@@ -32,7 +38,8 @@ class EngineI {
     if (f == "HandleChatCompletion" || f == "HandleEmbedding" ||
         f == "LoadModel" || f == "UnloadModel" || f == "GetModelStatus" ||
         f == "GetModels" || f == "CreateTranscription" ||
-        f == "CreateTranslation") {
+        f == "CreateTranslation" || f == "CreateBatchTranscription" ||
+        f == "DetectLanguage") {
       return true;
     }
     return false;
@@ -50,4 +57,16 @@ class EngineI {
   virtual void CreateTranslation(
       std::shared_ptr<Json::Value> jsonBody,
       std::function<void(Json::Value&&, Json::Value&&)>&& callback) = 0;
+
+  // Transcribes many files in one job. The callback is invoked as a stream:
+  // once per finished file and a last time with is_done set.
+  virtual void CreateBatchTranscription(
+      std::shared_ptr<Json::Value> jsonBody,
+      std::function<void(Json::Value&&, Json::Value&&)>&& callback) = 0;
+
+  // Identifies the spoken language of an audio file without transcribing
+  // it; the result holds the language probabilities.
+  virtual void DetectLanguage(
+      std::shared_ptr<Json::Value> jsonBody,
+      std::function<void(Json::Value&&, Json::Value&&)>&& callback) = 0;
 };
\ No newline at end of file
@@ -0,0 +1,469 @@
+// Micro benchmarks for the non-model part of a transcription request: audio
+// decoding, diarization, response formatting and the engine's JSON wrapping.
+// All inputs are synthetic. No model is needed, except for comparing the mel
+// front end with whisper's own spectrogram, which loads the model file named
+// by WHISPER_BENCH_MODEL.
+#include <benchmark/benchmark.h>
+
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "json/value.h"
+#include "mel_frontend.h"
+#include "whisper_server_context.h"
+
+#define DR_WAV_IMPLEMENTATION
+#include "dr_wav.h"
+
+#include "utils.h"
+
+namespace {
+constexpr int kSampleRate = COMMON_SAMPLE_RATE;
+constexpr float kPi = 3.14159265f;
+
+void PutLE(std::vector<uint8_t>& out, uint32_t v, int bytes) {
+  for (int i = 0; i < bytes; i++) {
+    out.push_back(static_cast<uint8_t>((v >> (8 * i)) & 0xff));
+  }
+}
+
+// 16 kHz s16 PCM WAV with a tone per channel and some noise
+std::vector<uint8_t> MakeWav(int seconds, int channels) {
+  const uint32_t n_frames = uint32_t(seconds) * kSampleRate;
+  const uint32_t data_size = n_frames * channels * 2;
+
+  std::vector<uint8_t> wav;
+  wav.reserve(44 + data_size);
+  wav.insert(wav.end(), {'R', 'I', 'F', 'F'});
+  PutLE(wav, 36 + data_size, 4);
+  wav.insert(wav.end(), {'W', 'A', 'V', 'E', 'f', 'm', 't', ' '});
+  PutLE(wav, 16, 4);
+  PutLE(wav, 1, 2);  // PCM
+  PutLE(wav, channels, 2);
+  PutLE(wav, kSampleRate, 4);
+  PutLE(wav, kSampleRate * channels * 2, 4);
+  PutLE(wav, channels * 2, 2);
+  PutLE(wav, 16, 2);
+  wav.insert(wav.end(), {'d', 'a', 't', 'a'});
+  PutLE(wav, data_size, 4);
+
+  std::mt19937 rng(42);
+  std::uniform_real_distribution<float> noise(-0.05f, 0.05f);
+  for (uint32_t i = 0; i < n_frames; i++) {
+    for (int c = 0; c < channels; c++) {
+      const float freq = c == 0 ? 220.0f : 330.0f;
+      const float s =
+          0.5f * std::sin(2.0f * kPi * freq * i / kSampleRate) +
+          noise(rng);
+      PutLE(wav, static_cast<uint16_t>(static_cast<int16_t>(s * 32767.0f)),
+            2);
+    }
+  }
+  return wav;
+}
+
+// Writes the synthetic WAV once per (seconds, channels) and returns its path
+std::string WavFile(int seconds, int channels) {
+  auto path = std::filesystem::temp_directory_path() /
+              ("cortex_audio_bench_" + std::to_string(seconds) + "s_" +
+               std::to_string(channels) + "ch.wav");
+  if (!std::filesystem::exists(path)) {
+    auto wav = MakeWav(seconds, channels);
+    std::ofstream out(path, std::ios::binary);
+    out.write(reinterpret_cast<const char*>(wav.data()), wav.size());
+  }
+  return path.string();
+}
+
+// Segments shaped like whisper output: ~3 s each with one token per word
+std::vector<WhisperSegment> MakeSegments(int n_segments) {
+  static const char* kWords[] = {" the", " quick", " brown", " fox",
+                                 " jumps", " over", " a",    " lazy",
+                                 " dog", " and",   " runs", " away"};
+  constexpr int kWordsPerSegment = 12;
+
+  std::vector<WhisperSegment> segments(n_segments);
+  for (int i = 0; i < n_segments; i++) {
+    auto& s = segments[i];
+    s.t0 = int64_t(i) * 300;
+    s.t1 = s.t0 + 300;
+    s.speaker = i % 2 == 0 ? "0" : "1";
+    for (int w = 0; w < kWordsPerSegment; w++) {
+      WhisperSegment::Token token;
+      token.data = {};
+      token.data.id = 1000 + w;
+      token.data.p = 0.9f;
+      token.data.t0 = s.t0 + w * 25;
+      token.data.t1 = token.data.t0 + 25;
+      token.text = kWords[w];
+      s.text += token.text;
+      s.tokens.push_back(std::move(token));
+    }
+  }
+  return segments;
+}
+
+void BM_ReadWavFile(benchmark::State& state) {
+  const auto seconds = static_cast<int>(state.range(0));
+  const auto channels = static_cast<int>(state.range(1));
+  const auto path = WavFile(seconds, channels);
+  std::vector<float> pcmf32;
+  std::vector<std::vector<float>> pcmf32s;
+  for (auto _ : state) {
+    if (!read_wav(path, pcmf32, pcmf32s, channels == 2)) {
+      state.SkipWithError("read_wav failed");
+      break;
+    }
+    benchmark::DoNotOptimize(pcmf32.data());
+  }
+  state.SetBytesProcessed(state.iterations() *
+                          int64_t(std::filesystem::file_size(path)));
+}
+BENCHMARK(BM_ReadWavFile)
+    ->ArgsProduct({{30, 600}, {1, 2}})
+    ->ArgNames({"seconds", "channels"})
+    ->Unit(benchmark::kMillisecond);
+
+void BM_ReadWavMemory(benchmark::State& state) {
+  const auto channels = static_cast<int>(state.range(1));
+  const auto wav = MakeWav(static_cast<int>(state.range(0)), channels);
+  std::vector<float> pcmf32;
+  std::vector<std::vector<float>> pcmf32s;
+  for (auto _ : state) {
+    if (!read_wav_from_memory(wav.data(), wav.size(), pcmf32, pcmf32s,
+                              channels == 2)) {
+      state.SkipWithError("read_wav_from_memory failed");
+      break;
+    }
+    benchmark::DoNotOptimize(pcmf32.data());
+  }
+  state.SetBytesProcessed(state.iterations() * int64_t(wav.size()));
+}
+BENCHMARK(BM_ReadWavMemory)
+    ->ArgsProduct({{30, 600}, {1, 2}})
+    ->ArgNames({"seconds", "channels"})
+    ->Unit(benchmark::kMillisecond);
+
+// read_wav("-") reads from stdin; stdin is reopened on the synthetic file
+void BM_ReadWavStdin(benchmark::State& state) {
+  const auto channels = static_cast<int>(state.range(1));
+  const auto path = WavFile(static_cast<int>(state.range(0)), channels);
+  std::vector<float> pcmf32;
+  std::vector<std::vector<float>> pcmf32s;
+  for (auto _ : state) {
+    state.PauseTiming();
+    if (std::freopen(path.c_str(), "rb", stdin) == nullptr) {
+      state.SkipWithError("could not reopen stdin");
+      break;
+    }
+    state.ResumeTiming();
+    if (!read_wav("-", pcmf32, pcmf32s, channels == 2)) {
+      state.SkipWithError("read_wav failed");
+      break;
+    }
+    benchmark::DoNotOptimize(pcmf32.data());
+  }
+  state.SetBytesProcessed(state.iterations() *
+                          int64_t(std::filesystem::file_size(path)));
+}
+BENCHMARK(BM_ReadWavStdin)
+    ->ArgsProduct({{30, 600}, {1, 2}})
+    ->ArgNames({"seconds", "channels"})
+    ->Unit(benchmark::kMillisecond);
+
+// Whether ffmpeg runs here, found by converting a short file once
+bool HasFfmpeg() {
+  static const bool has_ffmpeg = [] {
+    const auto src = WavFile(1, 1);
+    const auto dst = std::filesystem::temp_directory_path() /
+                     "cortex_audio_bench_probe.wav";
+    std::string error;
+    const bool converted = convert_to_wav(src, dst.string(), error);
+    std::error_code ec;
+    std::filesystem::remove(dst, ec);
+    return converted;
+  }();
+  return has_ffmpeg;
+}
+
+// Includes the ffmpeg process start up, which is what a request pays on a
+// cache miss.
+void BM_ConvertToWav(benchmark::State& state) {
+  if (!HasFfmpeg()) {
+    state.SkipWithError("ffmpeg not found");
+    return;
+  }
+  const auto src = WavFile(static_cast<int>(state.range(0)), 2);
+  const auto dst = std::filesystem::temp_directory_path() /
+                   "cortex_audio_bench_convert.wav";
+  std::string error;
+  for (auto _ : state) {
+    if (!convert_to_wav(src, dst.string(), error)) {
+      state.SkipWithError(error.c_str());
+      break;
+    }
+  }
+  std::filesystem::remove(dst);
+}
+BENCHMARK(BM_ConvertToWav)
+    ->Arg(30)
+    ->Arg(600)
+    ->ArgName("seconds")
+    ->Unit(benchmark::kMillisecond);
+
+// The same conversion through a process started ahead, with the input and
+// the PCM going over pipes
+void BM_FfmpegDecoderPool(benchmark::State& state) {
+  if (!FfmpegDecoderPool::Supported()) {
+    state.SkipWithError("ffmpeg processes cannot be pooled on this platform");
+    return;
+  }
+  if (!HasFfmpeg()) {
+    state.SkipWithError("ffmpeg not found");
+    return;
+  }
+  const auto src = WavFile(static_cast<int>(state.range(0)), 2);
+  const auto dst = std::filesystem::temp_directory_path() /
+                   "cortex_audio_bench_decode.wav";
+  FfmpegDecoderPool pool(1);
+  std::string error;
+  for (auto _ : state) {
+    if (!pool.DecodeToWav(src, dst.string(), error)) {
+      state.SkipWithError(error.c_str());
+      break;
+    }
+    // let the replacement start, as it would between requests
+    state.PauseTiming();
+    for (int i = 0; i < 1000 && pool.GetStats().idle == 0; i++) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    state.ResumeTiming();
+  }
+  std::filesystem::remove(dst);
+}
+BENCHMARK(BM_FfmpegDecoderPool)
+    ->Arg(30)
+    ->Arg(600)
+    ->ArgName("seconds")
+    ->Unit(benchmark::kMillisecond);
+
+// What a request pays when the same content was converted before: hashing
+// the input and looking it up
+void BM_ConvertedAudioCacheHit(benchmark::State& state) {
+  const auto src = WavFile(static_cast<int>(state.range(0)), 2);
+  const auto dir = std::filesystem::temp_directory_path() /
+                   "cortex_audio_bench_cache";
+  ConvertedAudioCache cache(
+      [](const std::string& input, const std::string& output,
+         std::string& error) {
+        std::error_code ec;
+        std::filesystem::copy_file(
+            input, output, std::filesystem::copy_options::overwrite_existing,
+            ec);
+        error = ec.message();
+        return !ec;
+      },
+      dir.string());
+  cache.Get(src);
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(cache.Get(src));
+  }
+  state.SetBytesProcessed(state.iterations() *
+                          int64_t(std::filesystem::file_size(src)));
+  std::filesystem::remove_all(dir);
+}
+BENCHMARK(BM_ConvertedAudioCacheHit)
+    ->Arg(30)
+    ->Arg(600)
+    ->ArgName("seconds")
+    ->Unit(benchmark::kMillisecond);
+
+// One call per ~3 s segment over a whole stereo file
+void BM_EstimateDiarizationSpeaker(benchmark::State& state) {
+  const auto path = WavFile(static_cast<int>(state.range(0)), 2);
+  std::vector<float> pcmf32;
+  std::vector<std::vector<float>> pcmf32s;
+  read_wav(path, pcmf32, pcmf32s, true);
+  const auto segments =
+      MakeSegments(static_cast<int>(state.range(0)) * 100 / 300);
+  for (auto _ : state) {
+    for (const auto& s : segments) {
+      benchmark::DoNotOptimize(
+          estimate_diarization_speaker(pcmf32s, s.t0, s.t1));
+    }
+  }
+  state.SetItemsProcessed(state.iterations() * int64_t(segments.size()));
+}
+BENCHMARK(BM_EstimateDiarizationSpeaker)
+    ->Arg(30)
+    ->Arg(600)
+    ->ArgName("seconds")
+    ->Unit(benchmark::kMicrosecond);
+
+// Each preprocessing step on its own (1 DC removal, 2 high-pass,
+// 4 normalization) and all of them, over a mono file
+void BM_AudioPreprocessor(benchmark::State& state) {
+  const auto path = WavFile(static_cast<int>(state.range(0)), 1);
+  std::vector<float> pcmf32;
+  std::vector<std::vector<float>> pcmf32s;
+  read_wav(path, pcmf32, pcmf32s, false);
+  PreprocessOptions options;
+  options.remove_dc = state.range(1) & 1;
+  options.high_pass_hz = (state.range(1) & 2) ? 80.0f : 0.0f;
+  options.normalize = state.range(1) & 4;
+  std::vector<float> samples;
+  for (auto _ : state) {
+    state.PauseTiming();
+    samples = pcmf32;
+    state.ResumeTiming();
+    AudioPreprocessor preprocessor(options, WHISPER_SAMPLE_RATE);
+    preprocessor.Process(samples.data(), samples.size());
+    benchmark::DoNotOptimize(samples.data());
+  }
+  state.SetItemsProcessed(state.iterations() * int64_t(pcmf32.size()));
+}
+BENCHMARK(BM_AudioPreprocessor)
+    ->ArgsProduct({{30, 600}, {1, 2, 4, 7}})
+    ->ArgNames({"seconds", "steps"})
+    ->Unit(benchmark::kMillisecond);
+
+// Mel spectrogram of a mono file, as fed to whisper_set_mel_with_state
+void BM_MelFrontend(benchmark::State& state) {
+  const auto path = WavFile(static_cast<int>(state.range(0)), 1);
+  std::vector<float> pcmf32;
+  std::vector<std::vector<float>> pcmf32s;
+  read_wav(path, pcmf32, pcmf32s, false);
+  const MelFrontend frontend(80);
+  std::vector<float> mel;
+  for (auto _ : state) {
+    frontend.Compute(pcmf32.data(), static_cast<int>(pcmf32.size()),
+                     static_cast<int>(state.range(1)), mel, nullptr);
+    benchmark::DoNotOptimize(mel.data());
+  }
+}
+BENCHMARK(BM_MelFrontend)
+    ->ArgsProduct({{30, 600}, {1, 4}})
+    ->ArgNames({"seconds", "threads"})
+    ->Unit(benchmark::kMillisecond);
+
+// The same through whisper_pcm_to_mel_with_state
+void BM_WhisperPcmToMel(benchmark::State& state) {
+  const char* model_path = std::getenv("WHISPER_BENCH_MODEL");
+  if (model_path == nullptr) {
+    state.SkipWithError("WHISPER_BENCH_MODEL is not set");
+    return;
+  }
+  static struct whisper_context* ctx =
+      whisper_init_from_file_with_params_no_state(
+          model_path, whisper_context_default_params());
+  if (ctx == nullptr) {
+    state.SkipWithError("Failed to load WHISPER_BENCH_MODEL");
+    return;
+  }
+  const auto path = WavFile(static_cast<int>(state.range(0)), 1);
+  std::vector<float> pcmf32;
+  std::vector<std::vector<float>> pcmf32s;
+  read_wav(path, pcmf32, pcmf32s, false);
+  struct whisper_state* wstate = whisper_init_state(ctx);
+  for (auto _ : state) {
+    whisper_pcm_to_mel_with_state(ctx, wstate, pcmf32.data(),
+                                  static_cast<int>(pcmf32.size()),
+                                  static_cast<int>(state.range(1)));
+  }
+  whisper_free_state(wstate);
+}
+BENCHMARK(BM_WhisperPcmToMel)
+    ->ArgsProduct({{30, 600}, {1, 4}})
+    ->ArgNames({"seconds", "threads"})
+    ->Unit(benchmark::kMillisecond);
+
+void BM_ToTimestamp(benchmark::State& state) {
+  const bool comma = state.range(0) != 0;
+  int64_t t = 0;
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(to_timestamp(t, comma));
+    t = (t + 137) % 360000;
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_ToTimestamp)->Arg(0)->Arg(1)->ArgName("comma");
+
+// Every response_format branch of WhisperServerContext::Inference
+void BM_FormatSegments(benchmark::State& state, const std::string& format,
+                       bool diarize) {
+  const auto segments = MakeSegments(static_cast<int>(state.range(0)));
+  WhisperParams params;
+  params.response_format = format;
+  params.diarize = diarize;
+  size_t bytes = 0;
+  for (auto _ : state) {
+    auto result = format_segments(segments, params);
+    bytes = result.size();
+    benchmark::DoNotOptimize(result.data());
+  }
+  state.SetItemsProcessed(state.iterations() * int64_t(segments.size()));
+  state.counters["output_bytes"] = double(bytes);
+}
+BENCHMARK_CAPTURE(BM_FormatSegments, json, std::string(json_format), false)
+    ->Arg(20)
+    ->Arg(1200)
+    ->ArgName("segments");
+BENCHMARK_CAPTURE(BM_FormatSegments, text, std::string(text_format), false)
+    ->Arg(20)
+    ->Arg(1200)
+    ->ArgName("segments");
+BENCHMARK_CAPTURE(BM_FormatSegments, srt, std::string(srt_format), false)
+    ->Arg(20)
+    ->Arg(1200)
+    ->ArgName("segments");
+BENCHMARK_CAPTURE(BM_FormatSegments, vtt, std::string(vtt_format), false)
+    ->Arg(20)
+    ->Arg(1200)
+    ->ArgName("segments");
+BENCHMARK_CAPTURE(BM_FormatSegments, verbose_json, std::string(vjson_format),
+                  false)
+    ->Arg(20)
+    ->Arg(1200)
+    ->ArgName("segments");
+BENCHMARK_CAPTURE(BM_FormatSegments, json_diarize, std::string(json_format),
+                  true)
+    ->Arg(20)
+    ->Arg(1200)
+    ->ArgName("segments");
+
+void BM_Base64Encode(benchmark::State& state) {
+  std::vector<unsigned char> data(static_cast<size_t>(state.range(0)));
+  std::mt19937 rng(7);
+  for (auto& b : data) {
+    b = static_cast<unsigned char>(rng());
+  }
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(utils::base64Encode(data));
+  }
+  state.SetBytesProcessed(state.iterations() * int64_t(data.size()));
+}
+BENCHMARK(BM_Base64Encode)->Arg(4 << 10)->Arg(1 << 20);
+
+// Wraps a transcription result the way HandleTranscription does
+void BM_CreateFullReturnJson(benchmark::State& state) {
+  WhisperParams params;
+  const auto content = format_segments(
+      MakeSegments(static_cast<int>(state.range(0))), params);
+  for (auto _ : state) {
+    auto resp = utils::CreateFullReturnJson(
+        utils::generate_random_string(20), "_", content, "_", 0, 0);
+    benchmark::DoNotOptimize(resp);
+  }
+  state.SetBytesProcessed(state.iterations() * int64_t(content.size()));
+}
+BENCHMARK(BM_CreateFullReturnJson)->Arg(20)->Arg(1200)->ArgName("segments");
+}  // namespace
+
+BENCHMARK_MAIN();
@@ -0,0 +1,452 @@
+// Load generator for the audio engine.
+//
+// Replays a workload against the example server over HTTP or directly
+// against the engine library, and reports throughput, latency percentiles
+// and real-time factor.
+//
+// Workload file: one JSON object per line, e.g.
+//   {"file": "jfk.wav", "response_format": "json", "weight": 3}
+//   {"file": "call.mp3", "duration_ms": 61000, "response_format": "srt"}
+// Entries are drawn at random in proportion to their weight. duration_ms is
+// only needed for non-WAV inputs, WAV durations are read from the header.
+// Non-WAV inputs need the model loaded with --ffmpeg.
+
+#include "cortex-common/enginei.h"
+#include "dylib.h"
+#include "httplib.h"
+#include "json/reader.h"
+#include "json/writer.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace {
+using Clock = std::chrono::steady_clock;
+
+struct BenchParams {
+  std::string target;  // http://host:port, empty to load the engine
+  std::string engine_path = "./engines/cortex.audio";
+  std::string model_path = "./models/ggml-tiny-q5_1.bin";
+  std::string model = "whisper.cpp";
+  std::string workload;
+  std::string default_file = "../../../whisper.cpp/samples/jfk.wav";
+  std::string mode = "closed";  // closed or open
+  int concurrency = 4;          // closed loop clients
+  double rate = 2.0;            // open loop arrivals per second
+  int requests = 100;
+  int warmup = 2;
+  int n_parallel = 1;
+  bool load_model = true;
+  bool ffmpeg_converter = false;
+  bool json_output = false;
+};
+
+struct WorkItem {
+  std::string file;
+  std::string content;  // file bytes, for HTTP uploads
+  std::string response_format = "json";
+  int64_t duration_ms = 0;
+  double weight = 1.0;
+};
+
+struct Sample {
+  double latency_ms;
+  int64_t audio_ms;
+  bool ok;
+};
+
+void PrintUsage(const char* argv0) {
+  fprintf(stderr,
+          "usage: %s [options]\n"
+          "  --target URL        benchmark a running server, e.g. "
+          "http://127.0.0.1:3928\n"
+          "  --engine PATH       engine library directory when no target is "
+          "given [./engines/cortex.audio]\n"
+          "  --model-path PATH   model to load [./models/ggml-tiny-q5_1.bin]\n"
+          "  --model ID          model id [whisper.cpp]\n"
+          "  --no-load           do not load the model before the run\n"
+          "  --n-parallel N      whisper states to load the model with [1]\n"
+          "  --ffmpeg            load the model with ffmpeg conversion, for "
+          "non-WAV workloads\n"
+          "  --workload FILE     JSONL workload, defaults to jfk.wav\n"
+          "  --mode MODE         closed (fixed concurrency) or open (fixed "
+          "arrival rate) [closed]\n"
+          "  --concurrency N     closed loop clients [4]\n"
+          "  --rate R            open loop requests per second [2]\n"
+          "  --requests N        measured requests [100]\n"
+          "  --warmup N          unmeasured requests before the run [2]\n"
+          "  --json              print the report as JSON\n",
+          argv0);
+}
+
+bool ParseArgs(int argc, char** argv, BenchParams& params) {
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    auto next = [&]() -> std::string {
+      if (i + 1 >= argc) {
+        fprintf(stderr, "error: missing value for %s\n", arg.c_str());
+        exit(1);
+      }
+      return argv[++i];
+    };
+    if (arg == "-h" || arg == "--help") {
+      PrintUsage(argv[0]);
+      exit(0);
+    } else if (arg == "--target") {
+      params.target = next();
+    } else if (arg == "--engine") {
+      params.engine_path = next();
+    } else if (arg == "--model-path") {
+      params.model_path = next();
+    } else if (arg == "--model") {
+      params.model = next();
+    } else if (arg == "--no-load") {
+      params.load_model = false;
+    } else if (arg == "--n-parallel") {
+      params.n_parallel = std::stoi(next());
+    } else if (arg == "--ffmpeg") {
+      params.ffmpeg_converter = true;
+    } else if (arg == "--workload") {
+      params.workload = next();
+    } else if (arg == "--mode") {
+      params.mode = next();
+    } else if (arg == "--concurrency") {
+      params.concurrency = std::stoi(next());
+    } else if (arg == "--rate") {
+      params.rate = std::stod(next());
+    } else if (arg == "--requests") {
+      params.requests = std::stoi(next());
+    } else if (arg == "--warmup") {
+      params.warmup = std::stoi(next());
+    } else if (arg == "--json") {
+      params.json_output = true;
+    } else {
+      fprintf(stderr, "error: unknown argument: %s\n", arg.c_str());
+      PrintUsage(argv[0]);
+      return false;
+    }
+  }
+  if (params.mode != "closed" && params.mode != "open") {
+    fprintf(stderr, "error: --mode must be closed or open\n");
+    return false;
+  }
+  return true;
+}
+
+// Duration of a PCM WAV file from its RIFF header, 0 if unknown.
+int64_t WavDurationMs(const std::string& content) {
+  if (content.size() < 12 || content.compare(0, 4, "RIFF") != 0 ||
+      content.compare(8, 4, "WAVE") != 0) {
+    return 0;
+  }
+  auto u16 = [&](size_t p) {
+    return uint32_t(uint8_t(content[p])) | uint32_t(uint8_t(content[p + 1]))
+                                               << 8;
+  };
+  auto u32 = [&](size_t p) { return u16(p) | u16(p + 2) << 16; };
+
+  uint32_t byte_rate = 0;
+  size_t pos = 12;
+  while (pos + 8 <= content.size()) {
+    auto id = content.substr(pos, 4);
+    uint32_t size = u32(pos + 4);
+    // the byte rate is bytes 8 to 11 of the chunk's body
+    if (id == "fmt " && pos + 20 <= content.size()) {
+      byte_rate = u32(pos + 8 + 8);
+    } else if (id == "data" && byte_rate > 0) {
+      uint64_t data_size = (std::min)(uint64_t(size),
+                                      uint64_t(content.size() - pos - 8));
+      return int64_t(data_size * 1000 / byte_rate);
+    }
+    pos += 8 + size + (size & 1);
+  }
+  return 0;
+}
+
+bool LoadWorkload(const BenchParams& params, std::vector<WorkItem>& items) {
+  auto add = [&items](WorkItem item) {
+    std::ifstream f(item.file, std::ios::binary);
+    if (!f.is_open()) {
+      fprintf(stderr, "error: could not open %s\n", item.file.c_str());
+      return false;
+    }
+    item.content.assign(std::istreambuf_iterator<char>(f), {});
+    if (item.duration_ms == 0) {
+      item.duration_ms = WavDurationMs(item.content);
+    }
+    items.push_back(std::move(item));
+    return true;
+  };
+
+  if (params.workload.empty()) {
+    WorkItem item;
+    item.file = params.default_file;
+    return add(std::move(item));
+  }
+
+  std::ifstream workload(params.workload);
+  if (!workload.is_open()) {
+    fprintf(stderr, "error: could not open workload %s\n",
+            params.workload.c_str());
+    return false;
+  }
+  Json::Reader reader;
+  std::string line;
+  while (std::getline(workload, line)) {
+    if (line.empty()) {
+      continue;
+    }
+    Json::Value v;
+    if (!reader.parse(line, v) || !v.isMember("file")) {
+      fprintf(stderr, "error: bad workload line: %s\n", line.c_str());
+      return false;
+    }
+    WorkItem item;
+    item.file = v["file"].asString();
+    item.response_format = v.get("response_format", "json").asString();
+    item.duration_ms = v.get("duration_ms", 0).asInt64();
+    item.weight = v.get("weight", 1.0).asDouble();
+    if (!add(std::move(item))) {
+      return false;
+    }
+  }
+  return !items.empty();
+}
+
+// Sends one request, returns true on HTTP 200.
+class Target {
+ public:
+  virtual ~Target() {}
+  virtual bool LoadModel(const BenchParams& params) = 0;
+  virtual bool Transcribe(const BenchParams& params, const WorkItem& item) = 0;
+};
+
+class HttpTarget : public Target {
+ public:
+  explicit HttpTarget(const std::string& url) : url_(url) {}
+
+  bool LoadModel(const BenchParams& params) override {
+    httplib::Client cli(url_);
+    cli.set_read_timeout(600, 0);
+    Json::Value body;
+    body["model_path"] = params.model_path;
+    body["model"] = params.model;
+    body["n_parallel"] = params.n_parallel;
+    body["ffmpeg_converter"] = params.ffmpeg_converter;
+    auto res = cli.Post("/loadmodel", body.toStyledString(), "application/json");
+    // 409: already loaded
+    return res && (res->status == 200 || res->status == 409);
+  }
+
+  bool Transcribe(const BenchParams& params, const WorkItem& item) override {
+    // one connection per request, like independent clients
+    httplib::Client cli(url_);
+    cli.set_read_timeout(3600, 0);
+    httplib::MultipartFormDataItems form = {
+        {"file", item.content, item.file.substr(item.file.find_last_of("/\\") + 1),
+         "application/octet-stream"},
+        {"model", params.model, "", ""},
+        {"response_format", item.response_format, "", ""},
+    };
+    auto res = cli.Post("/v1/audio/transcriptions", form);
+    return res && res->status == 200;
+  }
+
+ private:
+  std::string url_;
+};
+
+class EngineTarget : public Target {
+ public:
+  explicit EngineTarget(const std::string& path) {
+    dylib_ = std::make_unique<dylib>(path, "engine");
+    auto func = dylib_->get_function<EngineI*()>("get_engine");
+    engine_ = func();
+  }
+  ~EngineTarget() { delete engine_; }
+
+  bool LoadModel(const BenchParams& params) override {
+    auto body = std::make_shared<Json::Value>();
+    (*body)["model_path"] = params.model_path;
+    (*body)["model"] = params.model;
+    (*body)["n_parallel"] = params.n_parallel;
+    (*body)["ffmpeg_converter"] = params.ffmpeg_converter;
+    int code = 0;
+    engine_->LoadModel(body, [&code](Json::Value status, Json::Value) {
+      code = status["status_code"].asInt();
+    });
+    return code == 200 || code == 409;
+  }
+
+  bool Transcribe(const BenchParams& params, const WorkItem& item) override {
+    auto body = std::make_shared<Json::Value>();
+    (*body)["file"] = item.file;
+    (*body)["model"] = params.model;
+    (*body)["response_format"] = item.response_format;
+    int code = 0;
+    engine_->CreateTranscription(body,
+                                 [&code](Json::Value status, Json::Value) {
+                                   code = status["status_code"].asInt();
+                                 });
+    return code == 200;
+  }
+
+ private:
+  std::unique_ptr<dylib> dylib_;
+  EngineI* engine_ = nullptr;
+};
+
+double Percentile(std::vector<double> sorted, double p) {
+  if (sorted.empty()) {
+    return 0;
+  }
+  size_t rank = size_t(std::ceil(p / 100.0 * sorted.size()));
+  return sorted[(std::min)(sorted.size() - 1, rank == 0 ? 0 : rank - 1)];
+}
+}  // namespace
+
+int main(int argc, char** argv) {
+  BenchParams params;
+  if (!ParseArgs(argc, argv, params)) {
+    return 1;
+  }
+
+  std::vector<WorkItem> items;
+  if (!LoadWorkload(params, items)) {
+    return 1;
+  }
+  std::vector<double> weights;
+  for (const auto& item : items) {
+    weights.push_back(item.weight);
+  }
+
+  std::unique_ptr<Target> target;
+  if (!params.target.empty()) {
+    target = std::make_unique<HttpTarget>(params.target);
+  } else {
+    target = std::make_unique<EngineTarget>(params.engine_path);
+  }
+  if (params.load_model && !target->LoadModel(params)) {
+    fprintf(stderr, "error: failed to load model %s\n",
+            params.model_path.c_str());
+    return 1;
+  }
+
+  std::mutex mtx;
+  std::mt19937 rng(42);
+  std::discrete_distribution<size_t> pick(weights.begin(), weights.end());
+  auto next_item = [&]() -> const WorkItem& {
+    std::lock_guard<std::mutex> l(mtx);
+    return items[pick(rng)];
+  };
+
+  for (int i = 0; i < params.warmup; i++) {
+    target->Transcribe(params, next_item());
+  }
+
+  std::vector<Sample> samples;
+  samples.reserve(params.requests);
+  // latency is measured from the intended start, so a saturated server in
+  // open loop mode shows up as queueing delay
+  auto run_one = [&](Clock::time_point intended_start) {
+    const auto& item = next_item();
+    bool ok = target->Transcribe(params, item);
+    double latency_ms =
+        std::chrono::duration<double, std::milli>(Clock::now() - intended_start)
+            .count();
+    std::lock_guard<std::mutex> l(mtx);
+    samples.push_back({latency_ms, item.duration_ms, ok});
+  };
+
+  auto start = Clock::now();
+  std::vector<std::thread> threads;
+  if (params.mode == "closed") {
+    std::atomic<int> remaining = params.requests;
+    for (int c = 0; c < params.concurrency; c++) {
+      threads.emplace_back([&]() {
+        while (remaining-- > 0) {
+          run_one(Clock::now());
+        }
+      });
+    }
+  } else {
+    // Poisson arrivals, every request gets its own thread so the number in
+    // flight is not bounded by the client
+    std::mt19937 arrival_rng(7);
+    std::exponential_distribution<double> interarrival(params.rate);
+    auto t = start;
+    for (int i = 0; i < params.requests; i++) {
+      std::this_thread::sleep_until(t);
+      threads.emplace_back(run_one, t);
+      t += std::chrono::duration_cast<Clock::duration>(
+          std::chrono::duration<double>(interarrival(arrival_rng)));
+    }
+  }
+  for (auto& t : threads) {
+    t.join();
+  }
+  double wall_s = std::chrono::duration<double>(Clock::now() - start).count();
+
+  std::vector<double> latencies;
+  double audio_s = 0;
+  double rtf_sum = 0;
+  int failed = 0;
+  for (const auto& s : samples) {
+    if (!s.ok) {
+      failed++;
+      continue;
+    }
+    latencies.push_back(s.latency_ms);
+    audio_s += s.audio_ms / 1000.0;
+    if (s.audio_ms > 0) {
+      rtf_sum += s.latency_ms / s.audio_ms;
+    }
+  }
+  std::sort(latencies.begin(), latencies.end());
+
+  Json::Value report;
+  report["mode"] = params.mode;
+  report["target"] = params.target.empty() ? "engine" : params.target;
+  report["concurrency"] = params.mode == "closed" ? params.concurrency : 0;
+  report["rate"] = params.mode == "open" ? params.rate : 0.0;
+  report["requests"] = int(samples.size());
+  report["failed"] = failed;
+  report["wall_s"] = wall_s;
+  report["throughput_rps"] = latencies.size() / wall_s;
+  report["audio_s_per_s"] = audio_s / wall_s;
+  report["latency_p50_ms"] = Percentile(latencies, 50);
+  report["latency_p95_ms"] = Percentile(latencies, 95);
+  report["latency_p99_ms"] = Percentile(latencies, 99);
+  // per request: latency / audio duration, lower is better
+  report["rtf_mean"] = latencies.empty() ? 0.0 : rtf_sum / latencies.size();
+  // whole run: wall time / audio processed
+  report["rtf_aggregate"] = audio_s > 0 ? wall_s / audio_s : 0.0;
+
+  if (params.json_output) {
+    Json::StreamWriterBuilder writer;
+    writer["indentation"] = "";
+    printf("%s\n", Json::writeString(writer, report).c_str());
+  } else {
+    printf("mode            %s\n", params.mode.c_str());
+    printf("requests        %d (%d failed)\n", int(samples.size()), failed);
+    printf("throughput      %.2f req/s, %.2f audio s/s\n",
+           report["throughput_rps"].asDouble(),
+           report["audio_s_per_s"].asDouble());
+    printf("latency p50     %.1f ms\n", report["latency_p50_ms"].asDouble());
+    printf("latency p95     %.1f ms\n", report["latency_p95_ms"].asDouble());
+    printf("latency p99     %.1f ms\n", report["latency_p99_ms"].asDouble());
+    printf("rtf mean        %.3f\n", report["rtf_mean"].asDouble());
+    printf("rtf aggregate   %.3f\n", report["rtf_aggregate"].asDouble());
+  }
+  return failed == 0 ? 0 : 2;
+}
@@ -1,12 +1,17 @@
 #include "cortex-common/enginei.h"
+#include "cpu_topology.h"
 #include "dylib.h"
 #include "httplib.h"
 #include "json/reader.h"
+#include "json/writer.h"
 
 #include <signal.h>
 #include <condition_variable>
+#include <deque>
+#include <filesystem>
+#include <fstream>
 #include <mutex>
-#include <queue>
+#include <sstream>
 #include "trantor/utils/Logger.h"
 
 class Server {
@@ -27,25 +32,120 @@ class Server {
   std::unique_ptr<dylib> dylib_;
   EngineI* engine_;
 
-  struct SyncQueue {
-    void push(std::pair<Json::Value, Json::Value>&& p) {
+  // Status and result of an engine callback
+  using Event = std::pair<Json::Value, Json::Value>;
+
+  // One-shot slot for a non-streaming engine call. The engine callback moves
+  // its result in and never blocks; most engine calls complete inline, so
+  // the HTTP worker usually finds the result already set.
+  struct Completion {
+    void Set(Json::Value&& status, Json::Value&& res) {
+      {
+        std::lock_guard<std::mutex> l(mtx);
+        event = Event(std::move(status), std::move(res));
+        done = true;
+      }
+      cond.notify_one();
+    }
+
+    Event Wait() {
       std::unique_lock<std::mutex> l(mtx);
-      q.push(p);
+      cond.wait(l, [this] { return done; });
+      return std::move(event);
+    }
+
+    std::mutex mtx;
+    std::condition_variable cond;
+    bool done = false;
+    Event event;
+  };
+
+  // Events of a streaming engine call. The chunked content provider takes
+  // everything that is pending at once instead of one event per wake up.
+  struct StreamChannel {
+    void Push(Json::Value&& status, Json::Value&& res) {
+      {
+        std::lock_guard<std::mutex> l(mtx);
+        events.emplace_back(std::move(status), std::move(res));
+      }
       cond.notify_one();
     }
 
-    std::pair<Json::Value, Json::Value> wait_and_pop() {
+    // Moves all pending events into |out|. Waits at most |timeout| for the
+    // first one, so the provider gets back to httplib to notice shutdown.
+    void PopAll(std::deque<Event>& out, std::chrono::milliseconds timeout) {
+      std::unique_lock<std::mutex> l(mtx);
+      cond.wait_for(l, timeout, [this] { return !events.empty(); });
+      out.swap(events);
+    }
+
+    std::mutex mtx;
+    std::condition_variable cond;
+    std::deque<Event> events;
+  };
+
+  // Counts requests from routing until their response has been written, so
+  // that shutdown lets them finish. Once draining, new requests are refused.
+  class InFlight {
+   public:
+    // Held for the lifetime of a request; empty when draining.
+    using Token = std::shared_ptr<void>;
+
+    Token Enter() {
+      std::lock_guard<std::mutex> l(mtx_);
+      if (draining_) {
+        return nullptr;
+      }
+      count_++;
+      return Token(static_cast<void*>(this), [this](void*) { Leave(); });
+    }
+
+    // Refuses new requests and waits until the running ones are done.
+    // Returns false if they did not finish in time.
+    bool Drain(std::chrono::milliseconds timeout) {
+      std::unique_lock<std::mutex> l(mtx_);
+      draining_ = true;
+      return cond_.wait_for(l, timeout, [this] { return count_ == 0; });
+    }
+
+    int Count() {
+      std::lock_guard<std::mutex> l(mtx_);
+      return count_;
+    }
+
+   private:
+    void Leave() {
+      {
+        std::lock_guard<std::mutex> l(mtx_);
+        count_--;
+      }
+      cond_.notify_all();
+    }
+
+    std::mutex mtx_;
+    std::condition_variable cond_;
+    int count_ = 0;
+    bool draining_ = false;
+  };
+
+  // Set by a signal or DELETE /destroy, waited on by the main thread
+  struct ShutdownSignal {
+    void Request() {
+      {
+        std::lock_guard<std::mutex> l(mtx);
+        requested = true;
+      }
+      cond.notify_all();
+    }
+
+    void Wait() {
       std::unique_lock<std::mutex> l(mtx);
-      cond.wait(l, [this] { return !q.empty(); });
-      auto res = q.front();
-      q.pop();
-      return res;
+      cond.wait(l, [this] { return requested; });
     }
 
     std::mutex mtx;
     std::condition_variable cond;
-    // Status and result
-    std::queue<std::pair<Json::Value, Json::Value>> q;
+    bool requested = false;
   };
 };
 
@@ -63,7 +163,133 @@ inline void signal_handler(int signal) {
   shutdown_handler(signal);
 }
 
-using SyncQueue = Server::SyncQueue;
+using Completion = Server::Completion;
+using StreamChannel = Server::StreamChannel;
+using InFlight = Server::InFlight;
+
+namespace {
+// How long shutdown waits for in-flight requests before closing sockets
+constexpr auto kDrainTimeout = std::chrono::seconds(30);
+// Upper bound for a stream provider to notice that the server is stopping
+constexpr auto kStreamPollInterval = std::chrono::milliseconds(100);
+constexpr int kDefaultHttpThreads = 5;
+
+// Compact JSON through a writer and buffer built once per thread, since
+// Json::StreamWriter is not thread safe.
+std::string to_compact_string(const Json::Value& v) {
+  thread_local std::unique_ptr<Json::StreamWriter> writer = [] {
+    Json::StreamWriterBuilder builder;
+    builder["indentation"] = "";
+    return std::unique_ptr<Json::StreamWriter>(builder.newStreamWriter());
+  }();
+  thread_local std::ostringstream os;
+  os.str("");
+  os.clear();
+  writer->write(v, &os);
+  return os.str();
+}
+
+void set_json_res(httplib::Response& resp, const Json::Value& status,
+                  const Json::Value& res) {
+  resp.set_content(to_compact_string(res), "application/json; charset=utf-8");
+  resp.status = status["status_code"].asInt();
+}
+
+// Collects the fields of a multipart upload into a request body while the
+// "file" part is streamed to a temp directory through a fixed size buffer,
+// so memory does not grow with the upload. The directory is removed with
+// the spool, after the engine is done with the file.
+class UploadSpool {
+ public:
+  explicit UploadSpool(Json::Value& body) : body_(body) {}
+
+  ~UploadSpool() {
+    EndPart();
+    if (!dir_.empty()) {
+      std::error_code ec;
+      std::filesystem::remove_all(dir_, ec);
+    }
+  }
+
+  bool OnPart(const httplib::MultipartFormData& part) {
+    EndPart();
+    name_ = part.name;
+    if (name_ != "file") {
+      return true;
+    }
+    if (!dir_.empty()) {
+      // one audio file per request
+      LOG_ERROR << "Request has more than one file part";
+      name_.clear();
+      return false;
+    }
+
+    static std::atomic<uint64_t> seq = 0;
+    dir_ = std::filesystem::temp_directory_path() /
+           ("cortex-audio-" +
+            std::to_string(
+                std::chrono::duration_cast<std::chrono::milliseconds>(
+                    std::chrono::system_clock::now().time_since_epoch())
+                    .count()) +
+            "-" + std::to_string(seq++));
+    std::error_code ec;
+    std::filesystem::create_directories(dir_, ec);
+    // Keep the original name for its extension, never its directories
+    auto name = std::filesystem::path(part.filename).filename();
+    if (name.empty()) {
+      name = "audio";
+    }
+    auto path = dir_ / name;
+
+    buffer_.resize(kBufferSize);
+    file_.rdbuf()->pubsetbuf(buffer_.data(), buffer_.size());
+    file_.open(path, std::ios::binary);
+    if (!file_.is_open()) {
+      LOG_ERROR << "Save file failed: " << path.string();
+      return false;
+    }
+    LOG_INFO << "Save file to " << path.string();
+    body_[name_] = path.string();
+    return true;
+  }
+
+  bool OnData(const char* data, size_t len) {
+    if (file_.is_open()) {
+      file_.write(data, len);
+      return file_.good();
+    }
+    value_.append(data, len);
+    return true;
+  }
+
+ private:
+  static constexpr size_t kBufferSize = 1 << 20;
+
+  void EndPart() {
+    if (file_.is_open()) {
+      file_.close();
+    } else if (!name_.empty()) {
+      body_[name_] = std::move(value_);
+    }
+    name_.clear();
+    value_.clear();
+  }
+
+  Json::Value& body_;
+  std::string name_;
+  std::string value_;
+  std::filesystem::path dir_;
+  std::vector<char> buffer_;
+  std::ofstream file_;
+};
+
+void set_shutting_down_res(httplib::Response& resp) {
+  Json::Value res;
+  res["message"] = "Server is shutting down";
+  resp.set_content(to_compact_string(res), "application/json; charset=utf-8");
+  resp.status = httplib::StatusCode::ServiceUnavailable_503;
+}
+}  // namespace
 
 int main(int argc, char** argv) {
   std::string hostname = "127.0.0.1";
@@ -77,7 +303,34 @@ int main(int argc, char** argv) {
     port = std::atoi(argv[2]);  // Convert string argument to int
   }
 
+  // Number of HTTP worker threads
+  int n_threads = kDefaultHttpThreads;
+  if (argc > 3) {
+    n_threads = (std::max)(1, std::atoi(argv[3]));
+  }
+
+  // CPUs for request handling, e.g. "0-1". The HTTP threads, and the ffmpeg
+  // children they start, stay on them; loadmodel's "inference_cpus" gives
+  // the model the others.
+  std::vector<int> io_cpus;
+  if (argc > 4) {
+    io_cpus = cpu_topology::ParseCpuList(argv[4]);
+  }
+
+#if defined(__unix__) || (defined(__APPLE__) && defined(__MACH__))
+  // Signals are handled on a dedicated thread (below) rather than in a
+  // signal handler, so that shutdown can go through a condition variable.
+  // Blocked before any thread starts, so every thread inherits the mask.
+  sigset_t shutdown_signals;
+  sigemptyset(&shutdown_signals);
+  sigaddset(&shutdown_signals, SIGINT);
+  sigaddset(&shutdown_signals, SIGTERM);
+  pthread_sigmask(SIG_BLOCK, &shutdown_signals, nullptr);
+#endif
+
   Server server;
+  Server::ShutdownSignal shutdown;
+  InFlight in_flight;
   Json::Reader r;
   auto svr = std::make_unique<httplib::Server>();
 
@@ -87,26 +340,42 @@ int main(int argc, char** argv) {
     return 1;
   }
 
-  auto process_non_stream_res = [&server](httplib::Response& resp,
-                                          SyncQueue& q) {
-    auto [status, res] = q.wait_and_pop();
-    resp.set_content(res.toStyledString().c_str(),
-                     "application/json; charset=utf-8");
-    resp.status = status["status_code"].asInt();
+  auto process_non_stream_res = [](httplib::Response& resp,
+                                   Completion& completion) {
+    auto [status, res] = completion.Wait();
+    if (status["is_raw"].asBool() && res.isString()) {
+      // pre-serialized by the engine, written without another round trip
+      const char* begin = nullptr;
+      const char* end = nullptr;
+      res.getString(&begin, &end);
+      resp.set_content(begin, end - begin, status["content_type"].asString());
+      resp.status = status["status_code"].asInt();
+      return;
+    }
+    set_json_res(resp, status, res);
   };
 
-  auto process_stream_res = [&server](httplib::Response& resp,
-                                      std::shared_ptr<SyncQueue> q) {
+  // |token| keeps the request in flight until the stream has been written
+  auto process_stream_res = [](httplib::Response& resp,
+                               std::shared_ptr<StreamChannel> channel,
+                               InFlight::Token token) {
     const auto chunked_content_provider =
-        [&server, q](size_t size, httplib::DataSink& sink) {
-          while (true) {
-            auto [status, res] = q->wait_and_pop();
-            auto str = res["data"].asString();
+        [channel, token, events = std::deque<Server::Event>()](
+            size_t size, httplib::DataSink& sink) mutable {
+          // Returning without writing makes httplib call again, after it has
+          // checked for shutdown and a closed connection.
+          channel->PopAll(events, kStreamPollInterval);
+          while (!events.empty()) {
+            auto [status, res] = std::move(events.front());
+            events.pop_front();
+            // errors raised before streaming started carry a message only
+            auto str = res.isMember("data") ? res["data"].asString()
+                                            : to_compact_string(res);
             LOG_TRACE << "data: " << str;
 
             if (!sink.write(str.c_str(), str.size())) {
               LOG_WARN << "Failed to write";
-              //   return false;
+              return false;
             }
             if (status["has_error"].asBool() || status["is_done"].asBool()) {
               LOG_INFO << "Done";
@@ -114,7 +383,6 @@ int main(int argc, char** argv) {
               break;
             }
           }
-
           return true;
         };
     resp.set_chunked_content_provider("text/event-stream",
@@ -122,6 +390,20 @@ int main(int argc, char** argv) {
                                       [](bool) { LOG_INFO << "Done"; });
   };
 
+  // Refuses requests once shutdown has started and keeps the others counted
+  // until their handler returns.
+  const auto tracked = [&in_flight](httplib::Server::Handler handler) {
+    return [&in_flight, handler = std::move(handler)](
+               const httplib::Request& req, httplib::Response& resp) {
+      auto token = in_flight.Enter();
+      if (!token) {
+        set_shutting_down_res(resp);
+        return;
+      }
+      handler(req, resp);
+    };
+  };
+
   const auto handle_load_model = [&](const httplib::Request& req,
                                      httplib::Response& resp) {
     resp.set_header("Access-Control-Allow-Origin",
@@ -129,10 +411,8 @@ int main(int argc, char** argv) {
     auto req_body = std::make_shared<Json::Value>();
     r.parse(req.body, *req_body);
     server.engine_->LoadModel(
-        req_body, [&server, &resp](Json::Value status, Json::Value res) {
-          resp.set_content(res.toStyledString().c_str(),
-                           "application/json; charset=utf-8");
-          resp.status = status["status_code"].asInt();
+        req_body, [&resp](Json::Value&& status, Json::Value&& res) {
+          set_json_res(resp, status, res);
         });
   };
 
@@ -143,71 +423,106 @@ int main(int argc, char** argv) {
     auto req_body = std::make_shared<Json::Value>();
     r.parse(req.body, *req_body);
     server.engine_->UnloadModel(
-        req_body, [&server, &resp](Json::Value status, Json::Value res) {
-          resp.set_content(res.toStyledString().c_str(),
-                           "application/json; charset=utf-8");
-          resp.status = status["status_code"].asInt();
+        req_body, [&resp](Json::Value&& status, Json::Value&& res) {
+          set_json_res(resp, status, res);
         });
   };
 
-  const auto handle_transcriptions = [&](const httplib::Request& req,
-                                         httplib::Response& resp) {
-    resp.set_header("Access-Control-Allow-Origin",
-                    req.get_header_value("Origin"));
-    auto req_body = std::make_shared<Json::Value>();
-    LOG_INFO << "handle_transcriptions";
-    for (auto [id, f] : req.files) {
-      LOG_INFO << id;
-      if (id == "file") {
-        // Save input file to temp location
-        std::string temp_dir =
-            std::filesystem::temp_directory_path().string() + "/" +
-            std::to_string(
-                std::chrono::duration_cast<std::chrono::milliseconds>(
-                    std::chrono::system_clock::now().time_since_epoch())
-                    .count());
-        // Create the directory
-        std::filesystem::create_directory(temp_dir);
-        // Save the file to the directory, with its original name
-        std::string temp_file_path = temp_dir + "/" + f.filename;
-        std::ofstream file(temp_file_path, std::ios::binary);
-        if (file.is_open()) {
-          LOG_INFO << "Save file to " << temp_file_path;
-          file.write(f.content.c_str(), f.content.size());
-          file.close();
-        } else {
-          LOG_ERROR << "Save file failed";
-        }
-        (*req_body)[id] = temp_file_path;
-      } else {
-        (*req_body)[id] = f.content;
+  // Handler for an engine call taking an audio upload. Reads the body as it
+  // arrives instead of letting httplib buffer the whole upload; see
+  // UploadSpool.
+  using EngineCall = void (EngineI::*)(
+      std::shared_ptr<Json::Value>,
+      std::function<void(Json::Value&&, Json::Value&&)>&&);
+  const auto upload_handler = [&](EngineCall call, const char* name) {
+    return [&, call, name](const httplib::Request& req, httplib::Response& resp,
+                           const httplib::ContentReader& content_reader) {
+      resp.set_header("Access-Control-Allow-Origin",
+                      req.get_header_value("Origin"));
+      auto token = in_flight.Enter();
+      if (!token) {
+        set_shutting_down_res(resp);
+        return;
       }
-    }
-
-    LOG_INFO << req_body->toStyledString();
-    // This is an async call, need to use queue
-    auto q = std::make_shared<SyncQueue>();
-    server.engine_->CreateTranscription(
-        req_body, [&server, q](Json::Value status, Json::Value res) {
-          q->push(std::make_pair(status, res));
+      auto req_body = std::make_shared<Json::Value>();
+      LOG_INFO << name;
+      UploadSpool spool(*req_body);
+      bool ok = true;
+      if (req.is_multipart_form_data()) {
+        ok = content_reader(
+            [&spool](const httplib::MultipartFormData& part) {
+              return spool.OnPart(part);
+            },
+            [&spool](const char* data, size_t len) {
+              return spool.OnData(data, len);
+            });
+      } else {
+        std::string body;
+        ok = content_reader([&body](const char* data, size_t len) {
+          body.append(data, len);
+          return true;
         });
+        ok = ok && Json::Reader().parse(body, *req_body);
+      }
+      if (!ok) {
+        Json::Value res;
+        res["message"] = "Could not read request body";
+        resp.set_content(to_compact_string(res),
+                         "application/json; charset=utf-8");
+        resp.status = httplib::StatusCode::BadRequest_400;
+        return;
+      }
 
-    process_non_stream_res(resp, *q);
+      // only serialized when debug logging is on
+      LOG_DEBUG << to_compact_string(*req_body);
+      (*req_body)["raw_response"] = true;
+      auto completion = std::make_shared<Completion>();
+      (server.engine_->*call)(
+          req_body, [completion](Json::Value&& status, Json::Value&& res) {
+            completion->Set(std::move(status), std::move(res));
+          });
+
+      process_non_stream_res(resp, *completion);
+    };
   };
 
+  const auto handle_transcriptions =
+      upload_handler(&EngineI::CreateTranscription, "handle_transcriptions");
+  const auto handle_language_detection =
+      upload_handler(&EngineI::DetectLanguage, "handle_language_detection");
+
   const auto handle_translations = [&](const httplib::Request& req,
                                        httplib::Response& resp) {
     resp.set_header("Access-Control-Allow-Origin",
                     req.get_header_value("Origin"));
     auto req_body = std::make_shared<Json::Value>();
     r.parse(req.body, *req_body);
-    // This is an async call, need to use queue
-    SyncQueue q;
+    auto completion = std::make_shared<Completion>();
     server.engine_->HandleEmbedding(
-        req_body, [&server, &q](Json::Value status, Json::Value res) {
-          q.push(std::make_pair(status, res));
+        req_body, [completion](Json::Value&& status, Json::Value&& res) {
+          completion->Set(std::move(status), std::move(res));
+        });
+    process_non_stream_res(resp, *completion);
+  };
+
+  const auto handle_batch_transcriptions = [&](const httplib::Request& req,
+                                               httplib::Response& resp) {
+    resp.set_header("Access-Control-Allow-Origin",
+                    req.get_header_value("Origin"));
+    auto token = in_flight.Enter();
+    if (!token) {
+      set_shutting_down_res(resp);
+      return;
+    }
+    auto req_body = std::make_shared<Json::Value>();
+    r.parse(req.body, *req_body);
+    // Progress is streamed, one event per finished file
+    auto channel = std::make_shared<StreamChannel>();
+    server.engine_->CreateBatchTranscription(
+        req_body, [channel](Json::Value&& status, Json::Value&& res) {
+          channel->Push(std::move(status), std::move(res));
         });
-    process_non_stream_res(resp, q);
+    process_stream_res(resp, channel, std::move(token));
   };
 
   const auto handle_get_model_status = [&](const httplib::Request& req,
@@ -217,10 +532,8 @@ int main(int argc, char** argv) {
     auto req_body = std::make_shared<Json::Value>();
     r.parse(req.body, *req_body);
     server.engine_->GetModelStatus(
-        req_body, [&server, &resp](Json::Value status, Json::Value res) {
-          resp.set_content(res.toStyledString().c_str(),
-                           "application/json; charset=utf-8");
-          resp.status = status["status_code"].asInt();
+        req_body, [&resp](Json::Value&& status, Json::Value&& res) {
+          set_json_res(resp, status, res);
         });
   };
 
@@ -231,33 +544,38 @@ int main(int argc, char** argv) {
     auto req_body = std::make_shared<Json::Value>();
     r.parse(req.body, *req_body);
     server.engine_->GetModels(
-        req_body, [&server, &resp](Json::Value status, Json::Value res) {
-          resp.set_content(res.toStyledString().c_str(),
-                           "application/json; charset=utf-8");
-          resp.status = status["status_code"].asInt();
+        req_body, [&resp](Json::Value&& status, Json::Value&& res) {
+          set_json_res(resp, status, res);
         });
   };
 
-  svr->Post("/loadmodel", handle_load_model);
+  svr->Post("/loadmodel", tracked(handle_load_model));
   // Use POST since httplib does not read request body for GET method
-  svr->Post("/unloadmodel", handle_unload_model);
+  svr->Post("/unloadmodel", tracked(handle_unload_model));
   svr->Post("/v1/audio/transcriptions", handle_transcriptions);
-  svr->Post("/v1/audio/translations", handle_translations);
-  svr->Post("/modelstatus", handle_get_model_status);
-  svr->Get("/models", handle_get_running_models);
-  std::atomic<bool> running = true;
+  svr->Post("/v1/audio/language", handle_language_detection);
+  svr->Post("/v1/audio/translations", tracked(handle_translations));
+  svr->Post("/v1/audio/batches", handle_batch_transcriptions);
+  svr->Post("/modelstatus", tracked(handle_get_model_status));
+  svr->Get("/models", tracked(handle_get_running_models));
   svr->Delete("/destroy",
               [&](const httplib::Request& req, httplib::Response& resp) {
                 LOG_INFO << "Received Stop command";
-                running = false;
+                shutdown.Request();
               });
 
-  LOG_INFO << "HTTP server listening: " << hostname << ":" << port;
-  svr->new_task_queue = [] {
-    return new httplib::ThreadPool(5);
+  LOG_INFO << "HTTP server listening: " << hostname << ":" << port << " with "
+           << n_threads << " thread(s)";
+  svr->new_task_queue = [n_threads] {
+    return new httplib::ThreadPool(n_threads);
   };
-  // run the HTTP server in a thread - see comment below
+  // run the HTTP server in a thread - see comment below. Its worker pool is
+  // created by listen, so the pool inherits the pinning and the name.
   std::thread t([&]() {
+    if (!io_cpus.empty()) {
+      cpu_topology::PinCurrentThread(io_cpus);
+    }
+    cpu_topology::SetCurrentThreadName("http");
     if (!svr->listen_after_bind()) {
       return 1;
     }
@@ -266,16 +584,18 @@ int main(int argc, char** argv) {
   });
 
   shutdown_handler = [&](int) {
-    running = false;
+    shutdown.Request();
   };
 #if defined(__unix__) || (defined(__APPLE__) && defined(__MACH__))
-  struct sigaction sigint_action;
-  sigint_action.sa_handler = signal_handler;
-  sigemptyset(&sigint_action.sa_mask);
-  sigint_action.sa_flags = 0;
-  sigaction(SIGINT, &sigint_action, NULL);
-  sigaction(SIGTERM, &sigint_action, NULL);
+  std::thread([&shutdown_signals] {
+    cpu_topology::SetCurrentThreadName("signals");
+    int signal = 0;
+    while (sigwait(&shutdown_signals, &signal) == 0) {
+      signal_handler(signal);
+    }
+  }).detach();
 #elif defined(_WIN32)
+  // Console control handlers run on their own thread
   auto console_ctrl_handler = +[](DWORD ctrl_type) -> BOOL {
     return (ctrl_type == CTRL_C_EVENT) ? (signal_handler(SIGINT), true) : false;
   };
@@ -283,12 +603,16 @@ int main(int argc, char** argv) {
       reinterpret_cast<PHANDLER_ROUTINE>(console_ctrl_handler), true);
 #endif
 
-  while (running) {
-    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+  shutdown.Wait();
+  LOG_INFO << "Shutting down, waiting for " << in_flight.Count()
+           << " request(s) in flight";
+  if (!in_flight.Drain(kDrainTimeout)) {
+    LOG_WARN << "Requests still in flight after " << kDrainTimeout.count()
+             << "s, closing connections";
   }
 
   svr->stop();
   t.join();
   LOG_DEBUG << "Server shutdown";
   return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,87 @@
+#include "audio_buffer_pool.h"
+
+#include <algorithm>
+
+size_t AudioBuffers::Size() const {
+  size_t size = pcmf32.size() * sizeof(float) + pcm16.size() * sizeof(int16_t);
+  for (const auto& channel : pcmf32s) {
+    size += channel.size() * sizeof(float);
+  }
+  return size;
+}
+
+size_t AudioBuffers::Capacity() const {
+  size_t capacity =
+      pcmf32.capacity() * sizeof(float) + pcm16.capacity() * sizeof(int16_t);
+  for (const auto& channel : pcmf32s) {
+    capacity += channel.capacity() * sizeof(float);
+  }
+  return capacity;
+}
+
+AudioBufferPool::Lease AudioBufferPool::Acquire() {
+  std::unique_ptr<AudioBuffers> buffers;
+  {
+    std::lock_guard<std::mutex> l(mtx_);
+    stats_.acquired++;
+    if (!idle_.empty()) {
+      // the most recently returned set is the most likely to be warm
+      buffers = std::move(idle_.back());
+      idle_.pop_back();
+      stats_.reused++;
+    }
+  }
+  if (!buffers) {
+    buffers = std::make_unique<AudioBuffers>();
+  }
+  return Lease(buffers.release(), [this](AudioBuffers* b) { Release(b); });
+}
+
+void AudioBufferPool::SetMaxIdle(size_t max_idle) {
+  std::lock_guard<std::mutex> l(mtx_);
+  max_idle_ = max_idle;
+  if (idle_.size() > max_idle_) {
+    idle_.resize(max_idle_);
+  }
+}
+
+AudioBufferPool::Stats AudioBufferPool::GetStats() const {
+  std::lock_guard<std::mutex> l(mtx_);
+  Stats stats = stats_;
+  stats.idle = idle_.size();
+  for (const auto& b : idle_) {
+    stats.idle_bytes += b->Capacity();
+  }
+  stats.high_water_bytes = (std::max)(high_water_, window_peak_);
+  return stats;
+}
+
+void AudioBufferPool::Release(AudioBuffers* buffers) {
+  std::unique_ptr<AudioBuffers> owned(buffers);
+  const size_t used = owned->Size();
+  const size_t capacity = owned->Capacity();
+
+  // contents are dead, capacity is what gets reused
+  owned->pcmf32.clear();
+  for (auto& channel : owned->pcmf32s) {
+    channel.clear();
+  }
+  owned->pcm16.clear();
+
+  std::lock_guard<std::mutex> l(mtx_);
+  window_peak_ = (std::max)(window_peak_, used);
+  if (++window_count_ >= kWindow) {
+    high_water_ = window_peak_;
+    window_peak_ = 0;
+    window_count_ = 0;
+  }
+
+  const size_t mark = (std::max)(high_water_, window_peak_);
+  if (idle_.size() >= max_idle_ ||
+      (capacity > kMinTrimBytes && capacity > 2 * mark)) {
+    // |owned| frees the buffers on return
+    stats_.trimmed++;
+    return;
+  }
+  idle_.push_back(std::move(owned));
+}
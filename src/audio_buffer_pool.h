@@ -0,0 +1,65 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+// Decoder output and scratch buffers for one request.
+struct AudioBuffers {
+  std::vector<float> pcmf32;                // mono-channel F32 PCM
+  std::vector<std::vector<float>> pcmf32s;  // stereo-channel F32 PCM
+  std::vector<int16_t> pcm16;               // interleaved samples as read
+
+  // Bytes in use and bytes allocated
+  size_t Size() const;
+  size_t Capacity() const;
+};
+
+// Reuses AudioBuffers across requests, so steady load does not allocate and
+// free whole-file buffers for every request.
+//
+// Trim policy: the pool tracks the high-water mark of the bytes requests
+// actually used over the last kWindow returns. A returned buffer set whose
+// capacity is more than twice that mark (one unusually long file) is freed
+// instead of kept, and at most |max_idle| sets are kept idle.
+class AudioBufferPool {
+ public:
+  struct Stats {
+    uint64_t acquired = 0;
+    // acquisitions served by an idle buffer set
+    uint64_t reused = 0;
+    // buffer sets freed by the trim policy
+    uint64_t trimmed = 0;
+    size_t idle = 0;
+    size_t idle_bytes = 0;
+    size_t high_water_bytes = 0;
+  };
+
+  using Lease =
+      std::unique_ptr<AudioBuffers, std::function<void(AudioBuffers*)>>;
+
+  explicit AudioBufferPool(size_t max_idle = 4) : max_idle_(max_idle) {}
+
+  // The buffers go back to the pool when the lease is destroyed.
+  Lease Acquire();
+
+  void SetMaxIdle(size_t max_idle);
+  Stats GetStats() const;
+
+ private:
+  static constexpr int kWindow = 64;
+  // buffers below this size are always kept
+  static constexpr size_t kMinTrimBytes = 16 << 20;
+
+  void Release(AudioBuffers* buffers);
+
+  mutable std::mutex mtx_;
+  std::vector<std::unique_ptr<AudioBuffers>> idle_;
+  size_t max_idle_;
+  size_t high_water_ = 0;
+  size_t window_peak_ = 0;
+  int window_count_ = 0;
+  Stats stats_;
+};
@@ -1,7 +1,9 @@
 #include "audio_engine.h"
 
+#include <algorithm>
 #include <chrono>
 #include <filesystem>
+#include "batch_transcription_job.h"
 #include "json/writer.h"
 #include "trantor/utils/Logger.h"
 #include "utils.h"
@@ -11,18 +13,39 @@ constexpr const int k200OK = 200;
 constexpr const int k400BadRequest = 400;
 constexpr const int k409Conflict = 409;
 constexpr const int k500InternalServerError = 500;
+// Rejected up front: the estimated completion time misses the deadline.
+constexpr const int k503ServiceUnavailable = 503;
+// Admitted, but the deadline passed while queued or during inference.
+constexpr const int k504GatewayTimeout = 504;
+
+// Number of batch jobs that can run at the same time, others wait.
+constexpr const int kMaxConcurrentBatchJobs = 2;
 
 constexpr const auto kTypeF16 = "f16";
 constexpr const auto kType_Q8_0 = "q8_0";
+constexpr const auto kType_Q5_1 = "q5_1";
 constexpr const auto kType_Q4_0 = "q4_0";
 
 bool IsValidCacheType(const std::string& c) {
-  if (c != kTypeF16 && c != kType_Q8_0 && c != kType_Q4_0) {
+  if (c != kTypeF16 && c != kType_Q8_0 && c != kType_Q5_1 &&
+      c != kType_Q4_0) {
     return false;
   }
   return true;
 }
 
+Json::Value FallbackJson(const FallbackStats& stats) {
+  Json::Value json;
+  json["windows"] = Json::Int64(stats.windows);
+  json["fallback_windows"] = Json::Int64(stats.fallback_windows);
+  json["fallback_passes"] = Json::Int64(stats.fallback_passes);
+  json["recovered"] = Json::Int64(stats.recovered);
+  json["exhausted"] = Json::Int64(stats.exhausted);
+  json["decode_ms"] = Json::Int64(stats.decode_ms);
+  json["fallback_ms"] = Json::Int64(stats.fallback_ms);
+  return json;
+}
+
 Json::Value CreateEmbeddingPayload(const std::vector<float>& embedding,
                                    int prompt_tokens) {
   Json::Value dataItem;
@@ -39,42 +62,6 @@ Json::Value CreateEmbeddingPayload(const std::vector<float>& embedding,
   return dataItem;
 }
 
-Json::Value CreateFullReturnJson(const std::string& id,
-                                 const std::string& model,
-                                 const std::string& content,
-                                 const std::string& system_fingerprint,
-                                 int prompt_tokens, int completion_tokens,
-                                 Json::Value finish_reason = Json::Value()) {
-  Json::Value root;
-
-  root["id"] = id;
-  root["model"] = model;
-  root["created"] = static_cast<int>(std::time(nullptr));
-  root["object"] = "chat.completion";
-  root["system_fingerprint"] = system_fingerprint;
-
-  Json::Value choicesArray(Json::arrayValue);
-  Json::Value choice;
-
-  choice["index"] = 0;
-  Json::Value message;
-  message["role"] = "assistant";
-  message["content"] = content;
-  choice["message"] = message;
-  choice["finish_reason"] = finish_reason;
-
-  choicesArray.append(choice);
-  root["choices"] = choicesArray;
-
-  Json::Value usage;
-  usage["prompt_tokens"] = prompt_tokens;
-  usage["completion_tokens"] = completion_tokens;
-  usage["total_tokens"] = prompt_tokens + completion_tokens;
-  root["usage"] = usage;
-
-  return root;
-}
-
 std::string CreateReturnJson(const std::string& id, const std::string& model,
                              const std::string& content,
                              Json::Value finish_reason = Json::Value()) {
@@ -106,9 +93,23 @@ std::string CreateReturnJson(const std::string& id, const std::string& model,
 
 AudioEngine::AudioEngine() {
   // log_disable();
+  batch_queue_ = std::make_unique<trantor::ConcurrentTaskQueue>(
+      kMaxConcurrentBatchJobs, "BatchTranscription");
+  if (FfmpegDecoderPool::Supported()) {
+    audio_cache_ = std::make_shared<ConvertedAudioCache>(
+        [pool = decoder_pool_](const std::string& input,
+                               const std::string& output,
+                               std::string& error) {
+          return pool->DecodeToWav(input, output, error);
+        });
+  }
 }
 
-AudioEngine::~AudioEngine() {}
+AudioEngine::~AudioEngine() {
+  // running batch jobs stop after their in-flight files
+  stop_batches_ = true;
+  batch_queue_.reset();
+}
 
 void AudioEngine::CreateTranscription(
     std::shared_ptr<Json::Value> json_body,
@@ -131,6 +132,147 @@ void AudioEngine::CreateTranslation(
   }
 }
 
+void AudioEngine::CreateBatchTranscription(
+    std::shared_ptr<Json::Value> json_body,
+    std::function<void(Json::Value&&, Json::Value&&)>&& callback) {
+  auto model_id = utils::GetModelId(*json_body);
+  if (!CheckModelLoaded(callback, model_id)) {
+    return;
+  }
+
+  std::string batch_dir;
+  {
+    std::lock_guard<std::mutex> l(server_map_mtx_);
+    if (auto si = server_map_.find(model_id); si != server_map_.end()) {
+      batch_dir = si->second.batch_dir;
+    }
+  }
+  auto job = std::make_shared<BatchTranscriptionJob>();
+  std::string err =
+      batch_dir.empty()
+          ? "Batch jobs are disabled for model " + model_id +
+                ", load it with batch_dir to enable them"
+          : job->FromJson(*json_body, batch_dir);
+  if (!err.empty()) {
+    LOG_ERROR << err;
+    Json::Value jsonResp;
+    jsonResp["message"] = err;
+    Json::Value status;
+    status["is_done"] = false;
+    status["has_error"] = true;
+    status["is_stream"] = false;
+    status["status_code"] = k400BadRequest;
+    callback(std::move(status), std::move(jsonResp));
+    return;
+  }
+
+  batch_queue_->runTaskInQueue([this, job, model_id, cb = std::move(callback)] {
+    auto send = [&cb](const Json::Value& data, bool is_done, bool has_error) {
+      Json::StreamWriterBuilder writer;
+      writer["indentation"] = "";
+      Json::Value resp;
+      resp["data"] = "data: " + Json::writeString(writer, data) + "\n\n";
+      Json::Value status;
+      status["is_done"] = is_done;
+      status["has_error"] = has_error;
+      status["is_stream"] = true;
+      status["status_code"] = has_error ? k500InternalServerError : k200OK;
+      cb(std::move(status), std::move(resp));
+    };
+
+    // the model stays loaded until the job is done
+    WhisperServerContext* ctx = nullptr;
+    {
+      std::lock_guard<std::mutex> l(server_map_mtx_);
+      auto si = server_map_.find(model_id);
+      if (si != server_map_.end() && si->second.model_loaded) {
+        ctx = &si->second.ctx;
+        running_batches_[model_id]++;
+      }
+    }
+    if (ctx == nullptr) {
+      Json::Value err;
+      err["message"] = "Model " + model_id + " was unloaded";
+      return send(err, true, true);
+    }
+
+    LOG_INFO << "Batch job started, writing results to " << job->output_path();
+    auto summary = job->Run(
+        *ctx, stop_batches_,
+        [&send](const Json::Value& line) { send(line, false, false); });
+    {
+      std::lock_guard<std::mutex> l(server_map_mtx_);
+      if (--running_batches_[model_id] == 0) {
+        running_batches_.erase(model_id);
+      }
+    }
+    bool has_error = summary["has_error"].asBool();
+    summary.removeMember("has_error");
+    send(summary, true, has_error);
+    LOG_INFO << "Batch job finished: " << job->output_path();
+  });
+}
+
+void AudioEngine::DetectLanguage(
+    std::shared_ptr<Json::Value> json_body,
+    std::function<void(Json::Value&&, Json::Value&&)>&& callback) {
+  auto model_id = utils::GetModelId(*json_body);
+  if (!CheckModelLoaded(callback, model_id)) {
+    return;
+  }
+  auto req = audio::inferences::fromJson(json_body);
+  // languages returned, most likely first
+  const int top_k = (std::max)(
+      1, static_cast<int>(
+             audio::inferences::GetNumber(*json_body, "top_k", 5)));
+
+  Json::Value jsonResp;
+  Json::Value status;
+  status["is_done"] = false;
+  status["has_error"] = true;
+  status["is_stream"] = false;
+  if (req.file.empty()) {
+    LOG_ERROR << "audio file not found";
+    jsonResp["message"] = "No audio file found in request body";
+    status["status_code"] = k400BadRequest;
+    callback(std::move(status), std::move(jsonResp));
+    return;
+  }
+
+  try {
+    auto result = server_map_[model_id].ctx.DetectLanguage(req);
+    jsonResp["language"] = result.languages.front().first;
+    jsonResp["probability"] = result.languages.front().second;
+    jsonResp["languages"] = Json::Value(Json::arrayValue);
+    for (int i = 0; i < top_k && i < int(result.languages.size()); i++) {
+      Json::Value language;
+      language["language"] = result.languages[i].first;
+      language["probability"] = result.languages[i].second;
+      jsonResp["languages"].append(language);
+    }
+    jsonResp["audio_ms"] = Json::Int64(result.audio_ms);
+    jsonResp["processing_ms"] = Json::Int64(result.processing_ms);
+    status["is_done"] = true;
+    status["has_error"] = false;
+    status["status_code"] = k200OK;
+  } catch (const std::invalid_argument& e) {
+    jsonResp["message"] = e.what();
+    status["status_code"] = k400BadRequest;
+  } catch (const DecoderSaturatedError& e) {
+    jsonResp["message"] = e.what();
+    status["status_code"] = k503ServiceUnavailable;
+  } catch (const SchedulerStoppedError& e) {
+    LOG_WARN << e.what();
+    jsonResp["message"] = e.what();
+    status["status_code"] = k503ServiceUnavailable;
+  } catch (const std::exception& e) {
+    LOG_ERROR << e.what();
+    jsonResp["message"] = e.what();
+    status["status_code"] = k500InternalServerError;
+  }
+  callback(std::move(status), std::move(jsonResp));
+}
+
 void AudioEngine::LoadModel(
     std::shared_ptr<Json::Value> json_body,
     std::function<void(Json::Value&&, Json::Value&&)>&& callback) {
@@ -198,6 +340,21 @@ void AudioEngine::UnloadModel(
     std::function<void(Json::Value&&, Json::Value&&)>&& callback) {
   auto model_id = utils::GetModelId(*json_body);
   if (CheckModelLoaded(callback, model_id)) {
+    std::lock_guard<std::mutex> l(server_map_mtx_);
+    if (running_batches_.count(model_id)) {
+      LOG_WARN << "Model " << model_id << " has running batch jobs";
+      Json::Value jsonResp;
+      jsonResp["message"] = "Model " + model_id +
+                            " has running batch jobs, unload it when they "
+                            "are done";
+      Json::Value status;
+      status["is_done"] = false;
+      status["has_error"] = true;
+      status["is_stream"] = false;
+      status["status_code"] = k409Conflict;
+      callback(std::move(status), std::move(jsonResp));
+      return;
+    }
     server_map_.erase(model_id);
     server_map_[model_id].model_loaded = false;
     LOG_INFO << "Model unloaded successfully";
@@ -215,6 +372,125 @@ void AudioEngine::GetModelStatus(
     Json::Value jsonResp;
     jsonResp["model_loaded"] = is_loaded;
     jsonResp["model_data"] = "";
+
+    const auto pool = si->second.ctx.buffer_pool->GetStats();
+    Json::Value buffers;
+    buffers["acquired"] = Json::UInt64(pool.acquired);
+    buffers["reused"] = Json::UInt64(pool.reused);
+    buffers["trimmed"] = Json::UInt64(pool.trimmed);
+    buffers["idle"] = Json::UInt64(pool.idle);
+    buffers["idle_bytes"] = Json::UInt64(pool.idle_bytes);
+    buffers["high_water_bytes"] = Json::UInt64(pool.high_water_bytes);
+    jsonResp["metrics"]["audio_buffers"] = buffers;
+
+    const auto& tuning = si->second.ctx.thread_tuning;
+    Json::Value threads;
+    threads["source"] = tuning.source;
+    threads["n_parallel"] = tuning.n_parallel;
+    threads["n_threads"] = tuning.n_threads;
+    threads["trials"] = Json::Value(Json::arrayValue);
+    for (const auto& t : tuning.trials) {
+      Json::Value trial;
+      trial["n_parallel"] = t.n_parallel;
+      trial["n_threads"] = t.n_threads;
+      trial["encode_ms"] = t.encode_ms;
+      trial["throughput"] = t.throughput;
+      threads["trials"].append(trial);
+    }
+    jsonResp["metrics"]["threads"] = threads;
+
+    const auto& ctx = si->second.ctx;
+    Json::Value numa;
+    numa["enabled"] = !ctx.numa_nodes.empty();
+    numa["replicated_weights"] = !ctx.replicas.empty();
+    numa["nodes"] = Json::Value(Json::arrayValue);
+    for (size_t i = 0; i < ctx.numa_nodes.size(); i++) {
+      Json::Value node;
+      node["id"] = ctx.numa_nodes[i].id;
+      node["cpus"] = static_cast<int>(ctx.numa_nodes[i].cpus.size());
+      node["states"] = static_cast<int>(
+          std::count(ctx.state_nodes.begin(), ctx.state_nodes.end(), int(i)));
+      numa["nodes"].append(node);
+    }
+    jsonResp["metrics"]["numa"] = numa;
+
+    Json::Value cpus;
+    cpus["inference"] = static_cast<int>(ctx.worker_cpus.size());
+    cpus["io"] = static_cast<int>(ctx.io_cpus.size());
+    jsonResp["metrics"]["cpus"] = cpus;
+
+    jsonResp["metrics"]["mel_frontend"] = ctx.mel_frontend != nullptr;
+
+    // memory against speed: the weights' size next to the measured
+    // real-time factor of the model as loaded
+    const auto& quant = ctx.quantization;
+    Json::Value quantization;
+    quantization["type"] = quant.type.empty() ? kTypeF16 : quant.type;
+    quantization["source_type"] = quant.source_type;
+    quantization["path"] = quant.path;
+    quantization["cache_hit"] = quant.cache_hit;
+    quantization["requantize_ms"] = Json::Int64(quant.requantize_ms);
+    quantization["weights_bytes"] = Json::Int64(quant.weights_bytes);
+    quantization["source_weights_bytes"] =
+        Json::Int64(quant.source_weights_bytes);
+    quantization["real_time_factor"] = ctx.rtf.load();
+    jsonResp["metrics"]["quantization"] = quantization;
+
+    const auto converted = ctx.audio_cache->GetStats();
+    Json::Value audio_cache;
+    audio_cache["hits"] = Json::Int64(converted.hits);
+    audio_cache["misses"] = Json::Int64(converted.misses);
+    audio_cache["entries"] = Json::Int64(converted.entries);
+    audio_cache["bytes"] = Json::Int64(converted.bytes);
+    audio_cache["max_bytes"] = Json::Int64(converted.max_bytes);
+    jsonResp["metrics"]["audio_cache"] = audio_cache;
+
+    const auto decoding = decoder_pool_->GetStats();
+    Json::Value decoders;
+    decoders["decodes"] = Json::Int64(decoding.decodes);
+    decoders["failures"] = Json::Int64(decoding.failures);
+    decoders["path_fallbacks"] = Json::Int64(decoding.path_fallbacks);
+    decoders["waited"] = Json::Int64(decoding.waited);
+    decoders["rejected"] = Json::Int64(decoding.rejected);
+    decoders["spawned"] = Json::Int64(decoding.spawned);
+    decoders["idle"] = decoding.idle;
+    decoders["busy"] = decoding.busy;
+    decoders["waiting"] = decoding.waiting;
+    jsonResp["metrics"]["ffmpeg_decoders"] = decoders;
+
+    Json::Value preprocessing;
+    preprocessing["requests"] = Json::Int64(ctx.preprocessing->requests);
+    preprocessing["samples"] = Json::Int64(ctx.preprocessing->samples);
+    preprocessing["remove_dc_ms"] =
+        Json::Int64(ctx.preprocessing->remove_dc_us / 1000);
+    preprocessing["high_pass_ms"] =
+        Json::Int64(ctx.preprocessing->high_pass_us / 1000);
+    preprocessing["normalize_ms"] =
+        Json::Int64(ctx.preprocessing->normalize_us / 1000);
+    jsonResp["metrics"]["preprocessing"] = preprocessing;
+
+    Json::Value fallback = FallbackJson(ctx.fallback_policy->Totals());
+    fallback["adaptive"] = ctx.fallback_policy->adaptive();
+    fallback["tenants"] = Json::Value(Json::arrayValue);
+    for (const auto& t : ctx.fallback_policy->Tenants()) {
+      Json::Value tenant;
+      tenant["tenant"] = t.tenant;
+      tenant["mode"] = FallbackPolicy::ModeName(t.mode);
+      tenant["requests"] = Json::Int64(t.requests);
+      tenant["recovery_rate"] = t.recovery_rate;
+      tenant["fallback_share"] = t.fallback_share;
+      fallback["tenants"].append(tenant);
+    }
+    jsonResp["metrics"]["temperature_fallback"] = fallback;
+
+    const auto session_stats = ctx.sessions->GetStats();
+    Json::Value sessions;
+    sessions["hits"] = Json::Int64(session_stats.hits);
+    sessions["misses"] = Json::Int64(session_stats.misses);
+    sessions["expired"] = Json::Int64(session_stats.expired);
+    sessions["evicted"] = Json::Int64(session_stats.evicted);
+    sessions["sessions"] = Json::Int64(session_stats.sessions);
+    jsonResp["metrics"]["sessions"] = sessions;
     Json::Value status;
     status["is_done"] = true;
     status["has_error"] = false;
@@ -271,15 +547,108 @@ bool AudioEngine::LoadModelImpl(std::shared_ptr<Json::Value> json_body) {
     }
   }
 
+  // weights requantized at load from an f16 file, and cached next to it;
+  // "f16" loads the file as it is
+  const auto weights_type = (*json_body).get("quantize", kTypeF16).asString();
+  if (!IsValidCacheType(weights_type)) {
+    LOG_ERROR << "Unsupported weight type " << weights_type
+              << ", expected one of f16, q8_0, q5_1, q4_0";
+    return false;
+  }
+
+  {
+    // batch threads look models up concurrently
+    std::lock_guard<std::mutex> l(server_map_mtx_);
+    server_map_.try_emplace(model_id);
+  }
   server_map_[model_id].ctx.model_id = model_id;
+  server_map_[model_id].ctx.weights_type =
+      weights_type == kTypeF16 ? "" : weights_type;
+  // number of whisper states, i.e. requests processed in parallel, and
+  // compute threads per state; measured on this host with auto_tune_threads
+  server_map_[model_id].ctx.n_parallel_override =
+      (*json_body).get("n_parallel", 0).asInt();
+  server_map_[model_id].ctx.n_threads_override =
+      (*json_body).get("n_threads", 0).asInt();
+  server_map_[model_id].ctx.auto_tune_threads =
+      (*json_body).get("auto_tune_threads", false).asBool();
+  // pin states to NUMA nodes, optionally with a copy of the weights on each;
+  // no effect on single node hosts
+  server_map_[model_id].ctx.numa_enabled =
+      (*json_body).get("numa", true).asBool();
+  server_map_[model_id].ctx.numa_replicate_weights =
+      (*json_body).get("numa_replicate_weights", false).asBool();
+  // CPU list such as "2-15" for the inference workers, the other CPUs of
+  // the process are left to I/O and request handling
+  server_map_[model_id].ctx.inference_cpus = cpu_topology::ParseCpuList(
+      (*json_body).get("inference_cpus", "").asString());
+  // opt-in mel spectrogram on the engine's own FFT front end, checked
+  // against whisper's at load
+  server_map_[model_id].ctx.mel_frontend_enabled =
+      (*json_body).get("mel_frontend", false).asBool();
+  // less temperature fallback for latency sensitive tenants it rarely helps
+  server_map_[model_id].ctx.fallback_policy->SetAdaptive(
+      (*json_body).get("adaptive_fallback", false).asBool());
+  // context kept for requests naming a session
+  const auto max_sessions =
+      (*json_body)
+          .get("max_sessions", Json::UInt64(SessionCache::kDefaultMaxSessions))
+          .asUInt64();
+  const auto session_ttl_s =
+      (*json_body)
+          .get("session_ttl_s", Json::Int64(SessionCache::kDefaultTtl.count()))
+          .asInt64();
+  server_map_[model_id].ctx.sessions->SetLimits(
+      max_sessions, std::chrono::seconds(session_ttl_s));
+  // files at least this long are transcribed without decoding them whole
+  server_map_[model_id].ctx.params.stream_decode_min_ms =
+      (*json_body)
+          .get("stream_decode_min_ms",
+               server_map_[model_id].ctx.params.stream_decode_min_ms)
+          .asInt();
+  // batch jobs only read and write files under this directory, and are
+  // refused without it
+  server_map_[model_id].batch_dir =
+      (*json_body).get("batch_dir", "").asString();
+  // convert non-WAV inputs with ffmpeg; the converted files are cached on
+  // disk by content for every model, up to audio_cache_mb, in
+  // audio_cache_dir if set before the cache is first used; ffmpeg_workers
+  // processes decode at a time, and are kept started ahead
+  server_map_[model_id].ctx.params.ffmpeg_converter =
+      (*json_body).get("ffmpeg_converter", false).asBool();
+  if (json_body->isMember("ffmpeg_workers")) {
+    decoder_pool_->SetWorkers((*json_body)["ffmpeg_workers"].asInt());
+  }
+  if (json_body->isMember("audio_cache_dir") &&
+      !audio_cache_->SetDir((*json_body)["audio_cache_dir"].asString())) {
+    LOG_WARN << "audio_cache_dir ignored: converted audio is cached "
+             << "already";
+  }
+  if (json_body->isMember("audio_cache_mb")) {
+    audio_cache_->SetMaxBytes(
+        static_cast<uint64_t>(
+            (std::max)(0, (*json_body)["audio_cache_mb"].asInt()))
+        << 20);
+  }
+  server_map_[model_id].ctx.audio_cache = audio_cache_;
   auto model_path_str = model_path.asString();
   auto is_success = server_map_[model_id].ctx.LoadModel(model_path_str);
   if (!is_success) {
     LOG_ERROR << "Could not load model: " << model_path.asString();
+    std::lock_guard<std::mutex> l(server_map_mtx_);
     server_map_.erase(model_id);
     return false;
   }
 
+  // Relative shares of the model's workers per tenant, default weight is 1
+  if (json_body->isMember("tenant_weights")) {
+    const auto& weights = (*json_body)["tenant_weights"];
+    for (const auto& tenant : weights.getMemberNames()) {
+      server_map_[model_id].ctx.scheduler->SetTenantWeight(
+          tenant, weights[tenant].asDouble());
+    }
+  }
+
   // Warm up the model
   // Parse warm up audio path from request
   if (json_body->isMember("warm_up_audio_path")) {
@@ -297,8 +666,11 @@ bool AudioEngine::LoadModelImpl(std::shared_ptr<Json::Value> json_body) {
     } else {
       LOG_INFO << "Warming up model " << model_id << " with audio "
                << warm_up_audio_path << " ...";
-      std::string warm_up_result = server_map_[model_id].ctx.Inference(
-          warm_up_audio_path, "en", "", text_format, 0, false);
+      audio::inferences::TranscriptionRequest warm_up_req;
+      warm_up_req.file = warm_up_audio_path;
+      warm_up_req.response_format = text_format;
+      std::string warm_up_result =
+          server_map_[model_id].ctx.Inference(warm_up_req);
       LOG_INFO << "Warm up model " << model_id << " completed";
     }
   } else {
@@ -318,34 +690,82 @@ void AudioEngine::HandleTranscriptionImpl(
     std::function<void(Json::Value&&, Json::Value&&)>&& callback,
     bool translate) {
   auto model_id = utils::GetModelId(*json_body);
-  auto temp_file_path = (*json_body).get("file", "").asString();
-  if (temp_file_path.empty()) {
+  auto req = audio::inferences::fromJson(json_body);
+  req.translate = translate;
+  if (req.file.empty()) {
     LOG_ERROR << "audio file not found";
+    Json::Value jsonResp;
+    jsonResp["message"] = "No audio file found in request body";
+    Json::Value status;
+    status["is_done"] = false;
+    status["has_error"] = true;
+    status["is_stream"] = false;
+    status["status_code"] = k400BadRequest;
+    callback(std::move(status), std::move(jsonResp));
     return;
   }
-  auto language = (*json_body).get("language", "en").asString();
-  auto prompt = (*json_body).get("prompt", "").asString();
-  auto response_format =
-      (*json_body).get("response_format", json_format).asString();
-  auto temperature = (*json_body).get("temperature", 0.0f).asFloat();
 
   std::string result;
+  FallbackStats fallback;
   try {
-    result = server_map_[model_id].ctx.Inference(temp_file_path, language,
-                                                 prompt, response_format,
-                                                 temperature, translate);
-    auto resp_data = CreateFullReturnJson(utils::generate_random_string(20),
-                                          "_", result, "_", 0, 0);
+    result = server_map_[model_id].ctx.Inference(req, &fallback);
+    LOG_DEBUG << result;
+
     Json::Value status;
     status["is_done"] = true;
     status["has_error"] = false;
     status["is_stream"] = false;
     status["status_code"] = k200OK;
-    callback(std::move(status), std::move(resp_data));
-
-    LOG_DEBUG << result;
+    if (req.raw_response) {
+      // The result is already serialized, the host sends it as is
+      status["is_raw"] = true;
+      status["content_type"] = content_type_for(req.response_format);
+      callback(std::move(status), Json::Value(result));
+    } else {
+      auto resp_data = utils::CreateFullReturnJson(
+          utils::generate_random_string(20), "_", result, "_", 0, 0);
+      resp_data["temperature_fallback"] = FallbackJson(fallback);
+      callback(std::move(status), std::move(resp_data));
+    }
+  } catch (const DeadlineExceededError& e) {
+    Json::Value jsonResp;
+    jsonResp["message"] = e.what();
+    Json::Value status;
+    status["is_done"] = false;
+    status["has_error"] = true;
+    status["is_stream"] = false;
+    status["status_code"] =
+        e.admitted ? k504GatewayTimeout : k503ServiceUnavailable;
+    callback(std::move(status), std::move(jsonResp));
+  } catch (const DecoderSaturatedError& e) {
+    Json::Value jsonResp;
+    jsonResp["message"] = e.what();
+    Json::Value status;
+    status["is_done"] = false;
+    status["has_error"] = true;
+    status["is_stream"] = false;
+    status["status_code"] = k503ServiceUnavailable;
+    callback(std::move(status), std::move(jsonResp));
+  } catch (const SchedulerStoppedError& e) {
+    LOG_WARN << e.what();
+    Json::Value jsonResp;
+    jsonResp["message"] = e.what();
+    Json::Value status;
+    status["is_done"] = false;
+    status["has_error"] = true;
+    status["is_stream"] = false;
+    status["status_code"] = k503ServiceUnavailable;
+    callback(std::move(status), std::move(jsonResp));
   } catch (const std::exception& e) {
-    std::cerr << e.what() << '\n';
+    LOG_ERROR << e.what();
+    Json::Value jsonResp;
+    jsonResp["message"] = e.what();
+    Json::Value status;
+    status["is_done"] = false;
+    status["has_error"] = true;
+    status["is_stream"] = false;
+    status["status_code"] = k500InternalServerError;
+    callback(std::move(status), std::move(jsonResp));
   }
 }
 
@@ -28,6 +28,14 @@ class AudioEngine: public EngineI {
       std::shared_ptr<Json::Value> json_body,
       std::function<void(Json::Value&&, Json::Value&&)>&& callback) final;
 
+  void CreateBatchTranscription(
+      std::shared_ptr<Json::Value> json_body,
+      std::function<void(Json::Value&&, Json::Value&&)>&& callback) final;
+
+  void DetectLanguage(
+      std::shared_ptr<Json::Value> json_body,
+      std::function<void(Json::Value&&, Json::Value&&)>&& callback) final;
+
   void LoadModel(std::shared_ptr<Json::Value> json_body,
                  std::function<void(Json::Value&&, Json::Value&&)>&& callback) final;
 
@@ -59,13 +67,35 @@ class AudioEngine: public EngineI {
     WhisperServerContext ctx;
     std::atomic<bool> model_loaded;
     uint64_t start_time;
+    // Directory batch jobs read their inputs from and write their output
+    // to; empty disables batch jobs for the model
+    std::string batch_dir;
   };
 
   // key: model_id, value: ServerInfo
   std::unordered_map<std::string, ServerInfo> server_map_;
+  // Guards insertion into and removal from |server_map_| against batch
+  // threads looking models up, and |running_batches_|
+  std::mutex server_map_mtx_;
+  // key: model_id, value: batch jobs running on it; such a model cannot be
+  // unloaded
+  std::unordered_map<std::string, int> running_batches_;
+
+  // ffmpeg processes decoding non-WAV inputs, and the cache of what they
+  // decoded; shared by all models, so another model transcribing the same
+  // media reads the converted file
+  std::shared_ptr<FfmpegDecoderPool> decoder_pool_ =
+      std::make_shared<FfmpegDecoderPool>();
+  std::shared_ptr<ConvertedAudioCache> audio_cache_ =
+      std::make_shared<ConvertedAudioCache>(convert_to_wav);
 
   std::atomic<int> no_of_requests_ = 0;
   std::atomic<int> no_of_chats_ = 0;
 
+  // Runs batch jobs off the caller's thread; each job drives its own
+  // threads feeding the model's workers.
+  std::unique_ptr<trantor::ConcurrentTaskQueue> batch_queue_;
+  std::atomic<bool> stop_batches_ = false;
+
   bool print_version_ = true;
 };
\ No newline at end of file
@@ -0,0 +1,199 @@
+#include "audio_preprocessor.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <vector>
+
+namespace {
+constexpr double kPi = 3.14159265358979323846;
+// Lanes of the reductions: independent partial results the compiler keeps
+// in vector registers
+constexpr int kLanes = 8;
+// Loudness is measured over 20 ms frames
+constexpr int kFrameMs = 20;
+// Frames below this are silence whatever the recording
+constexpr float kAbsoluteGateDbfs = -70.0f;
+// Frames this far below the mean of the others are pauses, not speech
+constexpr float kRelativeGateDb = 10.0f;
+
+int64_t elapsed_us(std::chrono::steady_clock::time_point start) {
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+             std::chrono::steady_clock::now() - start)
+      .count();
+}
+
+float db_to_power(float db) {
+  return std::pow(10.0f, db / 10.0f);
+}
+
+double sum(const float* x, size_t n) {
+  double acc[kLanes] = {};
+  size_t i = 0;
+  for (; i + kLanes <= n; i += kLanes) {
+    for (int k = 0; k < kLanes; k++) {
+      acc[k] += x[i + k];
+    }
+  }
+  double total = 0.0;
+  for (; i < n; i++) {
+    total += x[i];
+  }
+  for (int k = 0; k < kLanes; k++) {
+    total += acc[k];
+  }
+  return total;
+}
+
+float sum_of_squares(const float* x, size_t n) {
+  float acc[kLanes] = {};
+  size_t i = 0;
+  for (; i + kLanes <= n; i += kLanes) {
+    for (int k = 0; k < kLanes; k++) {
+      acc[k] += x[i + k] * x[i + k];
+    }
+  }
+  float total = 0.0f;
+  for (; i < n; i++) {
+    total += x[i] * x[i];
+  }
+  for (int k = 0; k < kLanes; k++) {
+    total += acc[k];
+  }
+  return total;
+}
+
+float peak(const float* x, size_t n) {
+  float acc[kLanes] = {};
+  size_t i = 0;
+  for (; i + kLanes <= n; i += kLanes) {
+    for (int k = 0; k < kLanes; k++) {
+      acc[k] = (std::max)(acc[k], std::fabs(x[i + k]));
+    }
+  }
+  float result = 0.0f;
+  for (; i < n; i++) {
+    result = (std::max)(result, std::fabs(x[i]));
+  }
+  for (int k = 0; k < kLanes; k++) {
+    result = (std::max)(result, acc[k]);
+  }
+  return result;
+}
+}  // namespace
+
+AudioPreprocessor::AudioPreprocessor(const PreprocessOptions& options,
+                                     int sample_rate)
+    : options_(options), sample_rate_(sample_rate) {
+  if (options_.high_pass_hz > 0.0f &&
+      options_.high_pass_hz < 0.5f * sample_rate_) {
+    // RBJ cookbook high-pass with Q = 1/sqrt(2), i.e. Butterworth
+    const double w0 = 2.0 * kPi * options_.high_pass_hz / sample_rate_;
+    const double alpha = std::sin(w0) / std::sqrt(2.0);
+    const double cos_w0 = std::cos(w0);
+    const double a0 = 1.0 + alpha;
+    b0_ = static_cast<float>((1.0 + cos_w0) / 2.0 / a0);
+    b1_ = static_cast<float>(-(1.0 + cos_w0) / a0);
+    b2_ = b0_;
+    a1_ = static_cast<float>(-2.0 * cos_w0 / a0);
+    a2_ = static_cast<float>((1.0 - alpha) / a0);
+  } else {
+    options_.high_pass_hz = 0.0f;
+  }
+}
+
+void AudioPreprocessor::Process(float* samples, size_t n_samples) {
+  if (n_samples == 0) {
+    return;
+  }
+  if (options_.remove_dc) {
+    const auto start = std::chrono::steady_clock::now();
+    RemoveDc(samples, n_samples);
+    timings_.remove_dc_us += elapsed_us(start);
+  }
+  if (options_.high_pass_hz > 0.0f) {
+    const auto start = std::chrono::steady_clock::now();
+    HighPass(samples, n_samples);
+    timings_.high_pass_us += elapsed_us(start);
+  }
+  if (options_.normalize) {
+    const auto start = std::chrono::steady_clock::now();
+    timings_.gain_db = Normalize(samples, n_samples);
+    timings_.normalize_us += elapsed_us(start);
+  }
+}
+
+void AudioPreprocessor::RemoveDc(float* samples, size_t n_samples) const {
+  const float mean = static_cast<float>(sum(samples, n_samples) / n_samples);
+  for (size_t i = 0; i < n_samples; i++) {
+    samples[i] -= mean;
+  }
+}
+
+void AudioPreprocessor::HighPass(float* samples, size_t n_samples) {
+  float z1 = z1_;
+  float z2 = z2_;
+  for (size_t i = 0; i < n_samples; i++) {
+    const float x = samples[i];
+    const float y = b0_ * x + z1;
+    z1 = b1_ * x - a1_ * y + z2;
+    z2 = b2_ * x - a2_ * y;
+    samples[i] = y;
+  }
+  z1_ = z1;
+  z2_ = z2;
+}
+
+float AudioPreprocessor::Normalize(float* samples, size_t n_samples) const {
+  // mean power of the frames that hold speech, gated like EBU R 128: an
+  // absolute gate for silence, then a relative one for pauses
+  const size_t frame = static_cast<size_t>(sample_rate_) * kFrameMs / 1000;
+  std::vector<float> powers;
+  powers.reserve(n_samples / frame + 1);
+  for (size_t i = 0; i < n_samples; i += frame) {
+    const size_t n = (std::min)(frame, n_samples - i);
+    const float power = sum_of_squares(samples + i, n) / n;
+    if (power > db_to_power(kAbsoluteGateDbfs)) {
+      powers.push_back(power);
+    }
+  }
+  if (powers.empty()) {
+    return 0.0f;
+  }
+  double total = 0.0;
+  for (float power : powers) {
+    total += power;
+  }
+  const double gate = total / powers.size() / db_to_power(kRelativeGateDb);
+  double speech = 0.0;
+  size_t n_speech = 0;
+  for (float power : powers) {
+    if (power >= gate) {
+      speech += power;
+      n_speech++;
+    }
+  }
+  const float loudness_db =
+      10.0f * static_cast<float>(std::log10(speech / n_speech));
+
+  float gain_db = (std::min)(kTargetDbfs - loudness_db, kMaxGainDb);
+  // never clip
+  const float max_peak = peak(samples, n_samples);
+  if (max_peak > 0.0f) {
+    gain_db = (std::min)(gain_db, -20.0f * std::log10(max_peak / 0.999f));
+  }
+  const float gain = std::pow(10.0f, gain_db / 20.0f);
+  for (size_t i = 0; i < n_samples; i++) {
+    samples[i] *= gain;
+  }
+  return gain_db;
+}
+
+void PreprocessingStats::Add(const AudioPreprocessor::Timings& timings,
+                             size_t n_samples) {
+  requests++;
+  samples += static_cast<int64_t>(n_samples);
+  remove_dc_us += timings.remove_dc_us;
+  high_pass_us += timings.high_pass_us;
+  normalize_us += timings.normalize_us;
+}
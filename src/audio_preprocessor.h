@@ -0,0 +1,74 @@
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+// Steps run on the PCM before it reaches whisper, all off by default.
+struct PreprocessOptions {
+  // subtract the mean of the audio
+  bool remove_dc = false;
+  // second order Butterworth high-pass at this frequency, 0 disables
+  float high_pass_hz = 0.0f;
+  // bring the speech loudness to kTargetDbfs
+  bool normalize = false;
+
+  bool Enabled() const { return remove_dc || high_pass_hz > 0.0f || normalize; }
+};
+
+// Conditions mono PCM for whisper. Quiet recordings and recordings with a
+// DC offset or low frequency hum (telephone audio) decode with low
+// confidence, which makes whisper retry segments at higher temperatures.
+//
+// DC removal, the loudness measurement and the gain are plain loops over
+// the block, written so the compiler vectorizes them. The high-pass filter
+// is recursive and runs sample by sample; at a few operations per sample it
+// stays far below the cost of a decoder pass.
+class AudioPreprocessor {
+ public:
+  struct Timings {
+    int64_t remove_dc_us = 0;
+    int64_t high_pass_us = 0;
+    int64_t normalize_us = 0;
+    // last gain applied by normalization
+    float gain_db = 0.0f;
+  };
+
+  // Loudness target: RMS of the frames that hold speech, in dB full scale
+  static constexpr float kTargetDbfs = -20.0f;
+  // Normalization never amplifies more than this, so noise is not blown up
+  static constexpr float kMaxGainDb = 30.0f;
+
+  AudioPreprocessor(const PreprocessOptions& options, int sample_rate);
+
+  // Processes the next |n_samples| of the audio in place. The filter state
+  // carries over from one call to the next; the DC offset and the loudness
+  // are measured on each block, a whole file or one window of it.
+  void Process(float* samples, size_t n_samples);
+
+  const Timings& timings() const { return timings_; }
+
+ private:
+  void RemoveDc(float* samples, size_t n_samples) const;
+  void HighPass(float* samples, size_t n_samples);
+  // Returns the gain applied, in dB
+  float Normalize(float* samples, size_t n_samples) const;
+
+  PreprocessOptions options_;
+  int sample_rate_;
+  // biquad coefficients, normalized by a0, and its transposed direct form
+  // II state
+  float b0_ = 1.0f, b1_ = 0.0f, b2_ = 0.0f, a1_ = 0.0f, a2_ = 0.0f;
+  float z1_ = 0.0f, z2_ = 0.0f;
+  Timings timings_;
+};
+
+// Preprocessing done by a model's requests, for its status.
+struct PreprocessingStats {
+  std::atomic<int64_t> requests = 0;
+  std::atomic<int64_t> samples = 0;
+  std::atomic<int64_t> remove_dc_us = 0;
+  std::atomic<int64_t> high_pass_us = 0;
+  std::atomic<int64_t> normalize_us = 0;
+
+  void Add(const AudioPreprocessor::Timings& timings, size_t n_samples);
+};
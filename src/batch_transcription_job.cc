@@ -0,0 +1,321 @@
+#include "batch_transcription_job.h"
+
+#include <algorithm>
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <mutex>
+#include <thread>
+#include <unordered_set>
+#include "cpu_topology.h"
+#include "json/reader.h"
+#include "json/writer.h"
+#include "trantor/utils/Logger.h"
+
+namespace {
+// 16 kHz mono s16 PCM, used to estimate durations of non-WAV inputs
+constexpr int64_t kBytesPerMs = 32;
+// Pause before asking a saturated decoder pool again
+constexpr auto kDecoderRetryDelay = std::chrono::milliseconds(200);
+
+std::string ToCompactString(const Json::Value& v) {
+  Json::StreamWriterBuilder writer;
+  writer["indentation"] = "";
+  return Json::writeString(writer, v);
+}
+
+// Whether |path|, canonical, is |root| or inside it
+bool IsUnder(const std::filesystem::path& root,
+             const std::filesystem::path& path) {
+  auto [root_end, path_end] =
+      std::mismatch(root.begin(), root.end(), path.begin(), path.end());
+  return root_end == root.end();
+}
+
+// |path| inside |root|, a canonical path, or empty when it is absolute,
+// climbs out of it, or leads out of it through a symlink
+std::string ResolveUnder(const std::filesystem::path& root,
+                         const std::string& path) {
+  std::filesystem::path p(path);
+  if (p.empty() || p.has_root_name() || p.has_root_directory()) {
+    return {};
+  }
+  for (const auto& part : p) {
+    if (part == "..") {
+      return {};
+    }
+  }
+  std::error_code ec;
+  auto resolved = std::filesystem::weakly_canonical(root / p, ec);
+  if (ec || !IsUnder(root, resolved)) {
+    return {};
+  }
+  return resolved.string();
+}
+
+bool ReadManifest(const std::string& path, std::vector<std::string>& files) {
+  std::ifstream manifest(path);
+  if (!manifest.is_open()) {
+    return false;
+  }
+  Json::Reader reader;
+  std::string line;
+  while (std::getline(manifest, line)) {
+    if (!line.empty() && line.back() == '\r') {
+      line.pop_back();
+    }
+    if (line.empty()) {
+      continue;
+    }
+    if (line.front() == '{') {
+      Json::Value entry;
+      if (reader.parse(line, entry) && entry.isMember("file")) {
+        files.push_back(entry["file"].asString());
+      }
+    } else {
+      files.push_back(line);
+    }
+  }
+  return true;
+}
+}  // namespace
+
+std::string BatchTranscriptionJob::FromJson(const Json::Value& body,
+                                            const std::string& root) {
+  std::error_code ec;
+  auto root_dir = std::filesystem::weakly_canonical(root, ec);
+  if (ec) {
+    return "Could not resolve the batch directory " + root;
+  }
+  if (!root_dir.has_filename()) {
+    // "dir/" ends with an empty element that paths inside it do not have
+    root_dir = root_dir.parent_path();
+  }
+  auto output = body.get("output", "").asString();
+  if (output.empty()) {
+    return "No output path found in request body";
+  }
+  output_path_ = ResolveUnder(root_dir, output);
+  if (output_path_.empty()) {
+    return "Output path " + output + " is not inside the batch directory";
+  }
+  resume_ = body.get("resume", true).asBool();
+
+  base_request_ =
+      audio::inferences::fromJson(std::make_shared<Json::Value>(body));
+  base_request_.translate = body.get("task", "").asString() == "translate";
+  base_request_.priority = audio::inferences::RequestPriority::kBatch;
+  // a deadline does not make sense for a whole corpus
+  base_request_.deadline_ms = 0;
+
+  std::vector<std::string> listed;
+  for (const auto& f : body["files"]) {
+    listed.push_back(f.asString());
+  }
+
+  if (body.isMember("manifest")) {
+    auto manifest = body["manifest"].asString();
+    auto manifest_path = ResolveUnder(root_dir, manifest);
+    if (manifest_path.empty()) {
+      return "Manifest " + manifest + " is not inside the batch directory";
+    }
+    if (!ReadManifest(manifest_path, listed)) {
+      return "Could not open manifest " + manifest;
+    }
+  }
+
+  for (const auto& f : listed) {
+    auto path = ResolveUnder(root_dir, f);
+    if (path.empty()) {
+      return "Audio file " + f + " is not inside the batch directory";
+    }
+    files_.push_back(std::move(path));
+  }
+
+  if (body.isMember("directory")) {
+    std::unordered_set<std::string> extensions;
+    for (const auto& e : body["extensions"]) {
+      extensions.insert(e.asString());
+    }
+    if (extensions.empty()) {
+      extensions.insert(".wav");
+    }
+
+    auto directory = body["directory"].asString();
+    auto directory_path = ResolveUnder(root_dir, directory);
+    if (directory_path.empty()) {
+      return "Directory " + directory + " is not inside the batch directory";
+    }
+    using std::filesystem::recursive_directory_iterator;
+    for (recursive_directory_iterator it(directory_path, ec), end;
+         !ec && it != end; it.increment(ec)) {
+      if (!it->is_regular_file() ||
+          !extensions.count(it->path().extension().string())) {
+        continue;
+      }
+      // symlinked files are taken only if they stay inside the directory
+      std::error_code file_ec;
+      auto file = std::filesystem::canonical(it->path(), file_ec);
+      if (!file_ec && IsUnder(root_dir, file)) {
+        files_.push_back(it->path().string());
+      }
+    }
+    if (ec) {
+      return "Could not read directory " + directory + ": " + ec.message();
+    }
+  }
+
+  if (files_.empty()) {
+    return "No audio files found in request body";
+  }
+  return {};
+}
+
+Json::Value BatchTranscriptionJob::Run(WhisperServerContext& ctx,
+                                       const std::atomic<bool>& stop,
+                                       const ProgressCallback& on_progress) {
+  auto start = std::chrono::steady_clock::now();
+
+  // Files already transcribed by a previous run of this job
+  std::unordered_set<std::string> done;
+  if (resume_) {
+    std::ifstream previous(output_path_);
+    Json::Reader reader;
+    std::string line;
+    while (std::getline(previous, line)) {
+      Json::Value entry;
+      // a torn last line from a crash simply fails to parse
+      if (reader.parse(line, entry) && entry.get("status", "") == "ok") {
+        done.insert(entry["file"].asString());
+      }
+    }
+  }
+
+  // the output may hold other jobs' files too, only this job's count
+  size_t skipped = 0;
+  std::vector<Entry> entries;
+  entries.reserve(files_.size());
+  for (const auto& f : files_) {
+    if (done.count(f)) {
+      skipped++;
+      continue;
+    }
+    int64_t duration_ms = 0;
+    if (!get_wav_duration_ms(f, duration_ms)) {
+      std::error_code ec;
+      auto size = std::filesystem::file_size(f, ec);
+      duration_ms = ec ? 0 : int64_t(size) / kBytesPerMs;
+    }
+    entries.push_back({f, duration_ms});
+  }
+  // Longest first: long files start early and short ones fill the gaps at
+  // the end, so all workers finish at about the same time.
+  std::stable_sort(entries.begin(), entries.end(),
+                   [](const Entry& a, const Entry& b) {
+                     return a.duration_ms > b.duration_ms;
+                   });
+
+  std::ofstream output(output_path_, resume_ ? std::ios::app : std::ios::trunc);
+  if (!output.is_open()) {
+    Json::Value summary;
+    summary["message"] = "Could not open output file " + output_path_;
+    summary["has_error"] = true;
+    return summary;
+  }
+
+  LOG_INFO << "Batch job for model " << ctx.model_id << ": " << entries.size()
+           << " file(s) to process, " << skipped << " already done";
+
+  std::mutex output_mtx;
+  std::atomic<size_t> next = 0;
+  std::atomic<int> succeeded = 0;
+  std::atomic<int> failed = 0;
+
+  // One driver more than there are workers, so the next file is decoded
+  // while the workers are busy. Decoding is I/O side work, it stays off the
+  // cores reserved for inference.
+  auto driver = [&]() {
+    if (!ctx.io_cpus.empty()) {
+      cpu_topology::PinCurrentThread(ctx.io_cpus);
+    }
+    cpu_topology::SetCurrentThreadName("batch-io");
+    while (!stop) {
+      const size_t i = next++;
+      if (i >= entries.size()) {
+        break;
+      }
+      auto req = base_request_;
+      req.file = entries[i].file;
+      req.received_at = std::chrono::steady_clock::now();
+
+      Json::Value line;
+      line["file"] = req.file;
+      try {
+        std::string result;
+        while (true) {
+          try {
+            result = ctx.Inference(req);
+            break;
+          } catch (const DecoderSaturatedError&) {
+            // the job's files wait for a decoder rather than fail
+            if (stop) {
+              throw;
+            }
+            std::this_thread::sleep_for(kDecoderRetryDelay);
+          }
+        }
+        line["status"] = "ok";
+        line["response_format"] = req.response_format;
+        Json::Value parsed;
+        if ((req.response_format == json_format ||
+             req.response_format == vjson_format) &&
+            Json::Reader().parse(result, parsed)) {
+          line["result"] = parsed;
+        } else {
+          line["result"] = result;
+        }
+        succeeded++;
+      } catch (const std::exception& e) {
+        line["status"] = "error";
+        line["message"] = e.what();
+        failed++;
+      }
+      line["duration_ms"] = Json::Int64(entries[i].duration_ms);
+      line["processing_ms"] =
+          Json::Int64(std::chrono::duration_cast<std::chrono::milliseconds>(
+                          std::chrono::steady_clock::now() - req.received_at)
+                          .count());
+
+      std::lock_guard<std::mutex> l(output_mtx);
+      output << ToCompactString(line) << '\n';
+      output.flush();
+      on_progress(line);
+    }
+  };
+
+  const size_t n_drivers =
+      (std::min)(entries.size(), size_t((std::max)(1, ctx.n_states) + 1));
+  std::vector<std::thread> drivers;
+  for (size_t i = 0; i < n_drivers; i++) {
+    drivers.emplace_back(driver);
+  }
+  for (auto& d : drivers) {
+    d.join();
+  }
+
+  Json::Value summary;
+  summary["object"] = "batch";
+  summary["output"] = output_path_;
+  summary["total"] = Json::UInt64(files_.size());
+  summary["skipped"] = Json::UInt64(skipped);
+  summary["succeeded"] = succeeded.load();
+  summary["failed"] = failed.load();
+  summary["stopped"] = stop.load();
+  summary["elapsed_ms"] =
+      Json::Int64(std::chrono::duration_cast<std::chrono::milliseconds>(
+                      std::chrono::steady_clock::now() - start)
+                      .count());
+  // each file's error is in its line, the summary only flags that there are
+  summary["has_error"] = failed > 0;
+  return summary;
+}
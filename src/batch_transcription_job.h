@@ -0,0 +1,47 @@
+#pragma once
+#include <atomic>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "json/value.h"
+#include "transcription_request.h"
+#include "whisper_server_context.h"
+
+// Transcribes a corpus of audio files with one model and appends one JSON
+// line per file to an output file. The output doubles as the checkpoint:
+// files already recorded with status "ok" are skipped when the job is
+// resumed, so an interrupted job only redoes the files that were in flight.
+class BatchTranscriptionJob {
+ public:
+  // Called with every output line as soon as it has been written.
+  using ProgressCallback = std::function<void(const Json::Value&)>;
+
+  // Reads the job from a request body. Files come from "files" (array),
+  // "manifest" (one path or JSON object with "file" per line) or
+  // "directory" (recursive, filtered by "extensions"). All paths, the
+  // output's too, are relative to |root|: absolute paths, paths with ".."
+  // and paths that lead out of |root| through a symlink are refused.
+  // Returns an error message, empty on success.
+  std::string FromJson(const Json::Value& body, const std::string& root);
+
+  // Schedules the files longest first across all of the model's workers and
+  // blocks until they are done or |stop| is set. Returns a summary, with
+  // "has_error" set if any file failed.
+  Json::Value Run(WhisperServerContext& ctx, const std::atomic<bool>& stop,
+                  const ProgressCallback& on_progress);
+
+  const std::string& output_path() const { return output_path_; }
+
+ private:
+  struct Entry {
+    std::string file;
+    int64_t duration_ms;
+  };
+
+  std::vector<std::string> files_;
+  std::string output_path_;
+  bool resume_ = true;
+  // language, prompt, response format etc. shared by all files
+  audio::inferences::TranscriptionRequest base_request_;
+};
@@ -0,0 +1,292 @@
+#include "converted_audio_cache.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <exception>
+#include <filesystem>
+#include <fstream>
+#include <random>
+#include <stdexcept>
+#include <tuple>
+#include <vector>
+#include "trantor/utils/Logger.h"
+#include "trantor/utils/Utilities.h"
+
+#if defined(__unix__) || (defined(__APPLE__) && defined(__MACH__))
+#define CORTEX_AUDIO_POSIX_DIRS 1
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace fs = std::filesystem;
+
+namespace {
+// Bytes hashed at a time
+constexpr size_t kChunkBytes = 1 << 20;
+
+// SHA-256 of the content of |path| followed by its size, in hex. Files are
+// hashed a chunk at a time and the key is the SHA-256 of the chunk digests,
+// which is as hard to collide as SHA-256 itself: the cache is shared by
+// every model and tenant, so one client must not be able to craft a file
+// that is served another's audio.
+bool hash_file(const std::string& path, std::string& key) {
+  std::ifstream in(path, std::ios::binary);
+  if (!in) {
+    return false;
+  }
+  std::vector<char> chunk(kChunkBytes);
+  std::vector<trantor::utils::Hash256> digests;
+  uint64_t size = 0;
+  while (in) {
+    in.read(chunk.data(), chunk.size());
+    const size_t n = static_cast<size_t>(in.gcount());
+    if (n > 0) {
+      digests.push_back(trantor::utils::sha256(chunk.data(), n));
+    }
+    size += n;
+  }
+  if (in.bad()) {
+    return false;
+  }
+  key = trantor::utils::toHexString(trantor::utils::sha256(
+            digests.data(), digests.size() * sizeof(digests[0]))) +
+        "-" + std::to_string(size);
+  return true;
+}
+
+// The default directory: cortex-audio-cache-<uid> in the temp directory, if
+// this user owns it and no one else can access it. Another user may have
+// created it first, or left a link there, so a new directory is made then.
+// Empty if none can be made.
+std::string private_dir() {
+  std::error_code ec;
+  auto tmp_dir = fs::temp_directory_path(ec);
+  if (ec) {
+    tmp_dir = ".";
+  }
+#ifdef CORTEX_AUDIO_POSIX_DIRS
+  const uid_t uid = getuid();
+  const std::string dir =
+      (tmp_dir / ("cortex-audio-cache-" + std::to_string(uid))).string();
+  mkdir(dir.c_str(), 0700);
+  struct stat st;
+  if (lstat(dir.c_str(), &st) == 0 && S_ISDIR(st.st_mode) &&
+      st.st_uid == uid && (st.st_mode & 077) == 0) {
+    return dir;
+  }
+  std::string new_dir = (tmp_dir / "cortex-audio-cache-XXXXXX").string();
+  if (mkdtemp(new_dir.data()) == nullptr) {
+    LOG_ERROR << dir << " is not private to this user, and no directory "
+              << "can be made for converted audio instead";
+    return {};
+  }
+  LOG_WARN << dir << " is not private to this user, converted audio is "
+           << "cached in " << new_dir << " instead";
+  return new_dir;
+#else
+  // the temp directory is the user's own
+  return (tmp_dir / "cortex-audio-cache").string();
+#endif
+}
+
+std::string random_tmp_suffix() {
+  std::random_device rd;
+  char suffix[32];
+  std::snprintf(suffix, sizeof(suffix), ".%08x%08x.tmp", rd(), rd());
+  return suffix;
+}
+}  // namespace
+
+ConvertedAudioCache::ConvertedAudioCache(Converter convert, std::string dir,
+                                         uint64_t max_bytes)
+    : convert_(std::move(convert)),
+      dir_(std::move(dir)),
+      tmp_suffix_(random_tmp_suffix()),
+      max_bytes_(max_bytes) {}
+
+bool ConvertedAudioCache::SetDir(const std::string& dir) {
+  std::lock_guard<std::mutex> lock(mtx_);
+  if (opened_) {
+    return false;
+  }
+  dir_ = dir;
+  return true;
+}
+
+ConvertedAudioCache::Lease ConvertedAudioCache::Get(const std::string& input) {
+  std::string key;
+  if (!hash_file(input, key)) {
+    throw std::runtime_error("Failed to read audio file " + input);
+  }
+  const std::string path = PathOf(key);
+
+  std::unique_lock<std::mutex> lock(mtx_);
+  if (!opened_ && !OpenLocked()) {
+    throw std::runtime_error("No directory to cache converted audio in");
+  }
+  converted_cv_.wait(lock, [&] { return converting_.count(key) == 0; });
+  if (auto it = entries_.find(key); it != entries_.end()) {
+    std::error_code ec;
+    if (fs::exists(path, ec)) {
+      hits_++;
+      it->second.readers++;
+      it->second.last_use = ++clock_;
+      lock.unlock();
+      // the modification times order the files again after a restart
+      fs::last_write_time(path, fs::file_time_type::clock::now(), ec);
+      return MakeLease(key);
+    }
+    // removed behind our back
+    bytes_ -= it->second.bytes;
+    entries_.erase(it);
+  }
+  misses_++;
+  converting_.insert(key);
+  lock.unlock();
+
+  // written aside and renamed, readers never see half a file
+  const std::string tmp_path = path + tmp_suffix_;
+  std::string error;
+  std::error_code ec;
+  std::exception_ptr convert_error;
+  bool is_converted = false;
+  try {
+    is_converted = convert_(input, tmp_path, error);
+  } catch (...) {
+    // rethrown once the waiters are released
+    convert_error = std::current_exception();
+  }
+  uint64_t bytes = 0;
+  if (is_converted) {
+    fs::rename(tmp_path, path, ec);
+    if (ec) {
+      is_converted = false;
+      error = "Failed to move converted audio to " + path + ": " +
+              ec.message();
+    } else {
+      bytes = fs::file_size(path, ec);
+    }
+  }
+  if (!is_converted) {
+    fs::remove(tmp_path, ec);
+  }
+
+  lock.lock();
+  converting_.erase(key);
+  converted_cv_.notify_all();
+  if (convert_error) {
+    std::rethrow_exception(convert_error);
+  }
+  if (!is_converted) {
+    throw std::runtime_error(error);
+  }
+  Entry& entry = entries_[key];
+  entry.bytes = bytes;
+  entry.readers = 1;
+  entry.last_use = ++clock_;
+  bytes_ += bytes;
+  EvictLocked();
+  lock.unlock();
+  return MakeLease(key);
+}
+
+void ConvertedAudioCache::SetMaxBytes(uint64_t max_bytes) {
+  std::lock_guard<std::mutex> lock(mtx_);
+  max_bytes_ = max_bytes;
+  if (opened_) {
+    EvictLocked();
+  }
+}
+
+ConvertedAudioCache::Stats ConvertedAudioCache::GetStats() const {
+  std::lock_guard<std::mutex> lock(mtx_);
+  Stats stats;
+  stats.hits = hits_;
+  stats.misses = misses_;
+  stats.entries = static_cast<int64_t>(entries_.size());
+  stats.bytes = static_cast<int64_t>(bytes_);
+  stats.max_bytes = static_cast<int64_t>(max_bytes_);
+  return stats;
+}
+
+bool ConvertedAudioCache::OpenLocked() {
+  if (dir_.empty()) {
+    dir_ = private_dir();
+    if (dir_.empty()) {
+      return false;
+    }
+  }
+  opened_ = true;
+  std::error_code ec;
+  fs::create_directories(dir_, ec);
+
+  // oldest first, so they get the lowest use counts
+  std::vector<std::tuple<fs::file_time_type, std::string, uint64_t>> files;
+  const auto stale = fs::file_time_type::clock::now() - kStaleTmpAge;
+  for (fs::directory_iterator it(dir_, ec), end; !ec && it != end;
+       it.increment(ec)) {
+    const auto& file = it->path();
+    std::error_code file_ec;
+    if (file.extension() == ".tmp") {
+      // left by a conversion that did not finish; a recent one may still
+      // be written by another process
+      if (it->last_write_time(file_ec) < stale && !file_ec) {
+        fs::remove(file, file_ec);
+      }
+    } else if (file.extension() == ".wav") {
+      const auto time = it->last_write_time(file_ec);
+      const auto size = it->file_size(file_ec);
+      if (!file_ec) {
+        files.emplace_back(time, file.stem().string(), size);
+      }
+    }
+  }
+  std::sort(files.begin(), files.end());
+  for (const auto& [time, key, size] : files) {
+    Entry& entry = entries_[key];
+    entry.bytes = size;
+    entry.last_use = ++clock_;
+    bytes_ += size;
+  }
+  EvictLocked();
+  return true;
+}
+
+void ConvertedAudioCache::EvictLocked() {
+  while (bytes_ > max_bytes_) {
+    auto victim = entries_.end();
+    for (auto it = entries_.begin(); it != entries_.end(); ++it) {
+      if (it->second.readers == 0 &&
+          (victim == entries_.end() ||
+           it->second.last_use < victim->second.last_use)) {
+        victim = it;
+      }
+    }
+    if (victim == entries_.end()) {
+      // everything left is being read
+      break;
+    }
+    std::error_code ec;
+    fs::remove(PathOf(victim->first), ec);
+    bytes_ -= victim->second.bytes;
+    entries_.erase(victim);
+  }
+}
+
+ConvertedAudioCache::Lease ConvertedAudioCache::MakeLease(
+    const std::string& key) {
+  return Lease(new std::string(PathOf(key)),
+               [this, key](const std::string* path) {
+                 delete path;
+                 std::lock_guard<std::mutex> lock(mtx_);
+                 if (auto it = entries_.find(key); it != entries_.end()) {
+                   it->second.readers--;
+                 }
+                 EvictLocked();
+               });
+}
+
+std::string ConvertedAudioCache::PathOf(const std::string& key) const {
+  return (fs::path(dir_) / (key + ".wav")).string();
+}
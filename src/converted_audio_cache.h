@@ -0,0 +1,99 @@
+#pragma once
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+
+// On-disk cache of audio files converted to 16 kHz mono PCM WAV, keyed by the
+// SHA-256 of the source file's content, so transcribing the same media again,
+// with other parameters or by another model, skips the conversion.
+//
+// The cache lives in one directory, whose files survive restarts. It holds
+// at most |max_bytes|: least recently used files are removed past that,
+// except those a request is still reading. Sources are never modified.
+// Whoever can write the directory decides what is transcribed, so by
+// default it is one only the user running the process can access. Each
+// cache writes its conversions to files of its own before renaming them;
+// such files left for an hour are from conversions that did not finish,
+// and are removed when the directory is first used.
+class ConvertedAudioCache {
+ public:
+  // Converts |input| into a WAV file at |output|; returns false with |error|
+  // set on failure.
+  using Converter = std::function<bool(
+      const std::string& input, const std::string& output, std::string& error)>;
+  // Path of a converted file. The file stays in the cache at least as long
+  // as the lease is held.
+  using Lease = std::shared_ptr<const std::string>;
+
+  struct Stats {
+    int64_t hits = 0;
+    int64_t misses = 0;
+    int64_t entries = 0;
+    int64_t bytes = 0;
+    int64_t max_bytes = 0;
+  };
+
+  static constexpr uint64_t kDefaultMaxBytes = 2ull << 30;
+  static constexpr std::chrono::hours kStaleTmpAge{1};
+
+  // An empty |dir| is cortex-audio-cache-<uid> in the system temp directory,
+  // provided it is owned by the user and private to them; a new directory
+  // otherwise. Nothing is read or written before the first Get.
+  explicit ConvertedAudioCache(Converter convert, std::string dir = "",
+                               uint64_t max_bytes = kDefaultMaxBytes);
+
+  // Moves the cache to |dir|, empty for the default, unless it was used
+  // already; returns false then.
+  bool SetDir(const std::string& dir);
+
+  // The converted file for |input|, converting it unless a file with the
+  // same content was converted before. Concurrent requests for the same
+  // content wait for a single conversion. Throws std::runtime_error if
+  // |input| cannot be read or converted, and passes on what the converter
+  // throws.
+  Lease Get(const std::string& input);
+
+  // 0 keeps files only while they are read.
+  void SetMaxBytes(uint64_t max_bytes);
+
+  Stats GetStats() const;
+
+ private:
+  struct Entry {
+    uint64_t bytes = 0;
+    // value of |clock_| when last used
+    uint64_t last_use = 0;
+    int readers = 0;
+  };
+
+  // Indexes the files left in the directory, creating it first; returns
+  // false if there is no directory to use. |mtx_| is held.
+  bool OpenLocked();
+  // Removes unread files, least recently used first, until the cache fits
+  // |max_bytes_|; |mtx_| is held.
+  void EvictLocked();
+  Lease MakeLease(const std::string& key);
+  std::string PathOf(const std::string& key) const;
+
+  Converter convert_;
+  std::string dir_;
+  // ends the names of files being converted into: unique to this cache
+  const std::string tmp_suffix_;
+  mutable std::mutex mtx_;
+  std::condition_variable converted_cv_;
+  bool opened_ = false;
+  uint64_t max_bytes_;
+  uint64_t bytes_ = 0;
+  uint64_t clock_ = 0;
+  int64_t hits_ = 0;
+  int64_t misses_ = 0;
+  std::unordered_map<std::string, Entry> entries_;
+  // keys being converted
+  std::unordered_set<std::string> converting_;
+};
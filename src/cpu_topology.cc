@@ -0,0 +1,154 @@
+#include "cpu_topology.h"
+
+#include <algorithm>
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+#include <thread>
+#include "trantor/utils/Logger.h"
+
+#if defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#elif defined(__APPLE__)
+#include <pthread.h>
+#endif
+
+namespace cpu_topology {
+
+#if defined(__linux__)
+static_assert(kMaxCpus == CPU_SETSIZE, "kMaxCpus has to match cpu_set_t");
+#endif
+
+std::vector<int> ParseCpuList(const std::string& list) {
+  std::vector<int> cpus;
+  std::stringstream ss(list);
+  std::string range;
+  while (std::getline(ss, range, ',')) {
+    try {
+      const auto dash = range.find('-');
+      const int first = std::stoi(range.substr(0, dash));
+      const int last =
+          dash == std::string::npos ? first : std::stoi(range.substr(dash + 1));
+      if (first < 0 || last < first) {
+        LOG_WARN << "Ignoring CPU range " << range;
+        continue;
+      }
+      for (int cpu = first; cpu <= (std::min)(last, kMaxCpus - 1); cpu++) {
+        cpus.push_back(cpu);
+      }
+    } catch (const std::exception&) {
+      // empty list or trailing newline
+    }
+  }
+  std::sort(cpus.begin(), cpus.end());
+  cpus.erase(std::unique(cpus.begin(), cpus.end()), cpus.end());
+  return cpus;
+}
+
+std::vector<int> GetProcessCpus() {
+  std::vector<int> cpus;
+#if defined(__linux__)
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  if (sched_getaffinity(getpid(), sizeof(set), &set) == 0) {
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+      if (CPU_ISSET(cpu, &set)) {
+        cpus.push_back(cpu);
+      }
+    }
+  }
+#endif
+  if (cpus.empty()) {
+    const int n_cpus =
+        (std::max)(1, static_cast<int>(std::thread::hardware_concurrency()));
+    for (int cpu = 0; cpu < n_cpus; cpu++) {
+      cpus.push_back(cpu);
+    }
+  }
+  return cpus;
+}
+
+std::vector<NumaNode> GetNumaNodes() {
+  std::vector<NumaNode> nodes;
+#if defined(__linux__)
+  namespace fs = std::filesystem;
+  std::error_code ec;
+  for (const auto& entry :
+       fs::directory_iterator("/sys/devices/system/node", ec)) {
+    const std::string name = entry.path().filename().string();
+    if (name.rfind("node", 0) != 0 ||
+        name.find_first_not_of("0123456789", 4) != std::string::npos) {
+      continue;
+    }
+    std::ifstream file(entry.path() / "cpulist");
+    std::string list;
+    std::getline(file, list);
+    NumaNode node;
+    node.id = std::stoi(name.substr(4));
+    node.cpus = ParseCpuList(list);
+    // memory only nodes cannot run workers
+    if (!node.cpus.empty()) {
+      nodes.push_back(std::move(node));
+    }
+  }
+  std::sort(nodes.begin(), nodes.end(),
+            [](const NumaNode& a, const NumaNode& b) { return a.id < b.id; });
+#endif
+  if (nodes.empty()) {
+    NumaNode node;
+    const int n_cpus =
+        (std::max)(1, static_cast<int>(std::thread::hardware_concurrency()));
+    for (int cpu = 0; cpu < n_cpus; cpu++) {
+      node.cpus.push_back(cpu);
+    }
+    nodes.push_back(std::move(node));
+  }
+  return nodes;
+}
+
+bool PinCurrentThread(const std::vector<int>& cpus) {
+#if defined(__linux__)
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  for (int cpu : cpus) {
+    if (cpu >= 0 && cpu < CPU_SETSIZE) {
+      CPU_SET(cpu, &set);
+    }
+  }
+  if (CPU_COUNT(&set) == 0) {
+    return false;
+  }
+  const int ret = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+  if (ret != 0) {
+    LOG_WARN << "Failed to pin thread to " << cpus.size()
+             << " CPU(s), error " << ret;
+    return false;
+  }
+  return true;
+#else
+  (void)cpus;
+  return false;
+#endif
+}
+
+void SetCurrentThreadName(const std::string& name) {
+#if defined(__linux__)
+  pthread_setname_np(pthread_self(), name.substr(0, 15).c_str());
+#elif defined(__APPLE__)
+  pthread_setname_np(name.substr(0, 15).c_str());
+#else
+  (void)name;
+#endif
+}
+
+void RunPinned(const std::vector<int>& cpus, const std::function<void()>& fn) {
+  std::thread runner([&cpus, &fn] {
+    PinCurrentThread(cpus);
+    fn();
+  });
+  runner.join();
+}
+
+}  // namespace cpu_topology
@@ -0,0 +1,43 @@
+#pragma once
+#include <functional>
+#include <string>
+#include <vector>
+
+namespace cpu_topology {
+
+// CPU numbers a thread can be pinned to are below this (CPU_SETSIZE)
+constexpr int kMaxCpus = 1024;
+
+struct NumaNode {
+  int id = 0;
+  // online CPUs of the node
+  std::vector<int> cpus;
+};
+
+// "0-3,8,10-11" -> {0, 1, 2, 3, 8, 10, 11}, sorted and without duplicates.
+// Malformed and reversed ranges are skipped, CPUs from kMaxCpus on are
+// dropped.
+std::vector<int> ParseCpuList(const std::string& list);
+
+// CPUs the process may run on (the affinity of its main thread), sorted.
+// Every CPU where affinity is not supported.
+std::vector<int> GetProcessCpus();
+
+// NUMA nodes that have CPUs, from sysfs. Hosts without NUMA information
+// (and non Linux hosts) report a single node holding every CPU.
+std::vector<NumaNode> GetNumaNodes();
+
+// Restricts the calling thread to |cpus|. Threads it creates afterwards
+// inherit the mask. Returns false if pinning is not supported or failed.
+bool PinCurrentThread(const std::vector<int>& cpus);
+
+// Names the calling thread for profilers and debuggers, truncated to the 15
+// characters Linux allows. Threads it creates afterwards inherit the name.
+void SetCurrentThreadName(const std::string& name);
+
+// Runs |fn| on a new thread pinned to |cpus| and waits for it. Memory the
+// thread touches first is allocated on the node of those CPUs, which is how
+// model weights and states are placed on a node.
+void RunPinned(const std::vector<int>& cpus, const std::function<void()>& fn);
+
+}  // namespace cpu_topology
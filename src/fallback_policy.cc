@@ -0,0 +1,199 @@
+#include "fallback_policy.h"
+
+#include <algorithm>
+#include <iterator>
+
+namespace {
+int64_t to_ms(std::chrono::steady_clock::duration d) {
+  return std::chrono::duration_cast<std::chrono::milliseconds>(d).count();
+}
+}  // namespace
+
+void FallbackStats::Add(const FallbackStats& other) {
+  windows += other.windows;
+  fallback_windows += other.fallback_windows;
+  fallback_passes += other.fallback_passes;
+  recovered += other.recovered;
+  exhausted += other.exhausted;
+  decode_ms += other.decode_ms;
+  fallback_ms += other.fallback_ms;
+}
+
+FallbackTracker::FallbackTracker(float temperature, float temperature_inc) {
+  // the temperatures whisper_full tries, counted the way it lists them
+  max_passes_ = 0;
+  if (temperature_inc > 0.0f) {
+    for (float t = temperature; t < 1.0f + 1e-6f; t += temperature_inc) {
+      max_passes_++;
+    }
+  }
+  max_passes_ = (std::max)(1, max_passes_);
+}
+
+void FallbackTracker::OnEncoderBegin() {
+  EndWindow();
+}
+
+void FallbackTracker::OnPassStart() {
+  const auto now = std::chrono::steady_clock::now();
+  if (passes_ >= 2) {
+    fallback_time_ += now - pass_start_;
+  }
+  passes_++;
+  pass_start_ = now;
+  if (passes_ >= 2) {
+    stats_.fallback_passes++;
+  }
+}
+
+void FallbackTracker::Finish() {
+  EndWindow();
+}
+
+void FallbackTracker::EndWindow() {
+  if (passes_ == 0) {
+    return;
+  }
+  stats_.windows++;
+  if (passes_ >= 2) {
+    fallback_time_ += std::chrono::steady_clock::now() - pass_start_;
+    stats_.fallback_windows++;
+    if (passes_ >= max_passes_) {
+      stats_.exhausted++;
+    } else {
+      stats_.recovered++;
+    }
+    stats_.fallback_ms = to_ms(fallback_time_);
+  }
+  passes_ = 0;
+}
+
+void FallbackPolicy::SetAdaptive(bool adaptive) {
+  std::lock_guard<std::mutex> lock(mtx_);
+  adaptive_ = adaptive;
+  if (!adaptive_) {
+    tenants_.clear();
+  }
+}
+
+bool FallbackPolicy::adaptive() const {
+  std::lock_guard<std::mutex> lock(mtx_);
+  return adaptive_;
+}
+
+float FallbackPolicy::TemperatureInc(const std::string& tenant,
+                                     bool latency_sensitive, float temperature,
+                                     float temperature_inc) {
+  std::lock_guard<std::mutex> lock(mtx_);
+  if (!adaptive_ || !latency_sensitive || temperature_inc <= 0.0f) {
+    return temperature_inc;
+  }
+  auto it = tenants_.find(tenant);
+  if (it == tenants_.end()) {
+    return temperature_inc;
+  }
+  Tenant& state = it->second;
+  state.last_use = ++clock_;
+  const Mode mode = ModeOf(state);
+  if (mode == Mode::kFull) {
+    return temperature_inc;
+  }
+  if (++state.since_probe >= kProbeEvery) {
+    state.since_probe = 0;
+    return temperature_inc;
+  }
+  if (mode == Mode::kOff) {
+    return 0.0f;
+  }
+  // two fallback passes at most: halfway to 1.0, then 1.0
+  return (std::max)(temperature_inc, (1.0f - temperature) / 2.0f);
+}
+
+void FallbackPolicy::Record(const std::string& tenant,
+                            const FallbackStats& stats, bool measured) {
+  std::lock_guard<std::mutex> lock(mtx_);
+  totals_.Add(stats);
+  if (!adaptive_) {
+    return;
+  }
+  Tenant& state = tenants_[tenant];
+  state.requests++;
+  state.last_use = ++clock_;
+  if (measured) {
+    state.fallback_windows =
+        state.fallback_windows * kDecay + stats.fallback_windows;
+    state.recovered = state.recovered * kDecay + stats.recovered;
+    state.decode_ms = state.decode_ms * kDecay + stats.decode_ms;
+    state.fallback_ms = state.fallback_ms * kDecay + stats.fallback_ms;
+  }
+  if (tenants_.size() > kMaxTenants) {
+    PruneTenantsLocked();
+  }
+}
+
+FallbackStats FallbackPolicy::Totals() const {
+  std::lock_guard<std::mutex> lock(mtx_);
+  return totals_;
+}
+
+std::vector<FallbackPolicy::TenantSummary> FallbackPolicy::Tenants() const {
+  std::lock_guard<std::mutex> lock(mtx_);
+  std::vector<TenantSummary> result;
+  for (const auto& [name, state] : tenants_) {
+    TenantSummary summary;
+    summary.tenant = name;
+    summary.mode = ModeOf(state);
+    summary.requests = state.requests;
+    if (state.fallback_windows > 0.0f) {
+      summary.recovery_rate = state.recovered / state.fallback_windows;
+    }
+    if (state.decode_ms > 0.0f) {
+      summary.fallback_share = state.fallback_ms / state.decode_ms;
+    }
+    result.push_back(summary);
+  }
+  std::sort(result.begin(), result.end(),
+            [](const auto& a, const auto& b) { return a.tenant < b.tenant; });
+  return result;
+}
+
+void FallbackPolicy::PruneTenantsLocked() {
+  std::vector<uint64_t> uses;
+  uses.reserve(tenants_.size());
+  for (const auto& [name, state] : tenants_) {
+    uses.push_back(state.last_use);
+  }
+  auto median = uses.begin() + uses.size() / 2;
+  std::nth_element(uses.begin(), median, uses.end());
+  for (auto it = tenants_.begin(); it != tenants_.end();) {
+    it = it->second.last_use < *median ? tenants_.erase(it) : std::next(it);
+  }
+}
+
+const char* FallbackPolicy::ModeName(Mode mode) {
+  switch (mode) {
+    case Mode::kLimited:
+      return "limited";
+    case Mode::kOff:
+      return "off";
+    default:
+      return "full";
+  }
+}
+
+FallbackPolicy::Mode FallbackPolicy::ModeOf(const Tenant& tenant) {
+  if (tenant.fallback_windows < kMinWindows) {
+    return Mode::kFull;
+  }
+  const float recovery_rate = tenant.recovered / tenant.fallback_windows;
+  const float fallback_share =
+      tenant.decode_ms > 0.0f ? tenant.fallback_ms / tenant.decode_ms : 0.0f;
+  if (recovery_rate < kOffBelowRecovery) {
+    return Mode::kOff;
+  }
+  if (recovery_rate < kLimitBelowRecovery &&
+      fallback_share > kLimitAboveShare) {
+    return Mode::kLimited;
+  }
+  return Mode::kFull;
+}
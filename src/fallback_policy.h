@@ -0,0 +1,133 @@
+#pragma once
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Temperature fallback of whisper_full: a window whose decoding fails the
+// entropy or log probability thresholds is decoded again at the next
+// temperature, up to 1.0.
+struct FallbackStats {
+  // windows decoded, and those decoded more than once
+  int64_t windows = 0;
+  int64_t fallback_windows = 0;
+  // decoding passes after the first of their window
+  int64_t fallback_passes = 0;
+  // fallback windows that passed the thresholds before the last
+  // temperature, and those that used every temperature
+  int64_t recovered = 0;
+  int64_t exhausted = 0;
+  // time in whisper_full, and in fallback passes
+  int64_t decode_ms = 0;
+  int64_t fallback_ms = 0;
+
+  void Add(const FallbackStats& other);
+};
+
+// Observes the fallback of whisper_full runs through their callbacks: the
+// encoder begin callback runs once per window, and the logits filter
+// callback sees an empty sequence once at the start of every decoding
+// pass.
+class FallbackTracker {
+ public:
+  // |temperature| and |temperature_inc| as given to whisper_full
+  FallbackTracker(float temperature, float temperature_inc);
+
+  void OnEncoderBegin();
+  void OnPassStart();
+  // Call after each whisper_full run, and before reading the stats.
+  void Finish();
+
+  const FallbackStats& stats() const { return stats_; }
+
+ private:
+  void EndWindow();
+
+  // decoding passes whisper_full makes at most per window
+  int max_passes_;
+  int passes_ = 0;
+  std::chrono::steady_clock::time_point pass_start_;
+  std::chrono::steady_clock::duration fallback_time_{0};
+  FallbackStats stats_;
+};
+
+// Totals of a model's requests and, when adaptive, per tenant fallback
+// settings learned from them. Past kMaxTenants tenants, the least recently
+// seen half is forgotten, and starts over with the configured fallback.
+//
+// For tenants whose requests are latency sensitive (interactive or with a
+// deadline), fallback is limited to two passes when few fallback windows
+// recover and fallback takes a good share of the decoding time, and
+// turned off when they hardly ever recover. Every kProbeEvery requests of
+// such a tenant run with the configured fallback again, so the policy
+// notices when the tenant's audio changes. Other requests always get the
+// configured fallback.
+class FallbackPolicy {
+ public:
+  enum class Mode { kFull, kLimited, kOff };
+
+  struct TenantSummary {
+    std::string tenant;
+    Mode mode = Mode::kFull;
+    int64_t requests = 0;
+    // decayed over the tenant's recent requests
+    float recovery_rate = 0.0f;
+    float fallback_share = 0.0f;
+  };
+
+  // fallback windows seen before the policy acts
+  static constexpr float kMinWindows = 8.0f;
+  static constexpr float kOffBelowRecovery = 0.1f;
+  static constexpr float kLimitBelowRecovery = 0.4f;
+  static constexpr float kLimitAboveShare = 0.2f;
+  static constexpr int kProbeEvery = 16;
+  // weight of a tenant's past in its running counts, per request
+  static constexpr float kDecay = 0.95f;
+  static constexpr size_t kMaxTenants = 1024;
+
+  // Turning it off forgets what was learned of every tenant.
+  void SetAdaptive(bool adaptive);
+  bool adaptive() const;
+
+  // The temperature increment for a request of |tenant| starting at
+  // |temperature|, given the model's |temperature_inc|.
+  float TemperatureInc(const std::string& tenant, bool latency_sensitive,
+                       float temperature, float temperature_inc);
+
+  // Adds a finished request. Only requests that ran with the configured
+  // fallback, |measured|, tell how much fallback helps the tenant.
+  void Record(const std::string& tenant, const FallbackStats& stats,
+              bool measured);
+
+  FallbackStats Totals() const;
+  std::vector<TenantSummary> Tenants() const;
+
+  static const char* ModeName(Mode mode);
+
+ private:
+  struct Tenant {
+    int64_t requests = 0;
+    // requests limited by the mode since the last probe
+    int since_probe = 0;
+    float fallback_windows = 0.0f;
+    float recovered = 0.0f;
+    float decode_ms = 0.0f;
+    float fallback_ms = 0.0f;
+    // value of |clock_| when last seen
+    uint64_t last_use = 0;
+  };
+
+  static Mode ModeOf(const Tenant& tenant);
+  // Forgets the least recently seen half of the tenants. Requires mtx_ to
+  // be held.
+  void PruneTenantsLocked();
+
+  mutable std::mutex mtx_;
+  bool adaptive_ = false;
+  FallbackStats totals_;
+  uint64_t clock_ = 0;
+  // only kept when adaptive
+  std::unordered_map<std::string, Tenant> tenants_;
+};
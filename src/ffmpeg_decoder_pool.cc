@@ -0,0 +1,460 @@
+#include "ffmpeg_decoder_pool.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fstream>
+#include <mutex>
+#include <vector>
+#include "trantor/utils/Logger.h"
+
+#if defined(__unix__) || (defined(__APPLE__) && defined(__MACH__))
+#define CORTEX_AUDIO_POSIX_SPAWN 1
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <spawn.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+extern char** environ;
+#endif
+
+namespace {
+constexpr int kSampleRate = 16000;
+constexpr size_t kChunkBytes = 64 * 1024;
+// ffmpeg's messages kept for the error, the tail is what matters
+constexpr size_t kMaxErrorBytes = 4096;
+
+void put_le(std::string& s, uint32_t v, int bytes) {
+  for (int i = 0; i < bytes; i++) {
+    s.push_back(static_cast<char>((v >> (8 * i)) & 0xff));
+  }
+}
+
+// Header of a 16-bit mono PCM WAV file holding |data_bytes|
+std::string wav_header(uint64_t data_bytes) {
+  // sizes past 4 GiB are left at the maximum, which readers take as
+  // "up to the end of the file"
+  const uint32_t data_size = static_cast<uint32_t>(
+      (std::min)(data_bytes, uint64_t(0xffffffffu - 36)));
+  std::string h = "RIFF";
+  put_le(h, data_size + 36, 4);
+  h += "WAVEfmt ";
+  put_le(h, 16, 4);
+  put_le(h, 1, 2);  // PCM
+  put_le(h, 1, 2);  // mono
+  put_le(h, kSampleRate, 4);
+  put_le(h, kSampleRate * 2, 4);
+  put_le(h, 2, 2);
+  put_le(h, 16, 2);
+  h += "data";
+  put_le(h, data_size, 4);
+  return h;
+}
+
+#if CORTEX_AUDIO_POSIX_SPAWN
+// Without pipe2, pipes are created and children started under this lock, so
+// no child inherits the ends of another child's pipes.
+std::mutex spawn_mutex;
+
+// Pipe whose ends are not inherited by children
+bool make_pipe(int fds[2]) {
+#if defined(__linux__)
+  return pipe2(fds, O_CLOEXEC) == 0;
+#else
+  if (pipe(fds) != 0) {
+    return false;
+  }
+  fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+  fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+  return true;
+#endif
+}
+
+void close_fd(int& fd) {
+  if (fd >= 0) {
+    close(fd);
+    fd = -1;
+  }
+}
+#endif
+}  // namespace
+
+FfmpegDecoderPool::FfmpegDecoderPool(int n_workers)
+    : n_workers_((std::max)(1, n_workers)) {}
+
+FfmpegDecoderPool::~FfmpegDecoderPool() {
+  {
+    std::lock_guard<std::mutex> lock(mtx_);
+    stop_ = true;
+  }
+  refill_cv_.notify_all();
+  if (refill_thread_.joinable()) {
+    refill_thread_.join();
+  }
+  for (auto& process : idle_) {
+    Kill(process);
+  }
+}
+
+bool FfmpegDecoderPool::Supported() {
+#if CORTEX_AUDIO_POSIX_SPAWN
+  return true;
+#else
+  return false;
+#endif
+}
+
+bool FfmpegDecoderPool::DecodeToWav(const std::string& input,
+                                    const std::string& output,
+                                    std::string& error) {
+  Process process = Acquire();
+  bool is_decoded = false;
+  bool fell_back = false;
+  if (process.pid >= 0) {
+    is_decoded = Run(process, input, output, error);
+  }
+  if (!is_decoded) {
+    // the format may need to seek, or the process could not be started
+    fell_back = true;
+    std::string path_error;
+    Process path_process;
+    if (Spawn(input, path_process, path_error) &&
+        Run(path_process, input, output, path_error)) {
+      is_decoded = true;
+    } else {
+      error = path_error.empty() ? error : path_error;
+    }
+  }
+  Release();
+
+  std::lock_guard<std::mutex> lock(mtx_);
+  stats_.decodes++;
+  if (fell_back) {
+    stats_.path_fallbacks++;
+  }
+  if (!is_decoded) {
+    stats_.failures++;
+  }
+  return is_decoded;
+}
+
+void FfmpegDecoderPool::SetWorkers(int n_workers) {
+  std::vector<Process> surplus;
+  {
+    std::lock_guard<std::mutex> lock(mtx_);
+    n_workers_ = (std::max)(1, n_workers);
+    while (static_cast<int>(idle_.size()) > n_workers_) {
+      surplus.push_back(idle_.back());
+      idle_.pop_back();
+    }
+  }
+  slot_cv_.notify_all();
+  for (auto& process : surplus) {
+    Kill(process);
+  }
+}
+
+FfmpegDecoderPool::Stats FfmpegDecoderPool::GetStats() const {
+  std::lock_guard<std::mutex> lock(mtx_);
+  Stats stats = stats_;
+  stats.idle = static_cast<int>(idle_.size());
+  stats.busy = busy_;
+  stats.waiting = waiting_;
+  return stats;
+}
+
+FfmpegDecoderPool::Process FfmpegDecoderPool::Acquire() {
+  std::unique_lock<std::mutex> lock(mtx_);
+  if (busy_ >= n_workers_) {
+    if (waiting_ >= n_workers_ * kMaxWaitingPerWorker) {
+      stats_.rejected++;
+      throw DecoderSaturatedError(
+          "All " + std::to_string(n_workers_) + " ffmpeg decoders are busy "
+          "and " + std::to_string(waiting_) + " requests wait for one");
+    }
+    stats_.waited++;
+    waiting_++;
+    slot_cv_.wait(lock, [this] { return busy_ < n_workers_; });
+    waiting_--;
+  }
+  busy_++;
+  if (!refill_thread_.joinable() && Supported()) {
+    refill_thread_ = std::thread(&FfmpegDecoderPool::RefillLoop, this);
+  }
+  refill_ = true;
+  refill_cv_.notify_one();
+
+  Process process;
+  if (!idle_.empty()) {
+    process = idle_.front();
+    idle_.pop_front();
+    return process;
+  }
+  // none ready yet, this request pays for the start
+  lock.unlock();
+  std::string error;
+  if (Spawn("", process, error)) {
+    lock.lock();
+    stats_.spawned++;
+  } else {
+    LOG_WARN << "Failed to start ffmpeg: " << error;
+  }
+  return process;
+}
+
+void FfmpegDecoderPool::Release() {
+  {
+    std::lock_guard<std::mutex> lock(mtx_);
+    busy_--;
+  }
+  slot_cv_.notify_one();
+}
+
+void FfmpegDecoderPool::RefillLoop() {
+  std::unique_lock<std::mutex> lock(mtx_);
+  while (true) {
+    refill_cv_.wait(lock, [this] { return stop_ || refill_; });
+    if (stop_) {
+      return;
+    }
+    refill_ = false;
+    while (!stop_ && static_cast<int>(idle_.size()) < n_workers_) {
+      lock.unlock();
+      Process process;
+      std::string error;
+      const bool is_started = Spawn("", process, error);
+      lock.lock();
+      if (!is_started) {
+        // retried when the next decode asks for a process
+        LOG_WARN << "Failed to start ffmpeg: " << error;
+        break;
+      }
+      stats_.spawned++;
+      idle_.push_back(process);
+    }
+  }
+}
+
+#if CORTEX_AUDIO_POSIX_SPAWN
+bool FfmpegDecoderPool::Spawn(const std::string& input_path,
+                              Process& process, std::string& error) {
+  // a decoder exiting early must fail the write, not kill the server
+  struct sigaction sa;
+  if (sigaction(SIGPIPE, nullptr, &sa) == 0 && sa.sa_handler == SIG_DFL) {
+    signal(SIGPIPE, SIG_IGN);
+  }
+
+#if !defined(__linux__)
+  std::lock_guard<std::mutex> spawn_lock(spawn_mutex);
+#endif
+  const bool from_stdin = input_path.empty();
+  int in[2] = {-1, -1};
+  int out[2] = {-1, -1};
+  int err[2] = {-1, -1};
+  if ((from_stdin && !make_pipe(in)) || !make_pipe(out) || !make_pipe(err)) {
+    error = std::string("pipe: ") + std::strerror(errno);
+    for (int* fds : {in, out, err}) {
+      close_fd(fds[0]);
+      close_fd(fds[1]);
+    }
+    return false;
+  }
+
+  std::vector<std::string> args = {"ffmpeg", "-hide_banner", "-loglevel",
+                                   "error"};
+  if (from_stdin) {
+    args.insert(args.end(), {"-i", "pipe:0"});
+  } else {
+    args.insert(args.end(), {"-nostdin", "-i", input_path});
+  }
+  args.insert(args.end(), {"-vn", "-ac", "1", "-ar",
+                           std::to_string(kSampleRate), "-f", "s16le",
+                           "-c:a", "pcm_s16le", "pipe:1"});
+  std::vector<char*> argv;
+  for (auto& arg : args) {
+    argv.push_back(arg.data());
+  }
+  argv.push_back(nullptr);
+
+  posix_spawn_file_actions_t actions;
+  posix_spawn_file_actions_init(&actions);
+  if (from_stdin) {
+    posix_spawn_file_actions_adddup2(&actions, in[0], STDIN_FILENO);
+  } else {
+    posix_spawn_file_actions_addopen(&actions, STDIN_FILENO, "/dev/null",
+                                     O_RDONLY, 0);
+  }
+  posix_spawn_file_actions_adddup2(&actions, out[1], STDOUT_FILENO);
+  posix_spawn_file_actions_adddup2(&actions, err[1], STDERR_FILENO);
+  pid_t pid = -1;
+  const int rc = posix_spawnp(&pid, "ffmpeg", &actions, nullptr, argv.data(),
+                              environ);
+  posix_spawn_file_actions_destroy(&actions);
+  close_fd(in[0]);
+  close_fd(out[1]);
+  close_fd(err[1]);
+  if (rc != 0) {
+    error = std::string("ffmpeg: ") + std::strerror(rc);
+    close_fd(in[1]);
+    close_fd(out[0]);
+    close_fd(err[0]);
+    return false;
+  }
+
+  process.pid = pid;
+  process.in = in[1];
+  process.out = out[0];
+  process.err = err[0];
+  if (process.in >= 0) {
+    fcntl(process.in, F_SETFL, fcntl(process.in, F_GETFL) | O_NONBLOCK);
+  }
+  return true;
+}
+
+bool FfmpegDecoderPool::Run(Process& process, const std::string& input,
+                            const std::string& output, std::string& error) {
+  std::ifstream in;
+  if (process.in >= 0) {
+    in.open(input, std::ios::binary);
+    if (!in) {
+      error = "Failed to open " + input;
+      Kill(process);
+      return false;
+    }
+  }
+  std::ofstream out(output, std::ios::binary | std::ios::trunc);
+  if (!out) {
+    error = "Failed to create " + output;
+    Kill(process);
+    return false;
+  }
+  out << wav_header(0);
+
+  // One thread feeds stdin and drains stdout and stderr, whichever is
+  // ready, so neither side blocks on a full pipe.
+  std::vector<char> pending;
+  size_t pending_offset = 0;
+  std::vector<char> buf(kChunkBytes);
+  std::string messages;
+  uint64_t data_bytes = 0;
+  while (process.out >= 0 || process.err >= 0) {
+    pollfd fds[3];
+    int n_fds = 0;
+    int in_index = -1, out_index = -1, err_index = -1;
+    if (process.in >= 0) {
+      in_index = n_fds;
+      fds[n_fds++] = {process.in, POLLOUT, 0};
+    }
+    if (process.out >= 0) {
+      out_index = n_fds;
+      fds[n_fds++] = {process.out, POLLIN, 0};
+    }
+    if (process.err >= 0) {
+      err_index = n_fds;
+      fds[n_fds++] = {process.err, POLLIN, 0};
+    }
+    if (poll(fds, n_fds, -1) < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      error = std::string("poll: ") + std::strerror(errno);
+      break;
+    }
+
+    if (in_index >= 0 && fds[in_index].revents != 0) {
+      if (pending_offset == pending.size()) {
+        pending.resize(kChunkBytes);
+        in.read(pending.data(), pending.size());
+        pending.resize(static_cast<size_t>(in.gcount()));
+        pending_offset = 0;
+      }
+      if (pending.empty()) {
+        // end of input, ffmpeg flushes and exits
+        close_fd(process.in);
+      } else {
+        const ssize_t n = write(process.in, pending.data() + pending_offset,
+                                pending.size() - pending_offset);
+        if (n > 0) {
+          pending_offset += n;
+        } else if (n < 0 && errno != EAGAIN && errno != EINTR) {
+          // ffmpeg stopped reading: it failed, or has all it needs
+          close_fd(process.in);
+        }
+      }
+    }
+    if (out_index >= 0 && fds[out_index].revents != 0) {
+      const ssize_t n = read(process.out, buf.data(), buf.size());
+      if (n > 0) {
+        out.write(buf.data(), n);
+        data_bytes += n;
+      } else if (n == 0 || (errno != EAGAIN && errno != EINTR)) {
+        close_fd(process.out);
+      }
+    }
+    if (err_index >= 0 && fds[err_index].revents != 0) {
+      const ssize_t n = read(process.err, buf.data(), buf.size());
+      if (n > 0) {
+        messages.append(buf.data(), n);
+        if (messages.size() > kMaxErrorBytes) {
+          messages.erase(0, messages.size() - kMaxErrorBytes);
+        }
+      } else if (n == 0 || (errno != EAGAIN && errno != EINTR)) {
+        close_fd(process.err);
+      }
+    }
+  }
+  close_fd(process.in);
+  close_fd(process.out);
+  close_fd(process.err);
+
+  int status = 0;
+  while (waitpid(process.pid, &status, 0) < 0 && errno == EINTR) {
+  }
+  process.pid = -1;
+  const bool exited_ok = WIFEXITED(status) && WEXITSTATUS(status) == 0;
+  if (exited_ok && data_bytes > 0 && error.empty()) {
+    out.seekp(0);
+    out << wav_header(data_bytes);
+    out.close();
+    if (out) {
+      return true;
+    }
+    error = "Failed to write " + output;
+    return false;
+  }
+  if (error.empty()) {
+    while (!messages.empty() && messages.back() == '\n') {
+      messages.pop_back();
+    }
+    error = messages.empty() ? "ffmpeg produced no audio" : messages;
+  }
+  return false;
+}
+
+void FfmpegDecoderPool::Kill(Process& process) {
+  close_fd(process.in);
+  close_fd(process.out);
+  close_fd(process.err);
+  if (process.pid >= 0) {
+    kill(process.pid, SIGKILL);
+    while (waitpid(process.pid, nullptr, 0) < 0 && errno == EINTR) {
+    }
+    process.pid = -1;
+  }
+}
+#else
+bool FfmpegDecoderPool::Spawn(const std::string& input_path,
+                              Process& process, std::string& error) {
+  error = "ffmpeg decoders are not supported on this platform";
+  return false;
+}
+
+bool FfmpegDecoderPool::Run(Process& process, const std::string& input,
+                            const std::string& output, std::string& error) {
+  return false;
+}
+
+void FfmpegDecoderPool::Kill(Process& process) {}
+#endif
@@ -0,0 +1,105 @@
+#pragma once
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+
+// Thrown when every decoder is busy and too many requests wait already.
+struct DecoderSaturatedError : public std::runtime_error {
+  using std::runtime_error::runtime_error;
+};
+
+// ffmpeg processes started ahead of the requests that use them. A process
+// decodes one input: it reads the encoded bytes on stdin and streams 16 kHz
+// mono s16le PCM back on stdout, which is written out as a WAV file. No
+// shell is involved and the paths never reach a command line. When a
+// process is taken, a background thread starts its replacement, so
+// requests do not wait for fork and exec.
+//
+// At most |n_workers| inputs are decoded at a time. Requests beyond that
+// wait, up to kMaxWaitingPerWorker per worker; further ones are rejected
+// with DecoderSaturatedError instead of queueing without bound.
+//
+// Formats that need to seek, such as MP4 with its index at the end, cannot
+// be read from a pipe: when decoding from stdin fails, the file is decoded
+// again by a process given its path.
+class FfmpegDecoderPool {
+ public:
+  struct Stats {
+    // inputs decoded, failed ones included
+    int64_t decodes = 0;
+    int64_t failures = 0;
+    // decoded from the path after stdin failed
+    int64_t path_fallbacks = 0;
+    // requests that had to wait for a decoder, and that were turned away
+    int64_t waited = 0;
+    int64_t rejected = 0;
+    int64_t spawned = 0;
+    int idle = 0;
+    int busy = 0;
+    int waiting = 0;
+  };
+
+  static constexpr int kMaxWaitingPerWorker = 4;
+
+  // Processes are started on the first Decode.
+  explicit FfmpegDecoderPool(int n_workers = 2);
+  ~FfmpegDecoderPool();
+
+  FfmpegDecoderPool(const FfmpegDecoderPool&) = delete;
+  FfmpegDecoderPool& operator=(const FfmpegDecoderPool&) = delete;
+
+  // Whether decoders can be started on this platform; callers fall back to
+  // convert_to_wav otherwise.
+  static bool Supported();
+
+  // Decodes |input| into a 16 kHz mono PCM WAV file at |output|. Returns
+  // false with |error| set (ffmpeg's messages) if ffmpeg fails; throws
+  // DecoderSaturatedError if the pool is saturated.
+  bool DecodeToWav(const std::string& input, const std::string& output,
+                   std::string& error);
+
+  void SetWorkers(int n_workers);
+
+  Stats GetStats() const;
+
+ private:
+  struct Process {
+    int pid = -1;
+    // our ends of the child's stdin, stdout and stderr; stdin is -1 when
+    // the child reads its input from a path
+    int in = -1;
+    int out = -1;
+    int err = -1;
+  };
+
+  // Starts ffmpeg reading from stdin, or from |input_path| if not empty.
+  static bool Spawn(const std::string& input_path, Process& process,
+                    std::string& error);
+  // Streams |input| (when the child reads stdin) and the child's output to
+  // |output|, reaps the child and returns whether it succeeded.
+  static bool Run(Process& process, const std::string& input,
+                  const std::string& output, std::string& error);
+  static void Kill(Process& process);
+
+  // Takes an idle process, or starts one, once fewer than |n_workers_|
+  // decodes run.
+  Process Acquire();
+  void Release();
+  void RefillLoop();
+
+  mutable std::mutex mtx_;
+  std::condition_variable slot_cv_;
+  std::condition_variable refill_cv_;
+  int n_workers_;
+  int busy_ = 0;
+  int waiting_ = 0;
+  bool refill_ = false;
+  bool stop_ = false;
+  std::deque<Process> idle_;
+  std::thread refill_thread_;
+  Stats stats_;
+};
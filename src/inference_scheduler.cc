@@ -0,0 +1,223 @@
+#include "inference_scheduler.h"
+
+#include <algorithm>
+#include "trantor/utils/Logger.h"
+
+InferenceScheduler::~InferenceScheduler() {
+  Stop();
+}
+
+void InferenceScheduler::Start(
+    int n_workers, const std::string& name,
+    const std::vector<int>& worker_groups,
+    const std::function<void(int)>& on_worker_start) {
+  Stop();
+  n_workers = (std::max)(1, n_workers);
+  {
+    std::lock_guard<std::mutex> l(mtx_);
+    stop_ = false;
+    worker_group_.assign(n_workers, 0);
+    int n_groups = 1;
+    for (int i = 0; i < n_workers && i < int(worker_groups.size()); i++) {
+      worker_group_[i] = (std::max)(0, worker_groups[i]);
+      n_groups = (std::max)(n_groups, worker_group_[i] + 1);
+    }
+    groups_.clear();
+    groups_.resize(n_groups);
+  }
+  for (int i = 0; i < n_workers; i++) {
+    workers_.emplace_back([this, i, on_worker_start] {
+      if (on_worker_start) {
+        on_worker_start(i);
+      }
+      WorkerLoop(i);
+    });
+  }
+  LOG_INFO << "Started " << n_workers << " inference worker(s) for " << name;
+}
+
+void InferenceScheduler::Stop() {
+  std::vector<Job> dropped;
+  {
+    std::lock_guard<std::mutex> l(mtx_);
+    stop_ = true;
+    for (auto& q : queues_) {
+      for (auto& entry : q) {
+        dropped.push_back(std::move(entry.second.job));
+      }
+      q.clear();
+    }
+    queued_cost_ = {};
+    for (auto& g : groups_) {
+      g.cv.notify_all();
+    }
+  }
+  for (auto& job : dropped) {
+    if (job.on_dropped) {
+      job.on_dropped();
+    }
+  }
+  for (auto& w : workers_) {
+    if (w.joinable()) {
+      w.join();
+    }
+  }
+  workers_.clear();
+}
+
+void InferenceScheduler::SetTenantWeight(const std::string& tenant,
+                                         double weight) {
+  std::lock_guard<std::mutex> l(mtx_);
+  weights_[tenant] = weight > 0 ? weight : 1.0;
+}
+
+void InferenceScheduler::Submit(Job&& job) {
+  Group* group = nullptr;
+  {
+    std::unique_lock<std::mutex> l(mtx_);
+    if (stop_) {
+      l.unlock();
+      if (job.on_dropped) {
+        job.on_dropped();
+      }
+      return;
+    }
+    const auto cls = static_cast<size_t>(job.priority);
+    const auto cost = (std::max)(int64_t(1), job.cost);
+    auto w = weights_.find(job.tenant);
+    const double weight = w == weights_.end() ? 1.0 : w->second;
+
+    auto& last_finish = last_finish_[job.tenant];
+    const double start_tag = (std::max)(virtual_time_[cls], last_finish[cls]);
+    const double finish_tag = start_tag + double(cost) / weight;
+    last_finish[cls] = finish_tag;
+    if (last_finish_.size() >= prune_at_) {
+      PruneTenantsLocked();
+    }
+
+    queued_cost_[cls] += cost;
+    queues_[cls].emplace(Tag{finish_tag, seq_++},
+                         QueuedJob{start_tag, std::move(job)});
+    group = ReserveIdleLocked();
+  }
+  if (group != nullptr) {
+    group->cv.notify_one();
+  }
+}
+
+void InferenceScheduler::RunPreemptors(int worker_id, int64_t max_cost) {
+  const auto cls = static_cast<size_t>(Priority::kInteractive);
+  while (true) {
+    Job job;
+    {
+      std::lock_guard<std::mutex> l(mtx_);
+      if (stop_ || !PopLocked(cls, max_cost, job)) {
+        return;
+      }
+    }
+    RunJob(worker_id, job);
+  }
+}
+
+int64_t InferenceScheduler::PendingCost(Priority priority) const {
+  std::lock_guard<std::mutex> l(mtx_);
+  int64_t cost = running_cost_;
+  for (size_t cls = 0; cls <= static_cast<size_t>(priority); cls++) {
+    cost += queued_cost_[cls];
+  }
+  return cost;
+}
+
+void InferenceScheduler::WorkerLoop(int worker_id) {
+  Group* group = nullptr;
+  {
+    std::lock_guard<std::mutex> l(mtx_);
+    group = &groups_[worker_group_[worker_id]];
+  }
+  while (true) {
+    Job job;
+    {
+      std::unique_lock<std::mutex> l(mtx_);
+      const bool has_work =
+          std::any_of(queues_.begin(), queues_.end(),
+                      [](const auto& q) { return !q.empty(); });
+      if (!stop_ && !has_work) {
+        group->idle++;
+        group->cv.wait(l,
+                       [this, group] { return stop_ || group->wakeups > 0; });
+        group->idle--;
+        if (group->wakeups > 0) {
+          group->wakeups--;
+        }
+      }
+      if (stop_) {
+        return;
+      }
+      bool popped = false;
+      for (size_t cls = 0; cls < kNumClasses && !popped; cls++) {
+        popped = PopLocked(cls, INT64_MAX, job);
+      }
+      if (!popped) {
+        // a worker finishing its job took it first
+        continue;
+      }
+    }
+    RunJob(worker_id, job);
+  }
+}
+
+void InferenceScheduler::RunJob(int worker_id, Job& job) {
+  const auto cost = (std::max)(int64_t(1), job.cost);
+  try {
+    job.task(worker_id);
+  } catch (const std::exception& e) {
+    // Tasks report their own errors; this only keeps the worker alive.
+    LOG_ERROR << "Inference task failed: " << e.what();
+  }
+  std::lock_guard<std::mutex> l(mtx_);
+  running_cost_ -= cost;
+}
+
+bool InferenceScheduler::PopLocked(size_t cls, int64_t max_cost, Job& job) {
+  auto& q = queues_[cls];
+  auto it = std::find_if(q.begin(), q.end(), [max_cost](const auto& e) {
+    return e.second.job.cost <= max_cost;
+  });
+  if (it == q.end()) {
+    return false;
+  }
+  // Start-time fair queuing: virtual time follows the job in service.
+  virtual_time_[cls] = (std::max)(virtual_time_[cls], it->second.start_tag);
+  job = std::move(it->second.job);
+  q.erase(it);
+
+  const auto cost = (std::max)(int64_t(1), job.cost);
+  queued_cost_[cls] -= cost;
+  running_cost_ += cost;
+  return true;
+}
+
+void InferenceScheduler::PruneTenantsLocked() {
+  for (auto it = last_finish_.begin(); it != last_finish_.end();) {
+    bool idle = true;
+    for (size_t cls = 0; cls < kNumClasses; cls++) {
+      idle = idle && it->second[cls] <= virtual_time_[cls];
+    }
+    it = idle ? last_finish_.erase(it) : std::next(it);
+  }
+  prune_at_ = (std::max)(kMinPruneSize, 2 * last_finish_.size());
+}
+
+InferenceScheduler::Group* InferenceScheduler::ReserveIdleLocked() {
+  Group* best = nullptr;
+  for (auto& g : groups_) {
+    if (g.idle - g.wakeups > 0 &&
+        (best == nullptr || g.idle - g.wakeups > best->idle - best->wakeups)) {
+      best = &g;
+    }
+  }
+  if (best != nullptr) {
+    best->wakeups++;
+  }
+  return best;
+}
@@ -0,0 +1,126 @@
+#pragma once
+#include <array>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "transcription_request.h"
+
+// Reported to the jobs a scheduler drops because it stopped before running
+// them, e.g. when their model is reloaded.
+struct SchedulerStoppedError : public std::runtime_error {
+  using std::runtime_error::runtime_error;
+};
+
+// Orders inference work in front of a model's workers.
+// Jobs are served strictly by priority class. Inside a class, tenants share
+// the workers through weighted fair queuing: every job gets a virtual finish
+// tag of start + cost / weight, and the smallest tag runs first, so a tenant
+// with a large backlog cannot starve the others.
+//
+// Workers can be split into groups (the NUMA node they are pinned to). A new
+// job wakes an idle worker of the group with the most idle workers, so work
+// goes to the node with spare capacity.
+class InferenceScheduler {
+ public:
+  using Priority = audio::inferences::RequestPriority;
+  // Receives the index of the worker that runs the job.
+  using Task = std::function<void(int)>;
+
+  struct Job {
+    Priority priority = Priority::kStandard;
+    std::string tenant;
+    // Work estimate used for fair queuing, in milliseconds of audio.
+    int64_t cost = 0;
+    Task task;
+    // Runs instead of |task| when the job is dropped, so its submitter does
+    // not wait forever.
+    std::function<void()> on_dropped;
+  };
+
+  InferenceScheduler() = default;
+  ~InferenceScheduler();
+
+  // |worker_groups| holds the group of every worker, empty puts them all in
+  // one group. |on_worker_start| runs on every worker thread before its first
+  // job, with the worker index.
+  void Start(int n_workers, const std::string& name,
+             const std::vector<int>& worker_groups = {},
+             const std::function<void(int)>& on_worker_start = nullptr);
+  // Stops the workers after their current job. Queued jobs are dropped,
+  // as are jobs submitted until the next Start.
+  void Stop();
+
+  void SetTenantWeight(const std::string& tenant, double weight);
+
+  void Submit(Job&& job);
+
+  // Called by a long running job at a chunk boundary. Runs queued
+  // interactive jobs no longer than |max_cost| on the calling worker before
+  // returning, so short clips do not wait behind a whole batch file.
+  void RunPreemptors(int worker_id, int64_t max_cost);
+
+  // Audio (ms) that has to be processed before a new job of |priority|
+  // could finish: running jobs plus queued jobs of the same or higher class.
+  int64_t PendingCost(Priority priority) const;
+
+  int NumWorkers() const { return static_cast<int>(workers_.size()); }
+
+ private:
+  static constexpr size_t kNumClasses = 3;
+  // tenants tracked before idle ones are forgotten
+  static constexpr size_t kMinPruneSize = 1024;
+  // (finish tag, sequence number), the sequence keeps FIFO order on ties
+  using Tag = std::pair<double, uint64_t>;
+  struct QueuedJob {
+    double start_tag;
+    Job job;
+  };
+  struct Group {
+    std::condition_variable cv;
+    // workers waiting on |cv|, and how many of them were woken for a job
+    int idle = 0;
+    int wakeups = 0;
+  };
+
+  void WorkerLoop(int worker_id);
+  void RunJob(int worker_id, Job& job);
+  // Pops the next job of |cls| into |job|. Requires mtx_ to be held.
+  bool PopLocked(size_t cls, int64_t max_cost, Job& job);
+  // Forgets tenants whose last finish tags the virtual time has passed: a
+  // new job of theirs starts at the virtual time like any new tenant's.
+  // Requires mtx_ to be held.
+  void PruneTenantsLocked();
+  // Picks the group with the most idle workers not woken yet and books a
+  // wake up on it. Returns nullptr when every worker is busy, the next one
+  // to finish picks the job up. Requires mtx_ to be held.
+  Group* ReserveIdleLocked();
+
+  mutable std::mutex mtx_;
+  bool stop_ = false;
+  uint64_t seq_ = 0;
+
+  std::array<std::map<Tag, QueuedJob>, kNumClasses> queues_;
+  std::array<double, kNumClasses> virtual_time_ = {};
+  std::array<int64_t, kNumClasses> queued_cost_ = {};
+  int64_t running_cost_ = 0;
+  // key: tenant, value: finish tag of its last queued job per class
+  std::unordered_map<std::string, std::array<double, kNumClasses>>
+      last_finish_;
+  // size of |last_finish_| that triggers the next prune
+  size_t prune_at_ = kMinPruneSize;
+  std::unordered_map<std::string, double> weights_;
+
+  std::deque<Group> groups_;
+  std::vector<int> worker_group_;
+  std::vector<std::thread> workers_;
+};
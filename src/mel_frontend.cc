@@ -0,0 +1,348 @@
+#include "mel_frontend.h"
+
+#include <algorithm>
+#include <cmath>
+#include <mutex>
+#include <thread>
+#include "trantor/utils/Logger.h"
+
+namespace {
+// M_PI needs _USE_MATH_DEFINES with MSVC
+constexpr double kPi = 3.14159265358979323846;
+constexpr int kNFft = 400;
+constexpr int kHop = 160;
+constexpr int kHalf = kNFft / 2;
+constexpr int kNBins = kHalf + 1;
+// whisper pads 30 s of silence after the audio, and reflects the first
+// half window in front of it
+constexpr int kTailPad = WHISPER_SAMPLE_RATE * 30;
+// frames transformed together, and written out to every band row as a run
+constexpr int kBlockFrames = 32;
+
+// Slaney mel scale as librosa has it: linear below 1 kHz, log above
+double hz_to_mel(double hz) {
+  constexpr double kLinear = 200.0 / 3;
+  const double log_step = std::log(6.4) / 27.0;
+  return hz < 1000.0 ? hz / kLinear : 15.0 + std::log(hz / 1000.0) / log_step;
+}
+
+double mel_to_hz(double mel) {
+  constexpr double kLinear = 200.0 / 3;
+  const double log_step = std::log(6.4) / 27.0;
+  return mel < 15.0 ? mel * kLinear
+                     : 1000.0 * std::exp(log_step * (mel - 15.0));
+}
+
+// Runs fn(begin, end) over [0, n) split into |n_threads| ranges, one of them
+// on the calling thread
+template <typename Fn>
+void parallel_for(int n_threads, int n, const Fn& fn) {
+  n_threads = (std::max)(1, (std::min)(n_threads, n));
+  std::vector<std::thread> threads;
+  for (int t = 1; t < n_threads; t++) {
+    threads.emplace_back(fn, int(int64_t(n) * t / n_threads),
+                         int(int64_t(n) * (t + 1) / n_threads));
+  }
+  fn(0, int(int64_t(n) / n_threads));
+  for (auto& thread : threads) {
+    thread.join();
+  }
+}
+}  // namespace
+
+MelFrontend::MelFrontend(int n_mels) : n_mels_(n_mels) {
+  // periodic Hann window
+  hann_.resize(kNFft);
+  for (int i = 0; i < kNFft; i++) {
+    hann_[i] =
+        static_cast<float>(0.5 * (1.0 - std::cos(2.0 * kPi * i / kNFft)));
+  }
+
+  // Stockham passes of the half length complex transform, radix 4 first
+  int n = kHalf;
+  int stride = 1;
+  while (n > 1) {
+    int radix = n;
+    for (int r : {4, 2, 3, 5}) {
+      if (n % r == 0) {
+        radix = r;
+        break;
+      }
+    }
+    Stage stage;
+    stage.radix = radix;
+    stage.n = n;
+    stage.stride = stride;
+    for (int k = 0; k < radix; k++) {
+      // exact values for radix 2 and 4, whose roots are 1, -1, i and -i
+      const double angle = -2.0 * kPi * k / radix;
+      const bool exact = radix == 2 || radix == 4;
+      stage.root_re.push_back(static_cast<float>(
+          exact ? std::lround(std::cos(angle)) : std::cos(angle)));
+      stage.root_im.push_back(static_cast<float>(
+          exact ? std::lround(std::sin(angle)) : std::sin(angle)));
+    }
+    const int m = n / radix;
+    for (int p = 0; p < m; p++) {
+      for (int u = 0; u < radix; u++) {
+        const double angle = -2.0 * kPi * p * u / n;
+        stage.w_re.push_back(static_cast<float>(std::cos(angle)));
+        stage.w_im.push_back(static_cast<float>(std::sin(angle)));
+      }
+    }
+    stages_.push_back(std::move(stage));
+    n = m;
+    stride *= radix;
+  }
+  for (int k = 0; k <= kHalf; k++) {
+    split_re_.push_back(static_cast<float>(std::cos(-2.0 * kPi * k / kNFft)));
+    split_im_.push_back(static_cast<float>(std::sin(-2.0 * kPi * k / kNFft)));
+  }
+
+  // triangular filters between mel spaced edges up to 8 kHz, each scaled to
+  // unit area (Slaney normalization)
+  std::vector<double> edges(n_mels + 2);
+  const double mel_max = hz_to_mel(WHISPER_SAMPLE_RATE / 2.0);
+  for (int i = 0; i < n_mels + 2; i++) {
+    edges[i] = mel_to_hz(mel_max * i / (n_mels + 1));
+  }
+  for (int i = 0; i < n_mels; i++) {
+    Band band;
+    band.first_bin = -1;
+    const double norm = 2.0 / (edges[i + 2] - edges[i]);
+    for (int k = 0; k < kNBins; k++) {
+      const double hz = double(k) * WHISPER_SAMPLE_RATE / kNFft;
+      const double lower = (hz - edges[i]) / (edges[i + 1] - edges[i]);
+      const double upper = (edges[i + 2] - hz) / (edges[i + 2] - edges[i + 1]);
+      const float weight =
+          static_cast<float>((std::max)(0.0, (std::min)(lower, upper)) * norm);
+      if (weight > 0.0f) {
+        if (band.first_bin < 0) {
+          band.first_bin = k;
+        }
+        band.weights.resize(k - band.first_bin + 1, 0.0f);
+        band.weights.back() = weight;
+      }
+    }
+    if (band.first_bin < 0) {
+      band.first_bin = 0;
+    }
+    bands_.push_back(std::move(band));
+  }
+}
+
+void MelFrontend::PowerSpectra(std::vector<float>& re,
+                               std::vector<float>& im,
+                               std::vector<float>& tmp_re,
+                               std::vector<float>& tmp_im,
+                               std::vector<float>& power) const {
+  // Stockham passes with the frames as the fastest index: a pass over a
+  // block is the pass over one frame with a stride |kBlockFrames| times as
+  // large, and every inner loop runs over at least one value per frame
+  float* x_re = re.data();
+  float* x_im = im.data();
+  float* y_re = tmp_re.data();
+  float* y_im = tmp_im.data();
+  for (const Stage& stage : stages_) {
+    const int r = stage.radix;
+    const int s = stage.stride * kBlockFrames;
+    const int m = stage.n / r;
+    for (int p = 0; p < m; p++) {
+      for (int u = 0; u < r; u++) {
+        float* out_re = y_re + s * (r * p + u);
+        float* out_im = y_im + s * (r * p + u);
+        std::fill(out_re, out_re + s, 0.0f);
+        std::fill(out_im, out_im + s, 0.0f);
+        for (int t = 0; t < r; t++) {
+          const float c_re = stage.root_re[(t * u) % r];
+          const float c_im = stage.root_im[(t * u) % r];
+          const float* a_re = x_re + s * (p + t * m);
+          const float* a_im = x_im + s * (p + t * m);
+          for (int q = 0; q < s; q++) {
+            out_re[q] += a_re[q] * c_re - a_im[q] * c_im;
+            out_im[q] += a_re[q] * c_im + a_im[q] * c_re;
+          }
+        }
+        const float w_re = stage.w_re[p * r + u];
+        const float w_im = stage.w_im[p * r + u];
+        for (int q = 0; q < s; q++) {
+          const float o_re = out_re[q];
+          out_re[q] = o_re * w_re - out_im[q] * w_im;
+          out_im[q] = o_re * w_im + out_im[q] * w_re;
+        }
+      }
+    }
+    std::swap(x_re, y_re);
+    std::swap(x_im, y_im);
+  }
+
+  // untangle the two real transforms packed into the complex one
+  for (int k = 0; k <= kHalf; k++) {
+    const float* a_re = x_re + (k % kHalf) * kBlockFrames;
+    const float* a_im = x_im + (k % kHalf) * kBlockFrames;
+    const float* b_re = x_re + ((kHalf - k) % kHalf) * kBlockFrames;
+    const float* b_im = x_im + ((kHalf - k) % kHalf) * kBlockFrames;
+    const float w_re = split_re_[k];
+    const float w_im = split_im_[k];
+    float* out = power.data() + k * kBlockFrames;
+    for (int f = 0; f < kBlockFrames; f++) {
+      const float e_re = 0.5f * (a_re[f] + b_re[f]);
+      const float e_im = 0.5f * (a_im[f] - b_im[f]);
+      const float o_re = 0.5f * (a_im[f] + b_im[f]);
+      const float o_im = -0.5f * (a_re[f] - b_re[f]);
+      const float f_re = e_re + w_re * o_re - w_im * o_im;
+      const float f_im = e_im + w_re * o_im + w_im * o_re;
+      out[f] = f_re * f_re + f_im * f_im;
+    }
+  }
+}
+
+int MelFrontend::Compute(const float* samples, int n_samples, int n_threads,
+                         std::vector<float>& mel, int* n_audio_frames) const {
+  n_samples = (std::max)(0, n_samples);
+  const int n_frames = (n_samples + kTailPad) / kHop;
+  if (n_audio_frames != nullptr) {
+    // as whisper counts them, frames before the silence it pads with
+    *n_audio_frames = 1 + (n_samples + kHalf - kNFft) / kHop;
+  }
+  mel.resize(size_t(n_mels_) * n_frames);
+
+  // sample |i| of the audio with the reflected half window in front of it
+  // and silence after it
+  auto padded = [samples, n_samples](int i) {
+    const int j = i < kHalf ? kHalf - i : i - kHalf;
+    return j < n_samples ? samples[j] : 0.0f;
+  };
+
+  std::mutex max_mtx;
+  double mel_max = -1e20;
+  parallel_for(n_threads, n_frames, [&](int begin, int end) {
+    const size_t n_block = size_t(kHalf) * kBlockFrames;
+    std::vector<float> re(n_block), im(n_block), tmp_re(n_block),
+        tmp_im(n_block);
+    std::vector<float> power(size_t(kNBins) * kBlockFrames);
+    std::vector<double> sum(kBlockFrames);
+    double local_max = -1e20;
+    for (int b0 = begin; b0 < end; b0 += kBlockFrames) {
+      const int b1 = (std::min)(end, b0 + kBlockFrames);
+      if (b0 * kHop >= n_samples + kHalf) {
+        // only padding: every band is at the log floor
+        for (int b = 0; b < n_mels_; b++) {
+          float* row = mel.data() + size_t(b) * n_frames;
+          std::fill(row + b0, row + b1, -10.0f);
+        }
+        local_max = (std::max)(local_max, -10.0);
+        continue;
+      }
+      // windowed frames, even samples in the real part and odd ones in the
+      // imaginary part; frames past |b1| stay silent
+      std::fill(re.begin(), re.end(), 0.0f);
+      std::fill(im.begin(), im.end(), 0.0f);
+      for (int i = b0; i < b1; i++) {
+        const int start = i * kHop;
+        if (start >= n_samples + kHalf) {
+          continue;
+        }
+        for (int j = 0; j < kHalf; j++) {
+          re[j * kBlockFrames + i - b0] =
+              hann_[2 * j] * padded(start + 2 * j);
+          im[j * kBlockFrames + i - b0] =
+              hann_[2 * j + 1] * padded(start + 2 * j + 1);
+        }
+      }
+      PowerSpectra(re, im, tmp_re, tmp_im, power);
+
+      for (int b = 0; b < n_mels_; b++) {
+        const Band& band = bands_[b];
+        std::fill(sum.begin(), sum.end(), 0.0);
+        for (size_t k = 0; k < band.weights.size(); k++) {
+          const float* bin = power.data() + (band.first_bin + k) * kBlockFrames;
+          for (int f = 0; f < kBlockFrames; f++) {
+            sum[f] += bin[f] * band.weights[k];
+          }
+        }
+        float* row = mel.data() + size_t(b) * n_frames;
+        for (int i = b0; i < b1; i++) {
+          row[i] = static_cast<float>(
+              std::log10((std::max)(sum[i - b0], 1e-10)));
+          local_max = (std::max)(local_max, double(row[i]));
+        }
+      }
+    }
+    std::lock_guard<std::mutex> lock(max_mtx);
+    mel_max = (std::max)(mel_max, local_max);
+  });
+
+  // dynamic range of 8 (80 dB) below the loudest value, then scaled
+  const double floor = mel_max - 8.0;
+  auto normalize = [&mel, floor](int begin, int end) {
+    for (int i = begin; i < end; i++) {
+      mel[i] = static_cast<float>(((std::max)(double(mel[i]), floor) + 4.0) /
+                                  4.0);
+    }
+  };
+  parallel_for(n_threads, static_cast<int>(mel.size()), normalize);
+  return n_frames;
+}
+
+bool MelFrontend::MatchesWhisper(struct whisper_context* ctx,
+                                 struct whisper_state* state,
+                                 int n_threads) const {
+  if (whisper_model_n_mels(ctx) != n_mels_) {
+    return false;
+  }
+  // a tone sweeping up over a little noise
+  std::vector<float> signal(3 * WHISPER_SAMPLE_RATE);
+  uint32_t seed = 1;
+  double phase = 0.0;
+  for (size_t i = 0; i < signal.size(); i++) {
+    phase += 2.0 * kPi * (200.0 + 3000.0 * i / signal.size()) /
+             WHISPER_SAMPLE_RATE;
+    seed = seed * 1664525u + 1013904223u;
+    const double noise = ((seed >> 8) / 16777216.0 - 0.5) * 0.02;
+    signal[i] = static_cast<float>(0.3 * std::sin(phase) + noise);
+  }
+
+  const int n_vocab = whisper_n_vocab(ctx);
+  const whisper_token sot = whisper_token_sot(ctx);
+  // encoder output of whisper's own spectrogram, seen through one decoder
+  // step
+  if (whisper_pcm_to_mel_with_state(ctx, state, signal.data(),
+                                    static_cast<int>(signal.size()),
+                                    n_threads) != 0 ||
+      whisper_encode_with_state(ctx, state, 0, n_threads) != 0 ||
+      whisper_decode_with_state(ctx, state, &sot, 1, 0, n_threads) != 0) {
+    return false;
+  }
+  const float* logits = whisper_get_logits_from_state(state);
+  std::vector<float> expected(logits, logits + n_vocab);
+
+  // the same through this spectrogram and whisper_full without samples, as
+  // Inference runs it; language detection encodes it and returns
+  std::vector<float> mel;
+  const int n_frames = Compute(signal.data(), static_cast<int>(signal.size()),
+                               n_threads, mel, nullptr);
+  whisper_full_params wparams =
+      whisper_full_default_params(WHISPER_SAMPLING_GREEDY);
+  wparams.n_threads = n_threads;
+  wparams.print_progress = false;
+  wparams.language = "auto";
+  wparams.detect_language = true;
+  if (whisper_set_mel_with_state(ctx, state, mel.data(), n_frames,
+                                 n_mels_) != 0 ||
+      whisper_full_with_state(ctx, state, wparams, signal.data(), 0) != 0 ||
+      whisper_decode_with_state(ctx, state, &sot, 1, 0, n_threads) != 0) {
+    return false;
+  }
+  logits = whisper_get_logits_from_state(state);
+  float scale = 1.0f;
+  float diff = 0.0f;
+  for (int i = 0; i < n_vocab; i++) {
+    scale = (std::max)(scale, std::fabs(expected[i]));
+    diff = (std::max)(diff, std::fabs(expected[i] - logits[i]));
+  }
+  LOG_INFO << "Mel front end: largest logit difference to whisper's own "
+              "spectrogram "
+           << diff << " (largest logit " << scale << ")";
+  return diff < 5e-3f * scale;
+}
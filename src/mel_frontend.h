@@ -0,0 +1,72 @@
+#pragma once
+#include <cstdint>
+#include <vector>
+
+#include "whisper.h"
+
+// Log-mel spectrogram front end computing what whisper_pcm_to_mel does, for
+// whisper_set_mel_with_state.
+//
+// The FFT runs on a plan built once: the 400 point real transform is done as
+// a 200 point complex one, in Stockham passes with every twiddle
+// precomputed. Blocks of frames are transformed together over split real
+// and imaginary arrays, so the inner loops run across frames and vectorize.
+// The Hann window and the mel filterbank are precomputed too, the filterbank
+// as the band of bins each filter covers instead of a dense matrix.
+//
+// whisper keeps its filterbank inside the model; this one is built the way
+// whisper's were generated (librosa, Slaney mel scale and normalization).
+// MatchesWhisper checks the result against the model before it is used.
+class MelFrontend {
+ public:
+  explicit MelFrontend(int n_mels);
+
+  int n_mels() const { return n_mels_; }
+
+  // The spectrogram of |samples|, band major as whisper_set_mel_with_state
+  // takes it, padded with 30 s of silence like whisper pads it. Returns the
+  // number of frames; |n_audio_frames| receives how many of them hold audio.
+  // Frames are split over |n_threads| threads.
+  int Compute(const float* samples, int n_samples, int n_threads,
+              std::vector<float>& mel, int* n_audio_frames) const;
+
+  // Whether |ctx| encodes this front end's spectrogram of a test signal like
+  // its own, and whisper_full keeps a spectrogram set before it is called
+  // without samples. Runs the encoder twice on |state|.
+  bool MatchesWhisper(struct whisper_context* ctx, struct whisper_state* state,
+                      int n_threads) const;
+
+ private:
+  struct Stage {
+    int radix;
+    // transform length and stride of the pass
+    int n;
+    int stride;
+    // e^(-2 pi i k / radix)
+    std::vector<float> root_re;
+    std::vector<float> root_im;
+    // twiddles of the pass, radix per output group
+    std::vector<float> w_re;
+    std::vector<float> w_im;
+  };
+  struct Band {
+    int first_bin;
+    std::vector<float> weights;
+  };
+
+  // Power spectra of a block of windowed frames, the frames being the
+  // fastest index: |re| and |im| hold the even and odd samples of every
+  // frame on input, |power| receives n_fft / 2 + 1 bins of every frame.
+  // |re|, |im| and the temporaries are overwritten.
+  void PowerSpectra(std::vector<float>& re, std::vector<float>& im,
+                    std::vector<float>& tmp_re, std::vector<float>& tmp_im,
+                    std::vector<float>& power) const;
+
+  int n_mels_;
+  std::vector<float> hann_;
+  std::vector<Stage> stages_;
+  // e^(-2 pi i k / n_fft) for splitting the packed real transform
+  std::vector<float> split_re_;
+  std::vector<float> split_im_;
+  std::vector<Band> bands_;
+};
@@ -0,0 +1,413 @@
+#include "model_quantizer.h"
+
+#include <algorithm>
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <thread>
+#include <vector>
+#include "trantor/utils/Logger.h"
+
+namespace {
+struct QuantType {
+  const char* name;
+  enum ggml_type type;
+  enum ggml_ftype ftype;
+};
+
+constexpr QuantType kQuantTypes[] = {
+    {"q8_0", GGML_TYPE_Q8_0, GGML_FTYPE_MOSTLY_Q8_0},
+    {"q5_1", GGML_TYPE_Q5_1, GGML_FTYPE_MOSTLY_Q5_1},
+    {"q5_0", GGML_TYPE_Q5_0, GGML_FTYPE_MOSTLY_Q5_0},
+    {"q4_1", GGML_TYPE_Q4_1, GGML_FTYPE_MOSTLY_Q4_1},
+    {"q4_0", GGML_TYPE_Q4_0, GGML_FTYPE_MOSTLY_Q4_0},
+};
+
+// whisper.cpp's quantize example leaves these as they are
+constexpr const char* kKeptTensors[] = {
+    "encoder.conv1.bias",
+    "encoder.conv2.bias",
+    "encoder.positional_embedding",
+    "decoder.positional_embedding",
+};
+
+// hyperparameters in file order, the last one being the file type
+constexpr int kNumHparams = 11;
+
+std::string ftype_name(int32_t ftype) {
+  switch (ftype % GGML_QNT_VERSION_FACTOR) {
+    case GGML_FTYPE_ALL_F32:
+      return "f32";
+    case GGML_FTYPE_MOSTLY_F16:
+      return "f16";
+    default:
+      break;
+  }
+  for (const auto& t : kQuantTypes) {
+    if (t.ftype == ftype % GGML_QNT_VERSION_FACTOR) {
+      return t.name;
+    }
+  }
+  return "unknown";
+}
+
+template <typename T>
+bool read_value(std::istream& in, T& value) {
+  return bool(in.read(reinterpret_cast<char*>(&value), sizeof(value)));
+}
+
+template <typename T>
+void write_value(std::ostream& out, const T& value) {
+  out.write(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+// Header of a tensor record
+struct TensorHeader {
+  int32_t n_dims = 0;
+  int32_t ttype = 0;
+  int32_t ne[4] = {1, 1, 1, 1};
+  std::string name;
+
+  int64_t nelements() const {
+    return int64_t(ne[0]) * ne[1] * ne[2] * ne[3];
+  }
+  size_t nbytes() const {
+    const auto type = static_cast<enum ggml_type>(ttype);
+    return nelements() * ggml_type_size(type) / ggml_blck_size(type);
+  }
+};
+
+bool read_tensor_header(std::istream& in, TensorHeader& t) {
+  int32_t name_len = 0;
+  if (!read_value(in, t.n_dims) || !read_value(in, name_len) ||
+      !read_value(in, t.ttype) || t.n_dims < 1 || t.n_dims > 4) {
+    return false;
+  }
+  std::fill(std::begin(t.ne), std::end(t.ne), 1);
+  for (int i = 0; i < t.n_dims; i++) {
+    if (!read_value(in, t.ne[i])) {
+      return false;
+    }
+  }
+  t.name.assign(name_len, '\0');
+  return bool(in.read(t.name.data(), name_len));
+}
+
+void write_tensor_header(std::ostream& out, const TensorHeader& t) {
+  write_value(out, t.n_dims);
+  write_value(out, static_cast<int32_t>(t.name.size()));
+  write_value(out, t.ttype);
+  for (int i = 0; i < t.n_dims; i++) {
+    write_value(out, t.ne[i]);
+  }
+  out.write(t.name.data(), t.name.size());
+}
+
+// Reads the magic and hyperparameters, and copies the mel filters and the
+// vocabulary to |out| if given
+bool read_preamble(std::istream& in, int32_t (&hparams)[kNumHparams],
+                   std::ostream* out) {
+  uint32_t magic = 0;
+  if (!read_value(in, magic) || magic != GGML_FILE_MAGIC) {
+    return false;
+  }
+  for (auto& value : hparams) {
+    if (!read_value(in, value)) {
+      return false;
+    }
+  }
+  const auto start = in.tellg();
+  int32_t n_mel = 0;
+  int32_t n_fft = 0;
+  if (!read_value(in, n_mel) || !read_value(in, n_fft)) {
+    return false;
+  }
+  in.seekg(int64_t(n_mel) * n_fft * sizeof(float), std::ios::cur);
+  int32_t n_vocab = 0;
+  if (!read_value(in, n_vocab)) {
+    return false;
+  }
+  for (int32_t i = 0; i < n_vocab; i++) {
+    uint32_t len = 0;
+    if (!read_value(in, len)) {
+      return false;
+    }
+    in.seekg(len, std::ios::cur);
+  }
+  if (!in) {
+    return false;
+  }
+  if (out != nullptr) {
+    // filters and vocabulary are copied byte for byte
+    const auto end = in.tellg();
+    std::vector<char> bytes(end - start);
+    in.seekg(start);
+    in.read(bytes.data(), bytes.size());
+    out->write(bytes.data(), bytes.size());
+  }
+  return bool(in);
+}
+
+// File type and total tensor bytes of a model file, without its data
+bool scan_model_file(const std::string& path, int32_t& ftype,
+                     int64_t& weights_bytes) {
+  std::ifstream in(path, std::ios::binary);
+  int32_t hparams[kNumHparams];
+  if (!read_preamble(in, hparams, nullptr)) {
+    return false;
+  }
+  ftype = hparams[kNumHparams - 1];
+  weights_bytes = 0;
+  TensorHeader t;
+  while (read_tensor_header(in, t)) {
+    weights_bytes += t.nbytes();
+    in.seekg(t.nbytes(), std::ios::cur);
+  }
+  return true;
+}
+
+// What a cached copy was made from: the source's canonical path, size and
+// modification time, empty if the source cannot be read. A copy is only
+// used if the source is still the file it was made from.
+std::string source_identity(const std::string& model_path) {
+  namespace fs = std::filesystem;
+  std::error_code ec;
+  const auto path = fs::canonical(model_path, ec);
+  if (ec) {
+    return {};
+  }
+  const auto size = fs::file_size(path, ec);
+  if (ec) {
+    return {};
+  }
+  const auto time = fs::last_write_time(path, ec);
+  if (ec) {
+    return {};
+  }
+  return path.string() + "\n" + std::to_string(size) + "\n" +
+         std::to_string(time.time_since_epoch().count()) + "\n";
+}
+
+std::string read_file(const std::string& path) {
+  std::ifstream in(path, std::ios::binary);
+  return std::string(std::istreambuf_iterator<char>(in),
+                     std::istreambuf_iterator<char>());
+}
+
+bool should_quantize(const TensorHeader& t, enum ggml_type type) {
+  if (t.n_dims != 2 ||
+      (t.ttype != GGML_TYPE_F32 && t.ttype != GGML_TYPE_F16) ||
+      t.ne[0] % ggml_blck_size(type) != 0) {
+    return false;
+  }
+  return std::none_of(std::begin(kKeptTensors), std::end(kKeptTensors),
+                      [&t](const char* name) { return t.name == name; });
+}
+
+// Quantizes the rows of |data| into |out| on all cores, returns the size
+size_t quantize_rows(enum ggml_type type, const std::vector<float>& data,
+                     int64_t n_rows, int64_t n_per_row,
+                     std::vector<char>& out) {
+  out.resize(n_rows * n_per_row * ggml_type_size(type) / ggml_blck_size(type));
+  const int64_t n_threads = (std::min)(
+      n_rows, (std::max)(int64_t(1),
+                         int64_t(std::thread::hardware_concurrency())));
+  std::vector<size_t> sizes(n_threads, 0);
+  std::vector<std::thread> threads;
+  for (int64_t i = 0; i < n_threads; i++) {
+    threads.emplace_back([&, i] {
+      const int64_t first = n_rows * i / n_threads;
+      const int64_t last = n_rows * (i + 1) / n_threads;
+      // ggml places the rows from |first| on in |out| itself
+      sizes[i] = ggml_quantize_chunk(type, data.data(), out.data(),
+                                     first * n_per_row, last - first,
+                                     n_per_row, nullptr);
+    });
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  size_t size = 0;
+  for (size_t s : sizes) {
+    size += s;
+  }
+  return size;
+}
+}  // namespace
+
+bool ParseQuantizationType(const std::string& name, enum ggml_type& type) {
+  for (const auto& t : kQuantTypes) {
+    if (name == t.name) {
+      type = t.type;
+      return true;
+    }
+  }
+  return false;
+}
+
+std::string QuantizedModelPath(const std::string& model_path,
+                               const std::string& type) {
+  std::filesystem::path path(model_path);
+  return (path.parent_path() /
+          (path.stem().string() + "." + type + path.extension().string()))
+      .string();
+}
+
+bool QuantizeModelFile(const std::string& src, const std::string& dst,
+                       enum ggml_type type, ModelQuantization& result,
+                       std::string& error) {
+  std::ifstream in(src, std::ios::binary);
+  std::ofstream out(dst, std::ios::binary | std::ios::trunc);
+  if (!in || !out) {
+    error = "Cannot open " + std::string(!in ? src : dst);
+    return false;
+  }
+
+  int32_t hparams[kNumHparams];
+  write_value(out, uint32_t(GGML_FILE_MAGIC));
+  std::streampos hparams_pos = out.tellp();
+  for (int i = 0; i < kNumHparams; i++) {
+    write_value(out, int32_t(0));
+  }
+  if (!read_preamble(in, hparams, &out)) {
+    error = src + " is not a whisper model file";
+    return false;
+  }
+  const int32_t ftype = hparams[kNumHparams - 1] % GGML_QNT_VERSION_FACTOR;
+  result.source_type = ftype_name(ftype);
+  if (ftype != GGML_FTYPE_ALL_F32 && ftype != GGML_FTYPE_MOSTLY_F16) {
+    error = src + " is already quantized (" + ftype_name(ftype) +
+            "), requantizing needs f32 or f16 weights";
+    return false;
+  }
+  for (const auto& t : kQuantTypes) {
+    if (t.type == type) {
+      hparams[kNumHparams - 1] =
+          GGML_QNT_VERSION * GGML_QNT_VERSION_FACTOR + t.ftype;
+    }
+  }
+  out.seekp(hparams_pos);
+  for (int32_t value : hparams) {
+    write_value(out, value);
+  }
+  out.seekp(0, std::ios::end);
+
+  result.source_weights_bytes = 0;
+  result.weights_bytes = 0;
+  TensorHeader t;
+  std::vector<char> raw;
+  std::vector<float> data;
+  std::vector<char> quantized;
+  while (read_tensor_header(in, t)) {
+    raw.resize(t.nbytes());
+    if (!in.read(raw.data(), raw.size())) {
+      error = "Truncated tensor " + t.name + " in " + src;
+      return false;
+    }
+    result.source_weights_bytes += raw.size();
+    if (!should_quantize(t, type)) {
+      write_tensor_header(out, t);
+      out.write(raw.data(), raw.size());
+      result.weights_bytes += raw.size();
+      continue;
+    }
+
+    data.resize(t.nelements());
+    if (t.ttype == GGML_TYPE_F16) {
+      ggml_fp16_to_fp32_row(reinterpret_cast<const ggml_fp16_t*>(raw.data()),
+                            data.data(), t.nelements());
+    } else {
+      std::copy_n(reinterpret_cast<const float*>(raw.data()), t.nelements(),
+                  data.data());
+    }
+    const size_t size =
+        quantize_rows(type, data, t.nelements() / t.ne[0], t.ne[0], quantized);
+    t.ttype = type;
+    write_tensor_header(out, t);
+    out.write(quantized.data(), size);
+    result.weights_bytes += size;
+  }
+  if (!out.flush()) {
+    error = "Failed to write " + dst;
+    return false;
+  }
+  return true;
+}
+
+bool InspectModelFile(const std::string& model_path,
+                      ModelQuantization& result) {
+  int32_t ftype = 0;
+  if (!scan_model_file(model_path, ftype, result.source_weights_bytes)) {
+    return false;
+  }
+  result.source_type = ftype_name(ftype);
+  result.weights_bytes = result.source_weights_bytes;
+  return true;
+}
+
+bool PrepareQuantizedModel(const std::string& model_path,
+                           const std::string& type, ModelQuantization& result,
+                           std::string& error) {
+  namespace fs = std::filesystem;
+  enum ggml_type quant_type;
+  if (!ParseQuantizationType(type, quant_type)) {
+    error = "Unknown weight type " + type;
+    return false;
+  }
+  result = ModelQuantization();
+  result.type = type;
+
+  const std::string identity = source_identity(model_path);
+  const std::string path = QuantizedModelPath(model_path, type);
+  const std::string identity_path = path + ".source";
+  std::error_code ec;
+  int32_t ftype = 0;
+  if (!identity.empty() && fs::exists(path, ec) &&
+      read_file(identity_path) == identity &&
+      scan_model_file(path, ftype, result.weights_bytes) &&
+      ftype_name(ftype) == type) {
+    int32_t source_ftype = 0;
+    scan_model_file(model_path, source_ftype, result.source_weights_bytes);
+    result.source_type = ftype_name(source_ftype);
+    result.path = path;
+    result.cache_hit = true;
+    return true;
+  }
+
+  // written aside and renamed, a concurrent load never sees half a file
+  const std::string tmp_path = path + ".tmp";
+  const std::string tmp_identity_path = identity_path + ".tmp";
+  auto start = std::chrono::steady_clock::now();
+  if (!QuantizeModelFile(model_path, tmp_path, quant_type, result, error)) {
+    fs::remove(tmp_path, ec);
+    if (error == "Cannot open " + tmp_path) {
+      error = "Cannot write the " + type + " copy of " + model_path +
+              " next to it (" + error +
+              "); load it from a writable directory, or without quantize";
+    }
+    return false;
+  }
+  fs::rename(tmp_path, path, ec);
+  if (!ec) {
+    std::ofstream(tmp_identity_path, std::ios::trunc) << identity;
+    fs::rename(tmp_identity_path, identity_path, ec);
+  }
+  if (ec) {
+    fs::remove(tmp_path, ec);
+    fs::remove(tmp_identity_path, ec);
+    error = "Failed to move the " + type + " copy of " + model_path +
+            " to " + path;
+    return false;
+  }
+  result.requantize_ms =
+      std::chrono::duration_cast<std::chrono::milliseconds>(
+          std::chrono::steady_clock::now() - start)
+          .count();
+  result.path = path;
+  LOG_INFO << "Requantized " << model_path << " to " << type << " in "
+           << result.requantize_ms << " ms: " << result.weights_bytes
+           << " bytes of weights instead of " << result.source_weights_bytes
+           << ", cached as " << path;
+  return true;
+}
@@ -0,0 +1,56 @@
+#pragma once
+#include <cstdint>
+#include <string>
+
+#include "ggml.h"
+
+// What LoadModel did to a model's weights.
+struct ModelQuantization {
+  // Type of the weight matrices that were asked for, empty when the file is
+  // loaded as it is
+  std::string type;
+  // Type of the source file's weight matrices, "f16", "q5_1", ...
+  std::string source_type;
+  // File that was loaded: the source file or its requantized copy
+  std::string path;
+  // The copy existed already
+  bool cache_hit = false;
+  // Time spent writing the copy, 0 on a cache hit
+  int64_t requantize_ms = 0;
+  // Tensor data in the source file and in the file that was loaded, which
+  // is about what the weights take in memory
+  int64_t source_weights_bytes = 0;
+  int64_t weights_bytes = 0;
+};
+
+// Maps "q8_0", "q5_1", "q5_0", "q4_1" and "q4_0" to their ggml type.
+bool ParseQuantizationType(const std::string& name, enum ggml_type& type);
+
+// Where the copy of |model_path| in |type| is cached: next to it, as
+// <stem>.<type>.bin.
+std::string QuantizedModelPath(const std::string& model_path,
+                               const std::string& type);
+
+// Writes |src|, a whisper model file with f32 or f16 weights, to |dst| with
+// its weight matrices quantized to |type|, following whisper.cpp's quantize
+// example: 2D tensors other than the positional embeddings and convolution
+// biases are quantized, the others copied. Rows are quantized on all cores.
+// Fills the byte counts of |result|; returns false with |error| set if the
+// source cannot be read or is already quantized.
+bool QuantizeModelFile(const std::string& src, const std::string& dst,
+                       enum ggml_type type, ModelQuantization& result,
+                       std::string& error);
+
+// Fills the source type and byte counts of |result| for |model_path| loaded
+// as it is. Returns false if it is not a whisper model file.
+bool InspectModelFile(const std::string& model_path,
+                      ModelQuantization& result);
+
+// Resolves the file LoadModel loads for |model_path| in |type|: the copy
+// cached next to the source if it was made from the source as it is now,
+// per a <copy>.source file recording the source's canonical path, size and
+// modification time; otherwise a new copy written there. Fails if the
+// source's directory is not writable. Fills |result|.
+bool PrepareQuantizedModel(const std::string& model_path,
+                           const std::string& type, ModelQuantization& result,
+                           std::string& error);
@@ -0,0 +1,142 @@
+#include "session_cache.h"
+
+#include <algorithm>
+#include <cctype>
+
+namespace {
+// |text| without the spaces around it, which clients trim or add as they
+// join segments
+std::string trimmed(const std::string& text) {
+  const auto is_space = [](char c) {
+    return std::isspace(static_cast<unsigned char>(c)) != 0;
+  };
+  const auto first = std::find_if_not(text.begin(), text.end(), is_space);
+  const auto last = std::find_if_not(text.rbegin(), text.rend(), is_space);
+  return first < last.base() ? std::string(first, last.base())
+                             : std::string();
+}
+
+void keep_tail(std::vector<whisper_token>& tokens, size_t max_tokens) {
+  if (tokens.size() > max_tokens) {
+    tokens.erase(tokens.begin(), tokens.end() - max_tokens);
+  }
+}
+
+std::string text_of(struct whisper_context* ctx,
+                    const std::vector<whisper_token>& tokens) {
+  std::string text;
+  for (whisper_token token : tokens) {
+    text += whisper_token_to_str(ctx, token);
+  }
+  return text;
+}
+}  // namespace
+
+SessionCache::SessionCache(size_t max_sessions, std::chrono::seconds ttl)
+    : max_sessions_((std::max)(size_t(1), max_sessions)), ttl_(ttl) {}
+
+void SessionCache::SetLimits(size_t max_sessions, std::chrono::seconds ttl) {
+  std::lock_guard<std::mutex> lock(mtx_);
+  max_sessions_ = (std::max)(size_t(1), max_sessions);
+  ttl_ = ttl;
+  TrimLocked(std::chrono::steady_clock::now());
+}
+
+std::vector<whisper_token> SessionCache::PromptTokens(
+    const std::string& tenant, const std::string& session_id,
+    const std::string& prompt, struct whisper_context* ctx,
+    size_t max_tokens) {
+  const std::string key = KeyOf(tenant, session_id);
+  const auto now = std::chrono::steady_clock::now();
+  {
+    std::lock_guard<std::mutex> lock(mtx_);
+    TrimLocked(now);
+    if (auto it = index_.find(key); it != index_.end()) {
+      const Session& session = *it->second;
+      if (prompt.empty() || trimmed(prompt) == trimmed(session.context_text)) {
+        stats_.hits++;
+        auto tokens = TouchLocked(key, now)->context;
+        keep_tail(tokens, max_tokens);
+        return tokens;
+      }
+    }
+    stats_.misses++;
+  }
+
+  // a prompt has at most as many tokens as bytes
+  std::vector<whisper_token> tokens(prompt.size() + 1);
+  const int n = whisper_tokenize(ctx, prompt.c_str(), tokens.data(),
+                                 static_cast<int>(tokens.size()));
+  tokens.resize((std::max)(0, n));
+  keep_tail(tokens, max_tokens);
+  std::string context_text = text_of(ctx, tokens);
+
+  std::lock_guard<std::mutex> lock(mtx_);
+  Session& session = *TouchLocked(key, now);
+  session.context = tokens;
+  session.context_text = std::move(context_text);
+  TrimLocked(now);
+  return tokens;
+}
+
+void SessionCache::Update(const std::string& tenant,
+                          const std::string& session_id,
+                          const std::vector<whisper_token>& prompt_tokens,
+                          const std::vector<whisper_token>& tokens,
+                          struct whisper_context* ctx, size_t max_tokens) {
+  std::vector<whisper_token> context;
+  if (tokens.size() < max_tokens) {
+    const size_t n_prompt =
+        (std::min)(prompt_tokens.size(), max_tokens - tokens.size());
+    context.assign(prompt_tokens.end() - n_prompt, prompt_tokens.end());
+  }
+  context.insert(context.end(), tokens.begin(), tokens.end());
+  keep_tail(context, max_tokens);
+  std::string context_text = text_of(ctx, context);
+
+  const auto now = std::chrono::steady_clock::now();
+  std::lock_guard<std::mutex> lock(mtx_);
+  Session& session = *TouchLocked(KeyOf(tenant, session_id), now);
+  session.context = std::move(context);
+  session.context_text = std::move(context_text);
+  TrimLocked(now);
+}
+
+SessionCache::Stats SessionCache::GetStats() const {
+  std::lock_guard<std::mutex> lock(mtx_);
+  Stats stats = stats_;
+  stats.sessions = static_cast<int64_t>(lru_.size());
+  return stats;
+}
+
+void SessionCache::TrimLocked(std::chrono::steady_clock::time_point now) {
+  while (!lru_.empty() && now - lru_.back().last_used > ttl_) {
+    index_.erase(lru_.back().key);
+    lru_.pop_back();
+    stats_.expired++;
+  }
+  while (lru_.size() > max_sessions_) {
+    index_.erase(lru_.back().key);
+    lru_.pop_back();
+    stats_.evicted++;
+  }
+}
+
+std::string SessionCache::KeyOf(const std::string& tenant,
+                                const std::string& session_id) {
+  // the length keeps the tenant from running into the session id
+  return std::to_string(tenant.size()) + ":" + tenant + session_id;
+}
+
+SessionCache::Lru::iterator SessionCache::TouchLocked(
+    const std::string& key, std::chrono::steady_clock::time_point now) {
+  if (auto it = index_.find(key); it != index_.end()) {
+    lru_.splice(lru_.begin(), lru_, it->second);
+  } else {
+    lru_.emplace_front();
+    lru_.front().key = key;
+    index_[key] = lru_.begin();
+  }
+  lru_.front().last_used = now;
+  return lru_.begin();
+}
@@ -0,0 +1,99 @@
+#pragma once
+#include <chrono>
+#include <cstdint>
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "whisper.h"
+
+// Decoder context of transcription sessions, so clients sending a long
+// recording chunk by chunk do not have the previous text re-tokenized as
+// the prompt of every chunk.
+//
+// A session holds the tokens the next chunk is prompted with: the tail of
+// its prompt and of everything decoded since, as whisper keeps it between
+// the windows of one file. A request of the session reuses them when its
+// prompt is empty or is the session's context as text (the client sending
+// back what the session produced); any other prompt is used as it is,
+// tokenized, and starts the context over.
+//
+// Sessions are named by the client within its tenant, so two tenants
+// picking the same session id do not share a context. This is namespacing,
+// not isolation: the tenant is a request field the client sets, and a
+// client that names another tenant and its session id continues that
+// session.
+//
+// Sessions not used for |ttl| expire, and past |max_sessions| the least
+// recently used one is dropped.
+class SessionCache {
+ public:
+  struct Stats {
+    // requests that reused a session's context, and that tokenized their
+    // prompt
+    int64_t hits = 0;
+    int64_t misses = 0;
+    int64_t expired = 0;
+    int64_t evicted = 0;
+    int64_t sessions = 0;
+  };
+
+  static constexpr size_t kDefaultMaxSessions = 1024;
+  static constexpr std::chrono::seconds kDefaultTtl{600};
+
+  SessionCache(size_t max_sessions = kDefaultMaxSessions,
+               std::chrono::seconds ttl = kDefaultTtl);
+
+  void SetLimits(size_t max_sessions, std::chrono::seconds ttl);
+
+  // The prompt tokens for the next request of |tenant|'s |session_id|, at
+  // most |max_tokens| of them; |prompt| is tokenized with |ctx| when the
+  // session's context cannot be reused.
+  std::vector<whisper_token> PromptTokens(const std::string& tenant,
+                                          const std::string& session_id,
+                                          const std::string& prompt,
+                                          struct whisper_context* ctx,
+                                          size_t max_tokens);
+
+  // Appends what a request of |tenant|'s |session_id| decoded, |tokens|
+  // (text tokens only), to the context it was prompted with,
+  // |prompt_tokens|.
+  void Update(const std::string& tenant, const std::string& session_id,
+              const std::vector<whisper_token>& prompt_tokens,
+              const std::vector<whisper_token>& tokens,
+              struct whisper_context* ctx, size_t max_tokens);
+
+  Stats GetStats() const;
+
+ private:
+  struct Session {
+    // see KeyOf
+    std::string key;
+    std::vector<whisper_token> context;
+    // |context| as text
+    std::string context_text;
+    std::chrono::steady_clock::time_point last_used;
+  };
+  using Lru = std::list<Session>;
+
+  // Index key of |tenant|'s |session_id|
+  static std::string KeyOf(const std::string& tenant,
+                           const std::string& session_id);
+
+  // Drops expired sessions, and the least recently used past the limit;
+  // |mtx_| is held.
+  void TrimLocked(std::chrono::steady_clock::time_point now);
+  // The session, moved to the front of the LRU list; |mtx_| is held.
+  Lru::iterator TouchLocked(const std::string& key,
+                            std::chrono::steady_clock::time_point now);
+
+  mutable std::mutex mtx_;
+  size_t max_sessions_;
+  std::chrono::seconds ttl_;
+  // most recently used first
+  Lru lru_;
+  std::unordered_map<std::string, Lru::iterator> index_;
+  Stats stats_;
+};
@@ -0,0 +1,118 @@
+#include "thread_tuner.h"
+
+#include <algorithm>
+#include <chrono>
+#include <thread>
+#include "trantor/utils/Logger.h"
+
+namespace {
+// Timed rounds per split, after one warm up round
+constexpr int kRounds = 2;
+// A split with more states has to beat the current pick by this much
+constexpr double kMinGain = 1.10;
+
+// Thread counts tried for states of at most |max_threads|: the maximum,
+// then the powers of two below it, most first
+std::vector<int> ThreadCounts(int max_threads) {
+  std::vector<int> counts = {max_threads};
+  int n = 1;
+  while (n * 2 < max_threads) {
+    n *= 2;
+  }
+  for (; n >= 1 && n < max_threads; n /= 2) {
+    counts.push_back(n);
+  }
+  return counts;
+}
+
+// Runs the encoder once on every state concurrently; returns the wall time.
+double EncodeRound(struct whisper_context* ctx,
+                   const std::vector<struct whisper_state*>& states,
+                   int n_parallel, int n_threads) {
+  auto start = std::chrono::steady_clock::now();
+  std::vector<std::thread> runners;
+  for (int i = 1; i < n_parallel; i++) {
+    runners.emplace_back([ctx, state = states[i], n_threads] {
+      whisper_encode_with_state(ctx, state, 0, n_threads);
+    });
+  }
+  whisper_encode_with_state(ctx, states[0], 0, n_threads);
+  for (auto& r : runners) {
+    r.join();
+  }
+  return std::chrono::duration<double, std::milli>(
+             std::chrono::steady_clock::now() - start)
+      .count();
+}
+}  // namespace
+
+ThreadTuning TuneThreads(struct whisper_context* ctx, int n_cores,
+                         int max_parallel) {
+  ThreadTuning tuning;
+  tuning.source = "auto";
+  n_cores = (std::max)(1, n_cores);
+  max_parallel = (std::max)(1, (std::min)(max_parallel, n_cores));
+  tuning.n_threads = n_cores;
+
+  // a silent full window, the encoder cost does not depend on the content
+  const int n_mels = whisper_model_n_mels(ctx);
+  const int n_len = 2 * whisper_n_audio_ctx(ctx);
+  std::vector<float> mel(size_t(n_mels) * n_len, 0.0f);
+
+  std::vector<struct whisper_state*> states;
+  double best_throughput = 0.0;
+  for (int n_parallel = 1; n_parallel <= max_parallel; n_parallel *= 2) {
+    while (int(states.size()) < n_parallel) {
+      auto* state = whisper_init_state(ctx);
+      if (state == nullptr ||
+          whisper_set_mel_with_state(ctx, state, mel.data(), n_len, n_mels) !=
+              0) {
+        if (state != nullptr) {
+          whisper_free_state(state);
+        }
+        break;
+      }
+      states.push_back(state);
+    }
+    if (int(states.size()) < n_parallel) {
+      LOG_WARN << "Not enough memory for " << n_parallel
+               << " states, stopping thread tuning";
+      break;
+    }
+
+    // best throughput with this many states
+    double parallel_best = 0.0;
+    for (int n_threads : ThreadCounts((std::max)(1, n_cores / n_parallel))) {
+      EncodeRound(ctx, states, n_parallel, n_threads);  // warm up
+      double total_ms = 0.0;
+      for (int i = 0; i < kRounds; i++) {
+        total_ms += EncodeRound(ctx, states, n_parallel, n_threads);
+      }
+      ThreadTuning::Trial trial;
+      trial.n_parallel = n_parallel;
+      trial.n_threads = n_threads;
+      trial.encode_ms = total_ms / kRounds;
+      trial.throughput = n_parallel * 1000.0 / trial.encode_ms;
+      tuning.trials.push_back(trial);
+      LOG_INFO << "Thread tuning: " << n_parallel << " x " << n_threads
+               << " threads, encode " << trial.encode_ms << " ms, "
+               << trial.throughput << " encodes/s";
+
+      if (trial.throughput > best_throughput * kMinGain) {
+        best_throughput = trial.throughput;
+        tuning.n_parallel = n_parallel;
+        tuning.n_threads = n_threads;
+      }
+      // past the best count, fewer threads only get slower
+      if (trial.throughput * kMinGain < parallel_best) {
+        break;
+      }
+      parallel_best = (std::max)(parallel_best, trial.throughput);
+    }
+  }
+
+  for (auto* state : states) {
+    whisper_free_state(state);
+  }
+  return tuning;
+}
@@ -0,0 +1,34 @@
+#pragma once
+#include <string>
+#include <vector>
+
+#include "whisper.h"
+
+// How a model's cores are split between parallel states (requests in
+// flight) and compute threads per state, and how that was decided.
+struct ThreadTuning {
+  struct Trial {
+    int n_parallel;
+    int n_threads;
+    // wall time of one round of concurrent encoder runs
+    double encode_ms;
+    // encoder runs per second over all states
+    double throughput;
+  };
+
+  // "default", "override" or "auto"
+  std::string source = "default";
+  int n_parallel = 1;
+  int n_threads = 1;
+  std::vector<Trial> trials;
+};
+
+// Times the encoder of |ctx| on this host for n_parallel x n_threads, with
+// n_parallel a power of two up to |max_parallel| and, for each, n_threads
+// from |n_cores| / n_parallel down through the powers of two below it, and
+// returns the split with the best throughput. Splits within 10% of the best
+// prefer fewer states and then more threads, which keeps the latency of a
+// single request low. Uses temporary states, so it can run before the
+// model's own states are created.
+ThreadTuning TuneThreads(struct whisper_context* ctx, int n_cores,
+                         int max_parallel);
@@ -0,0 +1,116 @@
+#pragma once
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include "audio_preprocessor.h"
+#include "json/value.h"
+
+namespace audio::inferences {
+// Scheduling classes, served strictly in this order.
+enum class RequestPriority { kInteractive = 0, kStandard = 1, kBatch = 2 };
+
+inline RequestPriority PriorityFromString(const std::string& s) {
+  if (s == "interactive") {
+    return RequestPriority::kInteractive;
+  } else if (s == "batch") {
+    return RequestPriority::kBatch;
+  }
+  return RequestPriority::kStandard;
+}
+
+struct TranscriptionRequest {
+  std::string model_id;
+  std::string file;
+  std::string language = "en";
+  std::string prompt;
+  std::string response_format = "json";
+  float temperature = 0.0f;
+  bool translate = false;
+  // Latency budget in milliseconds, counted from |received_at|. 0 disables
+  // admission control and mid-inference aborts for this request.
+  int64_t deadline_ms = 0;
+  std::chrono::steady_clock::time_point received_at =
+      std::chrono::steady_clock::now();
+  RequestPriority priority = RequestPriority::kStandard;
+  // Fair queuing key; requests without a tenant share the "" tenant.
+  std::string tenant;
+  // Reply with the formatted result as is instead of a chat completion
+  // wrapper; see EngineI.
+  bool raw_response = false;
+  // Conditioning of the audio before it is transcribed
+  PreprocessOptions preprocess;
+  // Requests of one session, e.g. consecutive chunks of a recording, are
+  // prompted with the text decoded so far. Session ids are namespaced by
+  // tenant, which the client sets; see SessionCache
+  std::string session_id;
+
+  bool HasDeadline() const { return deadline_ms > 0; }
+  std::chrono::steady_clock::time_point Deadline() const {
+    return received_at + std::chrono::milliseconds(deadline_ms);
+  }
+};
+
+// Multipart form fields arrive as strings, JSON bodies as numbers.
+inline double GetNumber(const Json::Value& v, const std::string& key,
+                        double default_value) {
+  const auto& field = v[key];
+  if (field.isNumeric()) {
+    return field.asDouble();
+  }
+  if (field.isString() && !field.asString().empty()) {
+    try {
+      return std::stod(field.asString());
+    } catch (const std::exception&) {
+    }
+  }
+  return default_value;
+}
+
+// Same for booleans, which form fields send as "true" or "1"
+inline bool GetBool(const Json::Value& v, const std::string& key,
+                    bool default_value) {
+  const auto& field = v[key];
+  if (field.isBool() || field.isNumeric()) {
+    return field.asBool();
+  }
+  if (field.isString()) {
+    const auto& s = field.asString();
+    if (s == "true" || s == "1") {
+      return true;
+    } else if (s == "false" || s == "0") {
+      return false;
+    }
+  }
+  return default_value;
+}
+
+inline TranscriptionRequest fromJson(std::shared_ptr<Json::Value> jsonBody) {
+  TranscriptionRequest request;
+  if (jsonBody) {
+    request.model_id = (*jsonBody).get("model", "").asString();
+    request.file = (*jsonBody).get("file", "").asString();
+    request.language = (*jsonBody).get("language", "en").asString();
+    request.prompt = (*jsonBody).get("prompt", "").asString();
+    request.response_format =
+        (*jsonBody).get("response_format", "json").asString();
+    request.temperature =
+        static_cast<float>(GetNumber(*jsonBody, "temperature", 0.0));
+    request.deadline_ms =
+        static_cast<int64_t>(GetNumber(*jsonBody, "deadline_ms", 0));
+    request.priority =
+        PriorityFromString((*jsonBody).get("priority", "standard").asString());
+    request.tenant = (*jsonBody).get("tenant", "").asString();
+    if (request.tenant.empty()) {
+      request.tenant = (*jsonBody).get("user", "").asString();
+    }
+    request.raw_response = GetBool(*jsonBody, "raw_response", false);
+    request.preprocess.remove_dc = GetBool(*jsonBody, "remove_dc", false);
+    request.preprocess.high_pass_hz =
+        static_cast<float>(GetNumber(*jsonBody, "high_pass_hz", 0.0));
+    request.preprocess.normalize = GetBool(*jsonBody, "normalize", false);
+    request.session_id = (*jsonBody).get("session_id", "").asString();
+  }
+  return request;
+}
+}  // namespace audio::inferences
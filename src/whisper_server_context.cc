@@ -1,79 +1,60 @@
 #include "whisper_server_context.h"
 #include <trantor/utils/Logger.h>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
 #include <fstream>
+#include <future>
+#include <iterator>
 #include <sstream>
 #include "dr_wav.h"
 #include "json.hpp"
 
 using json = nlohmann::json;
 
-bool read_wav(const std::string& fname, std::vector<float>& pcmf32,
-              std::vector<std::vector<float>>& pcmf32s, bool stereo) {
-  drwav wav;
-  std::vector<uint8_t> wav_data;  // used for pipe input from stdin
-
-  if (fname == "-") {
-    {
-      uint8_t buf[1024];
-      while (true) {
-        const size_t n = fread(buf, 1, sizeof(buf), stdin);
-        if (n == 0) {
-          break;
-        }
-        wav_data.insert(wav_data.end(), buf, buf + n);
-      }
-    }
-
-    if (drwav_init_memory(&wav, wav_data.data(), wav_data.size(), nullptr) ==
-        false) {
-      fprintf(stderr, "error: failed to open WAV file from stdin\n");
-      return false;
-    }
-
-    fprintf(stderr, "%s: read %zu bytes from stdin\n", __func__,
-            wav_data.size());
-  } else if (drwav_init_file(&wav, fname.c_str(), nullptr) == false) {
-    fprintf(stderr, "error: failed to open '%s' as WAV file\n", fname.c_str());
-    return false;
-  }
-
+namespace {
+// Checks that an opened WAV can be fed to whisper; releases |wav| if not.
+bool check_wav_format(drwav& wav, const std::string& fname, bool stereo) {
   if (wav.channels != 1 && wav.channels != 2) {
     fprintf(stderr, "%s: WAV file '%s' must be mono or stereo\n", __func__,
             fname.c_str());
+    drwav_uninit(&wav);
     return false;
   }
 
   if (stereo && wav.channels != 2) {
     fprintf(stderr, "%s: WAV file '%s' must be stereo for diarization\n",
             __func__, fname.c_str());
+    drwav_uninit(&wav);
     return false;
   }
 
   if (wav.sampleRate != COMMON_SAMPLE_RATE) {
     fprintf(stderr, "%s: WAV file '%s' must be %i kHz\n", __func__,
             fname.c_str(), COMMON_SAMPLE_RATE / 1000);
+    drwav_uninit(&wav);
     return false;
   }
 
   if (wav.bitsPerSample != 16) {
     fprintf(stderr, "%s: WAV file '%s' must be 16-bit\n", __func__,
             fname.c_str());
+    drwav_uninit(&wav);
     return false;
   }
+  return true;
+}
 
-  const uint64_t n =
-      wav_data.empty()
-          ? wav.totalPCMFrameCount
-          : wav_data.size() / (wav.channels * wav.bitsPerSample / 8);
-
-  std::vector<int16_t> pcm16;
-  pcm16.resize(n * wav.channels);
-  drwav_read_pcm_frames_s16(&wav, n, pcm16.data());
-  drwav_uninit(&wav);
+// Converts |n| frames of buffers.pcm16 to mono (and stereo) float PCM
+void convert_pcm16(uint64_t n, int channels, AudioBuffers& buffers,
+                   bool stereo) {
+  auto& pcmf32 = buffers.pcmf32;
+  auto& pcmf32s = buffers.pcmf32s;
+  const auto& pcm16 = buffers.pcm16;
 
   // convert to mono, float
   pcmf32.resize(n);
-  if (wav.channels == 1) {
+  if (channels == 1) {
     for (uint64_t i = 0; i < n; i++) {
       pcmf32[i] = float(pcm16[i]) / 32768.0f;
     }
@@ -93,33 +74,334 @@ bool read_wav(const std::string& fname, std::vector<float>& pcmf32,
       pcmf32s[0][i] = float(pcm16[2 * i]) / 32768.0f;
       pcmf32s[1][i] = float(pcm16[2 * i + 1]) / 32768.0f;
     }
+  } else {
+    pcmf32s.clear();
+  }
+}
+
+// Converts the first |n| frames of an opened WAV to mono (and stereo) float
+// PCM and releases |wav|.
+bool decode_wav(drwav& wav, const std::string& fname, uint64_t n,
+                AudioBuffers& buffers, bool stereo) {
+  if (!check_wav_format(wav, fname, stereo)) {
+    return false;
   }
 
+  buffers.pcm16.resize(n * wav.channels);
+  drwav_read_pcm_frames_s16(&wav, n, buffers.pcm16.data());
+  drwav_uninit(&wav);
+
+  convert_pcm16(n, wav.channels, buffers, stereo);
   return true;
 }
+}  // namespace
+
+// Keeps a WAV file open and decodes it one window at a time.
+class WavWindowReader {
+ public:
+  ~WavWindowReader() {
+    if (open_) {
+      drwav_uninit(&wav_);
+    }
+  }
 
-std::string output_str(struct whisper_context* ctx,
-                       const WhisperParams& params,
-                       std::vector<std::vector<float>> pcmf32s) {
-  std::stringstream result;
-  const int n_segments = whisper_full_n_segments(ctx);
+  bool Open(const std::string& fname, bool stereo) {
+    if (drwav_init_file(&wav_, fname.c_str(), nullptr) == false) {
+      fprintf(stderr, "error: failed to open '%s' as WAV file\n",
+              fname.c_str());
+      return false;
+    }
+    // check_wav_format releases the file on failure
+    open_ = check_wav_format(wav_, fname, stereo);
+    stereo_ = stereo;
+    return open_;
+  }
+
+  uint64_t TotalSamples() const { return open_ ? wav_.totalPCMFrameCount : 0; }
+
+  // Decodes the next |n| samples at most into |buffers|, replacing their
+  // contents. Returns the number of samples decoded, 0 at the end.
+  size_t Read(size_t n, AudioBuffers& buffers) {
+    buffers.pcm16.resize(n * wav_.channels);
+    const auto n_read =
+        drwav_read_pcm_frames_s16(&wav_, n, buffers.pcm16.data());
+    convert_pcm16(n_read, wav_.channels, buffers, stereo_);
+    return static_cast<size_t>(n_read);
+  }
+
+ private:
+  drwav wav_;
+  bool open_ = false;
+  bool stereo_ = false;
+};
+
+namespace {
+// Samples read from stdin per call, large enough that pipes are drained in
+// few system calls.
+constexpr size_t kStdinBlockFrames = 1 << 16;
+// Upper bound for trusting the data size of a piped header up front
+constexpr uint64_t kMaxReserveBytes = 256ull << 20;
+
+size_t stdin_read(void* /*user_data*/, void* buffer, size_t bytes) {
+  return fread(buffer, 1, bytes, stdin);
+}
+
+// stdin cannot seek, dr_wav only ever skips forward in sequential mode
+drwav_bool32 stdin_seek(void* /*user_data*/, int offset,
+                        drwav_seek_origin origin) {
+  if (origin != drwav_seek_origin_current || offset < 0) {
+    return DRWAV_FALSE;
+  }
+  char buf[4096];
+  while (offset > 0) {
+    const size_t n = fread(buf, 1, (std::min)(size_t(offset), sizeof(buf)),
+                           stdin);
+    if (n == 0) {
+      return DRWAV_FALSE;
+    }
+    offset -= static_cast<int>(n);
+  }
+  return DRWAV_TRUE;
+}
+
+// Decodes a WAV stream from stdin as it arrives instead of buffering the
+// encoded bytes first.
+bool read_wav_stdin(AudioBuffers& buffers, bool stereo) {
+  drwav wav;
+  if (drwav_init_ex(&wav, stdin_read, stdin_seek, nullptr, nullptr, nullptr,
+                    DRWAV_SEQUENTIAL, nullptr) == false) {
+    fprintf(stderr, "error: failed to open WAV file from stdin\n");
+    return false;
+  }
+  if (!check_wav_format(wav, "-", stereo)) {
+    return false;
+  }
+
+  auto& pcm16 = buffers.pcm16;
+  pcm16.clear();
+  // Writers that cannot seek back (ffmpeg -f wav -) leave the data size at
+  // 0 or at the maximum, so samples are read until the end of the stream
+  // and the buffer grows block by block.
+  if (wav.dataChunkDataSize == 0 || wav.dataChunkDataSize == UINT32_MAX) {
+    wav.bytesRemaining = UINT64_MAX;
+  } else {
+    pcm16.reserve((std::min)(uint64_t(wav.dataChunkDataSize),
+                             kMaxReserveBytes) /
+                  sizeof(int16_t));
+  }
+  while (true) {
+    const size_t used = pcm16.size();
+    pcm16.resize(used + kStdinBlockFrames * wav.channels);
+    const auto n_read = drwav_read_pcm_frames_s16(&wav, kStdinBlockFrames,
+                                                  pcm16.data() + used);
+    pcm16.resize(used + n_read * wav.channels);
+    if (n_read < kStdinBlockFrames) {
+      break;
+    }
+  }
+  drwav_uninit(&wav);
+
+  const uint64_t n = pcm16.size() / wav.channels;
+  fprintf(stderr, "%s: read %llu samples from stdin\n", __func__,
+          static_cast<unsigned long long>(n));
+  convert_pcm16(n, wav.channels, buffers, stereo);
+  return true;
+}
+}  // namespace
+
+bool read_wav(const std::string& fname, AudioBuffers& buffers, bool stereo) {
+  if (fname == "-") {
+    return read_wav_stdin(buffers, stereo);
+  }
+
+  drwav wav;
+  if (drwav_init_file(&wav, fname.c_str(), nullptr) == false) {
+    fprintf(stderr, "error: failed to open '%s' as WAV file\n", fname.c_str());
+    return false;
+  }
+  return decode_wav(wav, fname, wav.totalPCMFrameCount, buffers, stereo);
+}
+
+bool read_wav(const std::string& fname, std::vector<float>& pcmf32,
+              std::vector<std::vector<float>>& pcmf32s, bool stereo) {
+  AudioBuffers buffers;
+  buffers.pcmf32.swap(pcmf32);
+  buffers.pcmf32s.swap(pcmf32s);
+  const bool ok = read_wav(fname, buffers, stereo);
+  pcmf32.swap(buffers.pcmf32);
+  pcmf32s.swap(buffers.pcmf32s);
+  return ok;
+}
+
+bool read_wav_from_memory(const void* data, size_t size,
+                          std::vector<float>& pcmf32,
+                          std::vector<std::vector<float>>& pcmf32s,
+                          bool stereo) {
+  drwav wav;
+  if (drwav_init_memory(&wav, data, size, nullptr) == false) {
+    fprintf(stderr, "error: failed to open WAV file from memory\n");
+    return false;
+  }
+  AudioBuffers buffers;
+  buffers.pcmf32.swap(pcmf32);
+  buffers.pcmf32s.swap(pcmf32s);
+  const bool ok =
+      decode_wav(wav, "<memory>", wav.totalPCMFrameCount, buffers, stereo);
+  pcmf32.swap(buffers.pcmf32);
+  pcmf32s.swap(buffers.pcmf32s);
+  return ok;
+}
+
+bool get_wav_duration_ms(const std::string& fname, int64_t& duration_ms) {
+  drwav wav;
+  if (drwav_init_file(&wav, fname.c_str(), nullptr) == false) {
+    return false;
+  }
+  duration_ms = wav.sampleRate == 0
+                    ? 0
+                    : int64_t(wav.totalPCMFrameCount * 1000 / wav.sampleRate);
+  drwav_uninit(&wav);
+  return true;
+}
+
+void collect_segments(struct whisper_context* ctx, struct whisper_state* state,
+                      const WhisperParams& params,
+                      const std::vector<std::vector<float>>& pcmf32s,
+                      int64_t pcmf32s_t0, int64_t t_offset,
+                      std::vector<WhisperSegment>& segments) {
+  const int n_segments = whisper_full_n_segments_from_state(state);
   for (int i = 0; i < n_segments; ++i) {
-    const char* text = whisper_full_get_segment_text(ctx, i);
-    std::string speaker = "";
+    WhisperSegment segment;
+    segment.t0 = whisper_full_get_segment_t0_from_state(state, i) + t_offset;
+    segment.t1 = whisper_full_get_segment_t1_from_state(state, i) + t_offset;
+    segment.text = whisper_full_get_segment_text_from_state(state, i);
+    segment.speaker_turn_next =
+        whisper_full_get_segment_speaker_turn_next_from_state(state, i);
 
     if (params.diarize && pcmf32s.size() == 2) {
-      const int64_t t0 = whisper_full_get_segment_t0(ctx, i);
-      const int64_t t1 = whisper_full_get_segment_t1(ctx, i);
-      speaker = estimate_diarization_speaker(pcmf32s, t0, t1);
+      segment.speaker = estimate_diarization_speaker(
+          pcmf32s, segment.t0 - pcmf32s_t0, segment.t1 - pcmf32s_t0, true);
     }
 
-    result << speaker << text << "\n";
+    const int n_tokens = whisper_full_n_tokens_from_state(state, i);
+    for (int j = 0; j < n_tokens; ++j) {
+      whisper_token_data token =
+          whisper_full_get_token_data_from_state(state, i, j);
+      if (token.id >= whisper_token_eot(ctx)) {
+        continue;
+      }
+      token.t0 += t_offset;
+      token.t1 += t_offset;
+      segment.tokens.push_back(
+          {token, whisper_full_get_token_text_from_state(ctx, state, i, j)});
+    }
+    segments.push_back(std::move(segment));
+  }
+}
+
+std::string output_str(const std::vector<WhisperSegment>& segments,
+                       const WhisperParams& params) {
+  std::stringstream result;
+  for (const auto& segment : segments) {
+    std::string speaker = "";
+
+    if (!segment.speaker.empty()) {
+      speaker = "(speaker " + segment.speaker + ")";
+    }
+
+    result << speaker << segment.text << "\n";
   }
   return result.str();
 }
 
+std::string format_segments(const std::vector<WhisperSegment>& segments,
+                            const WhisperParams& params) {
+  std::string result;
+  if (params.response_format == text_format) {
+    result = output_str(segments, params);
+  } else if (params.response_format == srt_format) {
+    std::stringstream ss;
+    for (size_t i = 0; i < segments.size(); ++i) {
+      const auto& segment = segments[i];
+      std::string speaker = "";
+
+      if (!segment.speaker.empty()) {
+        speaker = "(speaker " + segment.speaker + ")";
+      }
+
+      ss << i + 1 + params.offset_n << "\n";
+      ss << to_timestamp(segment.t0, true) << " --> "
+         << to_timestamp(segment.t1, true) << "\n";
+      ss << speaker << segment.text << "\n\n";
+    }
+    result = ss.str();
+  } else if (params.response_format == vtt_format) {
+    std::stringstream ss;
+
+    ss << "WEBVTT\n\n";
+
+    for (const auto& segment : segments) {
+      std::string speaker = "";
+
+      if (!segment.speaker.empty()) {
+        speaker = "<v Speaker" + segment.speaker + ">";
+      }
+
+      ss << to_timestamp(segment.t0) << " --> " << to_timestamp(segment.t1)
+         << "\n";
+      ss << speaker << segment.text << "\n\n";
+    }
+    result = ss.str();
+  } else if (params.response_format == vjson_format) {
+    /* try to match openai/whisper's Python format */
+    std::string results = output_str(segments, params);
+    json jres = json{{"text", results}};
+    for (size_t i = 0; i < segments.size(); ++i) {
+      const auto& s = segments[i];
+      json segment = json{
+          {"id", i},
+          {"text", s.text},
+      };
+
+      if (!params.no_timestamps) {
+        segment["start"] = s.t0 * 0.01;
+        segment["end"] = s.t1 * 0.01;
+      }
+
+      for (const auto& token : s.tokens) {
+        segment["tokens"].push_back(token.data.id);
+        json word = json{{"word", token.text}};
+        if (!params.no_timestamps) {
+          word["start"] = token.data.t0 * 0.01;
+          word["end"] = token.data.t1 * 0.01;
+        }
+        word["probability"] = token.data.p;
+        segment["words"].push_back(word);
+      }
+      jres["segments"].push_back(segment);
+    }
+    result = jres.dump(-1, ' ', false, json::error_handler_t::replace);
+  } else {
+    std::string results = output_str(segments, params);
+    json jres = json{{"text", results}};
+    result = jres.dump(-1, ' ', false, json::error_handler_t::replace);
+  }
+  return result;
+}
+
+std::string content_type_for(const std::string& response_format) {
+  if (response_format == text_format) {
+    return "text/plain; charset=utf-8";
+  } else if (response_format == srt_format) {
+    return "application/x-subrip; charset=utf-8";
+  } else if (response_format == vtt_format) {
+    return "text/vtt; charset=utf-8";
+  }
+  return "application/json; charset=utf-8";
+}
+
 std::string estimate_diarization_speaker(
-    std::vector<std::vector<float>> pcmf32s, int64_t t0, int64_t t1,
+    const std::vector<std::vector<float>>& pcmf32s, int64_t t0, int64_t t1,
     bool id_only) {
   std::string speaker = "";
   const int64_t n_samples = pcmf32s[0].size();
@@ -393,29 +675,18 @@ void check_ffmpeg_availibility() {
   }
 }
 
-bool convert_to_wav(const std::string& temp_filename, std::string& error_resp) {
+bool convert_to_wav(const std::string& input_filename,
+                    const std::string& output_filename,
+                    std::string& error_resp) {
   std::ostringstream cmd_stream;
-  std::string converted_filename_temp = temp_filename + "_temp.wav";
-  cmd_stream << "ffmpeg -i \"" << temp_filename
-             << "\" -ar 16000 -ac 1 -c:a pcm_s16le \""
-             << converted_filename_temp << "\" 2>&1";
+  cmd_stream << "ffmpeg -y -i \"" << input_filename
+             << "\" -ar 16000 -ac 1 -c:a pcm_s16le -f wav \""
+             << output_filename << "\" 2>&1";
   std::string cmd = cmd_stream.str();
 
   int status = std::system(cmd.c_str());
   if (status != 0) {
-    error_resp = "{\"error\":\"FFmpeg conversion failed.\"}";
-    return false;
-  }
-
-  // Remove the original file
-  if (remove(temp_filename.c_str()) != 0) {
-    error_resp = "{\"error\":\"Failed to remove the original file.\"}";
-    return false;
-  }
-
-  // Rename the temporary file to match the original filename
-  if (rename(converted_filename_temp.c_str(), temp_filename.c_str()) != 0) {
-    error_resp = "{\"error\":\"Failed to rename the temporary file.\"}";
+    error_resp = "ffmpeg exited with status " + std::to_string(status);
     return false;
   }
   return true;
@@ -434,12 +705,12 @@ void whisper_print_progress_callback(struct whisper_context* /*ctx*/,
 }
 
 void whisper_print_segment_callback(struct whisper_context* ctx,
-                                    struct whisper_state* /*state*/, int n_new,
+                                    struct whisper_state* state, int n_new,
                                     void* user_data) {
   const auto& params = *((WhisperPrintUserData*)user_data)->params;
   const auto& pcmf32s = *((WhisperPrintUserData*)user_data)->pcmf32s;
 
-  const int n_segments = whisper_full_n_segments(ctx);
+  const int n_segments = whisper_full_n_segments_from_state(state);
 
   std::string speaker = "";
 
@@ -455,8 +726,8 @@ void whisper_print_segment_callback(struct whisper_context* ctx,
 
   for (int i = s0; i < n_segments; i++) {
     if (!params.no_timestamps || params.diarize) {
-      t0 = whisper_full_get_segment_t0(ctx, i);
-      t1 = whisper_full_get_segment_t1(ctx, i);
+      t0 = whisper_full_get_segment_t0_from_state(state, i);
+      t1 = whisper_full_get_segment_t1_from_state(state, i);
     }
 
     if (!params.no_timestamps) {
@@ -469,16 +740,17 @@ void whisper_print_segment_callback(struct whisper_context* ctx,
     }
 
     if (params.print_colors) {
-      for (int j = 0; j < whisper_full_n_tokens(ctx, i); ++j) {
+      for (int j = 0; j < whisper_full_n_tokens_from_state(state, i); ++j) {
         if (params.print_special == false) {
-          const whisper_token id = whisper_full_get_token_id(ctx, i, j);
+          const whisper_token id =
+              whisper_full_get_token_id_from_state(state, i, j);
           if (id >= whisper_token_eot(ctx)) {
             continue;
           }
         }
 
-        const char* text = whisper_full_get_token_text(ctx, i, j);
-        const float p = whisper_full_get_token_p(ctx, i, j);
+        const char* text = whisper_full_get_token_text_from_state(ctx, state, i, j);
+        const float p = whisper_full_get_token_p_from_state(state, i, j);
 
         const int col = (std::max)(
             0, (std::min)((int)k_colors.size() - 1,
@@ -488,13 +760,13 @@ void whisper_print_segment_callback(struct whisper_context* ctx,
                "\033[0m");
       }
     } else {
-      const char* text = whisper_full_get_segment_text(ctx, i);
+      const char* text = whisper_full_get_segment_text_from_state(state, i);
 
       printf("%s%s", speaker.c_str(), text);
     }
 
     if (params.tinydiarize) {
-      if (whisper_full_get_segment_speaker_turn_next(ctx, i)) {
+      if (whisper_full_get_segment_speaker_turn_next_from_state(state, i)) {
         printf("%s", params.tdrz_speaker_turn.c_str());
       }
     }
@@ -508,74 +780,547 @@ void whisper_print_segment_callback(struct whisper_context* ctx,
 }
 
 WhisperServerContext::~WhisperServerContext() {
+  // workers use ctx, stop them first
+  if (scheduler) {
+    scheduler->Stop();
+  }
   if (ctx) {
     whisper_print_timings(ctx);
-    whisper_free(ctx);
-    ctx = nullptr;
   }
+  FreeModel();
+}
+
+void WhisperServerContext::FreeModel() {
+  for (auto* state : states) {
+    whisper_free_state(state);
+  }
+  states.clear();
+  state_nodes.clear();
+  for (auto* replica : replicas) {
+    whisper_free(replica);
+  }
+  replicas.clear();
+  whisper_free(ctx);
+  ctx = nullptr;
+}
+
+struct whisper_context* WhisperServerContext::ContextFor(int worker_id) const {
+  const int node = worker_id < int(state_nodes.size()) ? state_nodes[worker_id]
+                                                       : 0;
+  return node == 0 || replicas.empty() ? ctx : replicas[node - 1];
+}
+
+const std::vector<int>& WhisperServerContext::CpusFor(int node) const {
+  return numa_nodes.empty() ? worker_cpus : numa_nodes[node].cpus;
+}
+
+void WhisperServerContext::ResolveCpus() {
+  const auto process_cpus = cpu_topology::GetProcessCpus();
+  worker_cpus.clear();
+  io_cpus.clear();
+  auto configured = inference_cpus;
+  std::sort(configured.begin(), configured.end());
+  std::set_intersection(process_cpus.begin(), process_cpus.end(),
+                        configured.begin(), configured.end(),
+                        std::back_inserter(worker_cpus));
+  if (worker_cpus.empty()) {
+    if (!inference_cpus.empty()) {
+      LOG_WARN << "None of the inference CPUs of model " << model_id
+               << " is available to the process, using all of them";
+    }
+    worker_cpus = process_cpus;
+  } else {
+    std::set_difference(process_cpus.begin(), process_cpus.end(),
+                        worker_cpus.begin(), worker_cpus.end(),
+                        std::back_inserter(io_cpus));
+  }
+
+  // NUMA placement only pays off with workers on more than one node
+  numa_nodes.clear();
+  if (numa_enabled) {
+    for (auto& node : cpu_topology::GetNumaNodes()) {
+      std::vector<int> cpus;
+      std::set_intersection(node.cpus.begin(), node.cpus.end(),
+                            worker_cpus.begin(), worker_cpus.end(),
+                            std::back_inserter(cpus));
+      if (!cpus.empty()) {
+        node.cpus = std::move(cpus);
+        numa_nodes.push_back(std::move(node));
+      }
+    }
+    if (numa_nodes.size() < 2) {
+      numa_nodes.clear();
+    }
+  }
+  LOG_INFO << "Model " << model_id << " runs inference on "
+           << worker_cpus.size() << " CPU(s), " << io_cpus.size()
+           << " left for I/O";
 }
 
 bool WhisperServerContext::LoadModel(std::string& model_path) {
+  // requantized before anything is torn down, a failure leaves the model
+  // as it was
+  ModelQuantization loaded_weights;
+  loaded_weights.path = model_path;
+  if (!weights_type.empty()) {
+    std::string error;
+    if (!PrepareQuantizedModel(model_path, weights_type, loaded_weights,
+                               error)) {
+      LOG_ERROR << "Could not requantize model " << model_id << " to "
+                << weights_type << ": " << error;
+      return false;
+    }
+  } else {
+    InspectModelFile(model_path, loaded_weights);
+  }
+
+  if (scheduler) {
+    scheduler->Stop();
+  }
   whisper_mutex.lock();
 
   // clean up
-  whisper_free(ctx);
-
-  // whisper init
-  ctx = whisper_init_from_file_with_params(model_path.c_str(), cparams);
+  FreeModel();
+
+  ResolveCpus();
+  const int n_replicas =
+      numa_replicate_weights ? (std::max)(1, int(numa_nodes.size())) : 1;
+
+  // whisper init, states are created below, one per worker. Each copy of
+  // the weights is loaded from its node, which places its memory there.
+  for (int node = 0; node < n_replicas; node++) {
+    struct whisper_context* loaded = nullptr;
+    cpu_topology::RunPinned(CpusFor(node), [&] {
+      loaded = whisper_init_from_file_with_params_no_state(
+          loaded_weights.path.c_str(), cparams);
+    });
+    // TODO perhaps load prior model here instead of exit
+    if (loaded == nullptr) {
+      FreeModel();
+      whisper_mutex.unlock();
+      return false;
+    }
+    if (node == 0) {
+      ctx = loaded;
+    } else {
+      replicas.push_back(loaded);
+    }
+  }
 
-  // TODO perhaps load prior model here instead of exit
-  if (ctx == nullptr) {
-    whisper_mutex.unlock();
-    return false;
+  quantization = std::move(loaded_weights);
+
+  ResolveThreads();
+  for (int i = 0; i < n_states; i++) {
+    const int node = numa_nodes.empty() ? 0 : i % int(numa_nodes.size());
+    state_nodes.push_back(node);
+    auto* model = ContextFor(i);
+    struct whisper_state* state = nullptr;
+    cpu_topology::RunPinned(CpusFor(node),
+                            [&] { state = whisper_init_state(model); });
+    if (state == nullptr) {
+      LOG_ERROR << "Failed to allocate whisper state " << i << " for model "
+                << model_id;
+      FreeModel();
+      whisper_mutex.unlock();
+      return false;
+    }
+    // initialize openvino encoder. this has no effect on whisper.cpp builds
+    // that don't have OpenVINO configured
+    whisper_ctx_init_openvino_encoder_with_state(
+        model, state, nullptr, params.openvino_encode_device.c_str(), nullptr);
+    states.push_back(state);
   }
 
-  // initialize openvino encoder. this has no effect on whisper.cpp builds that
-  // don't have OpenVINO configured
-  whisper_ctx_init_openvino_encoder(
-      ctx, nullptr, params.openvino_encode_device.c_str(), nullptr);
+  mel_frontend.reset();
+  if (mel_frontend_enabled) {
+    auto frontend = std::make_unique<MelFrontend>(whisper_model_n_mels(ctx));
+    bool matches = false;
+    cpu_topology::RunPinned(CpusFor(state_nodes[0]), [&] {
+      matches = frontend->MatchesWhisper(ContextFor(0), states[0],
+                                         params.n_threads);
+    });
+    if (matches) {
+      mel_frontend = std::move(frontend);
+    } else {
+      LOG_WARN << "Mel front end does not match the spectrogram of model "
+               << model_id << ", whisper computes it";
+    }
+  }
 
   // check if the model is in the file system
   whisper_mutex.unlock();
+
+  // worker i owns states[i] and runs on its node's CPUs; whisper's compute
+  // threads are started by the worker and inherit its CPU mask and name
+  if (!scheduler) {
+    scheduler = std::make_unique<InferenceScheduler>();
+  }
+  scheduler->Start(n_states, model_id, state_nodes, [this](int worker_id) {
+    cpu_topology::PinCurrentThread(CpusFor(state_nodes[worker_id]));
+    cpu_topology::SetCurrentThreadName("whisper-" + std::to_string(worker_id));
+  });
+  if (!numa_nodes.empty()) {
+    LOG_INFO << "Model " << model_id << " placed on " << numa_nodes.size()
+             << " NUMA nodes, weights "
+             << (replicas.empty() ? "shared" : "replicated");
+  }
+  // one set per worker and one per request decoding ahead of it, which
+  // covers steady load without pinning memory for rare bursts
+  buffer_pool->SetMaxIdle(2 * n_states);
   return true;
 }
 
+void WhisperServerContext::ResolveThreads() {
+  // states beyond this rarely pay off, each one holds its own KV caches
+  constexpr int kMaxTunedParallel = 4;
+  // with NUMA placement the split covers one node, the smallest one
+  const int n_nodes = numa_nodes.empty() ? 1 : int(numa_nodes.size());
+  int n_cores = (std::max)(1, static_cast<int>(worker_cpus.size()));
+  for (const auto& node : numa_nodes) {
+    n_cores = (std::min)(n_cores, static_cast<int>(node.cpus.size()));
+  }
+
+  if (n_parallel_override > 0 || n_threads_override > 0) {
+    thread_tuning = ThreadTuning();
+    thread_tuning.source = "override";
+    // an explicit n_parallel is the total over all nodes
+    thread_tuning.n_parallel =
+        n_parallel_override > 0 ? n_parallel_override : n_nodes;
+    const int per_node = (thread_tuning.n_parallel + n_nodes - 1) / n_nodes;
+    thread_tuning.n_threads = n_threads_override > 0
+                                  ? n_threads_override
+                                  : (std::max)(1, n_cores / per_node);
+  } else if (auto_tune_threads) {
+    cpu_topology::RunPinned(CpusFor(0), [&] {
+      thread_tuning = TuneThreads(ctx, n_cores, kMaxTunedParallel);
+    });
+    thread_tuning.n_parallel *= n_nodes;
+  } else {
+    thread_tuning = ThreadTuning();
+    thread_tuning.n_parallel = n_nodes;
+    thread_tuning.n_threads = (std::min)(WhisperParams().n_threads, n_cores);
+  }
+
+  n_states = thread_tuning.n_parallel;
+  params.n_threads = thread_tuning.n_threads;
+  LOG_INFO << "Model " << model_id << " runs " << n_states << " state(s) x "
+           << params.n_threads << " thread(s) (" << thread_tuning.source
+           << ")";
+}
+
+int64_t WhisperServerContext::EstimateCompletionMs(
+    int64_t audio_ms, audio::inferences::RequestPriority priority) const {
+  const int64_t pending = scheduler ? scheduler->PendingCost(priority) : 0;
+  const int n_workers = scheduler ? (std::max)(1, scheduler->NumWorkers()) : 1;
+  return static_cast<int64_t>((pending / n_workers + audio_ms) * rtf.load());
+}
+
+namespace {
+// Length of the chunks long audio is processed in: batch jobs longer than
+// this, so interactive requests can run in between, and streamed files.
+constexpr int64_t kWindowMs = 30 * 1000;
+
+// Shared with whisper's abort callbacks to stop processing once the request
+// deadline has passed.
+struct DeadlineState {
+  bool has_deadline = false;
+  std::chrono::steady_clock::time_point deadline;
+  std::atomic<bool> expired = false;
+
+  bool CheckExpired() {
+    if (has_deadline && !expired &&
+        std::chrono::steady_clock::now() >= deadline) {
+      expired = true;
+    }
+    return expired;
+  }
+};
+
+// Handed to whisper_full's encoder begin callback
+struct EncoderBeginState {
+  DeadlineState* deadline;
+  FallbackTracker* fallback;
+};
+
+// Detects the language from the encoder output |state| holds, with the
+// single decoder step whisper_lang_auto_detect_with_state takes after running
+// the encoder again. Languages are those |ctx| has tokens for: large-v3 has
+// one more than older models. Fills |probs| with whisper_lang_max_id() + 1
+// probabilities and returns the most likely language id, -1 on failure.
+int detect_language_encoded(struct whisper_context* ctx,
+                            struct whisper_state* state, int n_threads,
+                            std::vector<float>& probs) {
+  const whisper_token sot = whisper_token_sot(ctx);
+  if (whisper_decode_with_state(ctx, state, &sot, 1, 0, n_threads) != 0) {
+    return -1;
+  }
+  const float* logits = whisper_get_logits_from_state(state);
+
+  // softmax over the language tokens only
+  const int n_languages =
+      whisper_token_translate(ctx) - whisper_token_sot(ctx) - 1;
+  int best = 0;
+  for (int id = 1; id < n_languages; id++) {
+    if (logits[whisper_token_lang(ctx, id)] >
+        logits[whisper_token_lang(ctx, best)]) {
+      best = id;
+    }
+  }
+  const float max = logits[whisper_token_lang(ctx, best)];
+  probs.assign(whisper_lang_max_id() + 1, 0.0f);
+  double sum = 0.0;
+  for (int id = 0; id < n_languages; id++) {
+    probs[id] = std::exp(logits[whisper_token_lang(ctx, id)] - max);
+    sum += probs[id];
+  }
+  for (int id = 0; id < n_languages; id++) {
+    probs[id] = static_cast<float>(probs[id] / sum);
+  }
+  return best;
+}
+
+// The WAV conversion of |input_file_path|, from the cache when the same
+// content was converted before
+ConvertedAudioCache::Lease ensure_wav(ConvertedAudioCache& cache,
+                                      const std::string& input_file_path) {
+  try {
+    return cache.Get(input_file_path);
+  } catch (const DecoderSaturatedError& e) {
+    LOG_WARN << e.what();
+    throw;
+  } catch (const std::runtime_error& e) {
+    std::string error_resp =
+        "Failed to convert " + input_file_path + " to wav: " + e.what();
+    LOG_ERROR << error_resp;
+    throw std::runtime_error(error_resp);
+  }
+}
+
+void log_preprocessing(const std::string& model_id,
+                       const AudioPreprocessor::Timings& timings,
+                       size_t n_samples, bool normalized) {
+  LOG_INFO << "Model " << model_id << " preprocessed " << n_samples
+           << " samples: DC removal " << timings.remove_dc_us
+           << " us, high-pass " << timings.high_pass_us << " us, normalization "
+           << timings.normalize_us << " us"
+           << (normalized ? ", gain " + std::to_string(timings.gain_db) + " dB"
+                          : "");
+}
+}  // namespace
+
 std::string WhisperServerContext::Inference(
-    std::string& input_file_path, std::string language, std::string prompt,
-    std::string response_format, float temperature, bool translate) {
-  // acquire whisper model mutex lock
-  whisper_mutex.lock();
+    const audio::inferences::TranscriptionRequest& req,
+    FallbackStats* fallback) {
+  std::string input_file_path = req.file;
+
+  // if file is not wav, convert to wav; the converted file is read in place
+  // of the input and stays in the cache until the request is done
+  ConvertedAudioCache::Lease converted;
+  if (params.ffmpeg_converter && input_file_path != "-") {
+    converted = ensure_wav(*audio_cache, input_file_path);
+    input_file_path = *converted;
+  }
 
-  // audio arrays
-  std::vector<float> pcmf32;                // mono-channel F32 PCM
-  std::vector<std::vector<float>> pcmf32s;  // stereo-channel F32 PCM
+  // Long files are decoded window by window on the worker, so memory does
+  // not grow with their length.
+  std::unique_ptr<WavWindowReader> reader;
+  int64_t duration_ms = 0;
+  if (params.stream_decode_min_ms > 0 && input_file_path != "-" &&
+      get_wav_duration_ms(input_file_path, duration_ms) &&
+      duration_ms >= params.stream_decode_min_ms) {
+    reader = std::make_unique<WavWindowReader>();
+    if (!reader->Open(input_file_path, params.diarize)) {
+      std::string error_resp = "Failed to read WAV file " + input_file_path;
+      LOG_ERROR << error_resp;
+      throw std::runtime_error(error_resp);
+    }
+  }
 
-  // if file is not wav, convert to wav
-  if (params.ffmpeg_converter) {
-    std::string error_resp = "Failed to execute ffmpeg command converting " +
-                             input_file_path + " to wav";
-    const bool is_converted = convert_to_wav(input_file_path, error_resp);
-    if (!is_converted) {
-      whisper_mutex.unlock();
+  // Otherwise decoding runs on the calling thread: it does not touch the
+  // model, and it gives us the audio duration needed for admission control.
+  // The buffers come from the pool and go back when the request is done.
+  auto buffers = buffer_pool->Acquire();
+  if (!reader) {
+    // read wav content into pcmf32
+    if (!read_wav(input_file_path, *buffers, params.diarize)) {
+      std::string error_resp = "Failed to read WAV file " + input_file_path;
       LOG_ERROR << error_resp;
       throw std::runtime_error(error_resp);
     }
+    printf("Successfully loaded %s\n", input_file_path.c_str());
+
+    // conditioned here, off the model's workers; streamed files are
+    // conditioned window by window as they are read
+    if (req.preprocess.Enabled()) {
+      AudioPreprocessor preprocessor(req.preprocess, WHISPER_SAMPLE_RATE);
+      preprocessor.Process(buffers->pcmf32.data(), buffers->pcmf32.size());
+      preprocessing->Add(preprocessor.timings(), buffers->pcmf32.size());
+      log_preprocessing(model_id, preprocessor.timings(),
+                        buffers->pcmf32.size(), req.preprocess.normalize);
+    }
+  }
+
+  const int64_t audio_ms =
+      (reader ? reader->TotalSamples() : buffers->pcmf32.size()) * 1000 /
+      WHISPER_SAMPLE_RATE;
+  if (req.HasDeadline()) {
+    auto now = std::chrono::steady_clock::now();
+    auto estimated_done = now + std::chrono::milliseconds(EstimateCompletionMs(
+                                    audio_ms, req.priority));
+    if (estimated_done > req.Deadline()) {
+      std::string error_resp =
+          "Model " + model_id + " cannot process " +
+          std::to_string(audio_ms) + " ms of audio within the " +
+          std::to_string(req.deadline_ms) + " ms deadline";
+      LOG_WARN << error_resp;
+      throw DeadlineExceededError(error_resp, /*admitted*/ false);
+    }
+  }
+
+  // The promise is owned by the job: if the scheduler drops the job (model
+  // reloaded or unloaded), the future reports it instead of hanging.
+  auto promise = std::make_shared<std::promise<std::string>>();
+  auto future = promise->get_future();
+  InferenceScheduler::Job job;
+  job.priority = req.priority;
+  job.tenant = req.tenant;
+  job.cost = audio_ms;
+  job.task = [this, promise, &req, &buffers, &reader,
+              fallback](int worker_id) {
+    try {
+      promise->set_value(
+          RunInference(req, *buffers, reader.get(), worker_id, fallback));
+    } catch (...) {
+      promise->set_exception(std::current_exception());
+    }
+  };
+  job.on_dropped = [promise, model_id = model_id] {
+    promise->set_exception(std::make_exception_ptr(SchedulerStoppedError(
+        "Model " + model_id + " stopped before processing the request")));
+  };
+  scheduler->Submit(std::move(job));
+  return future.get();
+}
+
+LanguageDetection WhisperServerContext::DetectLanguage(
+    const audio::inferences::TranscriptionRequest& req) {
+  const auto start = std::chrono::steady_clock::now();
+  if (!whisper_is_multilingual(ctx)) {
+    throw std::invalid_argument("Model " + model_id +
+                                " is English-only, it cannot detect languages");
+  }
+  std::string input_file_path = req.file;
+  ConvertedAudioCache::Lease converted;
+  if (params.ffmpeg_converter && input_file_path != "-") {
+    converted = ensure_wav(*audio_cache, input_file_path);
+    input_file_path = *converted;
   }
 
-  // read wav content into pcmf32
-  if (!read_wav(input_file_path, pcmf32, pcmf32s, params.diarize)) {
+  // only the first window is looked at, so only that much is decoded
+  const size_t window = kWindowMs * WHISPER_SAMPLE_RATE / 1000;
+  auto buffers = buffer_pool->Acquire();
+  bool is_read = false;
+  if (input_file_path == "-") {
+    is_read = read_wav(input_file_path, *buffers, /*stereo*/ false);
+  } else {
+    WavWindowReader reader;
+    is_read = reader.Open(input_file_path, /*stereo*/ false) &&
+              reader.Read(window, *buffers) > 0;
+  }
+  if (!is_read) {
     std::string error_resp = "Failed to read WAV file " + input_file_path;
     LOG_ERROR << error_resp;
-    whisper_mutex.unlock();
     throw std::runtime_error(error_resp);
   }
+  if (buffers->pcmf32.size() > window) {
+    buffers->pcmf32.resize(window);
+  }
+  const int64_t audio_ms =
+      buffers->pcmf32.size() * 1000 / WHISPER_SAMPLE_RATE;
+
+  auto promise = std::make_shared<std::promise<LanguageDetection>>();
+  auto future = promise->get_future();
+  InferenceScheduler::Job job;
+  job.priority = req.priority;
+  job.tenant = req.tenant;
+  job.cost = audio_ms;
+  job.task = [this, promise, &buffers](int worker_id) {
+    try {
+      promise->set_value(RunLanguageDetection(*buffers, worker_id));
+    } catch (...) {
+      promise->set_exception(std::current_exception());
+    }
+  };
+  job.on_dropped = [promise, model_id = model_id] {
+    promise->set_exception(std::make_exception_ptr(SchedulerStoppedError(
+        "Model " + model_id + " stopped before processing the request")));
+  };
+  scheduler->Submit(std::move(job));
+
+  auto result = future.get();
+  result.audio_ms = audio_ms;
+  result.processing_ms =
+      std::chrono::duration_cast<std::chrono::milliseconds>(
+          std::chrono::steady_clock::now() - start)
+          .count();
+  return result;
+}
 
-  printf("Successfully loaded %s\n", input_file_path.c_str());
+LanguageDetection WhisperServerContext::RunLanguageDetection(
+    const AudioBuffers& audio, int worker_id) {
+  struct whisper_state* state = states[worker_id];
+  struct whisper_context* model = ContextFor(worker_id);
 
-  params.translate = translate;
-  params.language = language;
-  params.response_format = response_format;
-  if (!whisper_is_multilingual(ctx)) {
+  if (whisper_pcm_to_mel_with_state(model, state, audio.pcmf32.data(),
+                                    static_cast<int>(audio.pcmf32.size()),
+                                    params.n_threads) != 0 ||
+      whisper_encode_with_state(model, state, 0, params.n_threads) != 0) {
+    throw std::runtime_error("Failed to encode the audio");
+  }
+  std::vector<float> probs;
+  if (detect_language_encoded(model, state, params.n_threads, probs) < 0) {
+    throw std::runtime_error("Failed to detect the language");
+  }
+
+  LanguageDetection result;
+  result.languages.reserve(probs.size());
+  for (int id = 0; id < int(probs.size()); id++) {
+    result.languages.emplace_back(whisper_lang_str(id), probs[id]);
+  }
+  std::sort(result.languages.begin(), result.languages.end(),
+            [](const auto& a, const auto& b) { return a.second > b.second; });
+  return result;
+}
+
+std::string WhisperServerContext::RunInference(
+    const audio::inferences::TranscriptionRequest& req, AudioBuffers& audio,
+    WavWindowReader* reader, int worker_id, FallbackStats* fallback) {
+  const std::string& input_file_path = req.file;
+  const size_t total_samples =
+      reader ? reader->TotalSamples() : audio.pcmf32.size();
+  const int64_t audio_ms = total_samples * 1000 / WHISPER_SAMPLE_RATE;
+
+  DeadlineState deadline_state;
+  deadline_state.has_deadline = req.HasDeadline();
+  deadline_state.deadline = req.Deadline();
+  if (deadline_state.CheckExpired()) {
+    std::string error_resp = "Deadline exceeded while waiting for model " +
+                             model_id + " to process " + input_file_path;
+    LOG_WARN << error_resp;
+    throw DeadlineExceededError(error_resp, /*admitted*/ true);
+  }
+
+  // the worker owns its state, no lock needed
+  struct whisper_state* state = states[worker_id];
+  // the copy of the weights on the state's node
+  struct whisper_context* model = ContextFor(worker_id);
+
+  // per-request copy, workers and preempting requests run concurrently
+  WhisperParams params = this->params;
+  params.translate = req.translate;
+  params.language = req.language;
+  params.response_format = req.response_format;
+  if (!whisper_is_multilingual(model)) {
     if (params.language != "en" || params.translate) {
       params.language = "en";
       params.translate = false;
@@ -591,16 +1336,18 @@ std::string WhisperServerContext::Inference(
   // print some processing info
   std::string processing_info =
       "Model " + model_id + " processing " + input_file_path + " (" +
-      std::to_string(pcmf32.size()) + " samples, " +
-      std::to_string(float(pcmf32.size()) / WHISPER_SAMPLE_RATE) + " sec), " +
-      std::to_string(params.n_threads) + " threads, " +
-      std::to_string(params.n_processors) +
-      " processors, lang = " + params.language +
+      std::to_string(total_samples) + " samples, " +
+      std::to_string(float(total_samples) / WHISPER_SAMPLE_RATE) + " sec" +
+      (reader ? ", streamed), " : "), ") +
+      std::to_string(params.n_threads) + " threads, worker " +
+      std::to_string(worker_id) + "/" + std::to_string(n_states) +
+      ", lang = " + params.language +
       ", task = " + (params.translate ? "translate" : "transcribe") + ", " +
       (params.tinydiarize ? "tdrz = 1, " : "") +
       (params.no_timestamps ? "timestamps = 0" : "timestamps = 1");
   LOG_INFO << processing_info;
 
+  std::vector<WhisperSegment> segments;
   // run the inference
   {
     std::string msg = "Running whisper.cpp inference of model " + model_id +
@@ -635,19 +1382,25 @@ std::string WhisperServerContext::Inference(
 
     wparams.tdrz_enable = params.tinydiarize;  // [TDRZ]
 
-    wparams.initial_prompt = prompt.c_str();
+    wparams.initial_prompt = req.prompt.c_str();
 
     wparams.greedy.best_of = params.best_of;
     wparams.beam_search.beam_size = params.beam_size;
 
-    wparams.temperature = temperature;
-    wparams.temperature_inc = params.temperature_inc;
+    // latency sensitive tenants get less fallback when it rarely helps them
+    const bool latency_sensitive =
+        req.HasDeadline() ||
+        req.priority == audio::inferences::RequestPriority::kInteractive;
+    wparams.temperature = req.temperature;
+    wparams.temperature_inc = fallback_policy->TemperatureInc(
+        req.tenant, latency_sensitive, req.temperature,
+        params.temperature_inc);
     wparams.entropy_thold = params.entropy_thold;
     wparams.logprob_thold = params.logprob_thold;
 
     wparams.no_timestamps = params.no_timestamps;
 
-    WhisperPrintUserData user_data = {&params, &pcmf32s, 0};
+    WhisperPrintUserData user_data = {&params, &audio.pcmf32s, 0};
 
     // this callback is called on each new segment
     if (params.print_realtime) {
@@ -660,137 +1413,201 @@ std::string WhisperServerContext::Inference(
       wparams.progress_callback_user_data = &user_data;
     }
 
-    // examples for abort mechanism
-    // in examples below, we do not abort the processing, but we could if the
-    // flag is set to true
-
-    // the callback is called before every encoder run - if it returns false,
-    // the processing is aborted
-    {
-      static bool is_aborted =
-          false;  // NOTE: this should be atomic to avoid data race
-
-      wparams.encoder_begin_callback = [](struct whisper_context* /*ctx*/,
-                                          struct whisper_state* /*state*/,
-                                          void* user_data) {
-        bool is_aborted = *(bool*)user_data;
-        return !is_aborted;
-      };
-      wparams.encoder_begin_callback_user_data = &is_aborted;
-    }
-
-    // the callback is called before every computation - if it returns true, the
-    // computation is aborted
-    {
-      static bool is_aborted =
-          false;  // NOTE: this should be atomic to avoid data race
-
-      wparams.abort_callback = [](void* user_data) {
-        bool is_aborted = *(bool*)user_data;
-        return is_aborted;
-      };
-      wparams.abort_callback_user_data = &is_aborted;
+    // the callback is called before every encoder run, i.e. once per
+    // window - if it returns false, the processing is aborted
+    FallbackTracker fallback_tracker(wparams.temperature,
+                                     wparams.temperature_inc);
+    EncoderBeginState encoder_begin_state = {&deadline_state,
+                                             &fallback_tracker};
+    wparams.encoder_begin_callback = [](struct whisper_context* /*ctx*/,
+                                        struct whisper_state* /*state*/,
+                                        void* user_data) {
+      auto* s = static_cast<EncoderBeginState*>(user_data);
+      s->fallback->OnEncoderBegin();
+      return !s->deadline->CheckExpired();
+    };
+    wparams.encoder_begin_callback_user_data = &encoder_begin_state;
+
+    // called for every decoding step; a pass starts from an empty sequence,
+    // more than one pass per window is temperature fallback
+    wparams.logits_filter_callback =
+        [](struct whisper_context* /*ctx*/, struct whisper_state* /*state*/,
+           const whisper_token_data* /*tokens*/, int n_tokens,
+           float* /*logits*/, void* user_data) {
+          if (n_tokens == 0) {
+            static_cast<FallbackTracker*>(user_data)->OnPassStart();
+          }
+        };
+    wparams.logits_filter_callback_user_data = &fallback_tracker;
+
+    // the callback is called before every computation - if it returns true,
+    // the computation is aborted
+    wparams.abort_callback = [](void* user_data) {
+      return static_cast<DeadlineState*>(user_data)->CheckExpired();
+    };
+    wparams.abort_callback_user_data = &deadline_state;
+
+    // Long batch jobs run chunk by chunk and let queued interactive requests
+    // through in between; streamed files are decoded and run one window at
+    // a time. Each chunk is prompted with the previous chunk's text to keep
+    // the context.
+    const bool batch =
+        req.priority == audio::inferences::RequestPriority::kBatch;
+    const bool chunked = reader != nullptr || (batch && audio_ms > kWindowMs);
+    const size_t chunk_samples =
+        chunked ? kWindowMs * WHISPER_SAMPLE_RATE / 1000 : total_samples;
+    const size_t max_prompt = whisper_n_text_ctx(model) / 2;
+    std::vector<whisper_token> prompt_tokens;
+    std::vector<float> mel;
+    // a session's context is reused as is, its prompt tokenized only when
+    // it does not continue the session
+    std::vector<whisper_token> session_tokens;
+    if (!req.session_id.empty()) {
+      session_tokens = sessions->PromptTokens(req.tenant, req.session_id,
+                                              req.prompt, model, max_prompt);
+      prompt_tokens = session_tokens;
     }
-
-    if (whisper_full_parallel(ctx, wparams, pcmf32.data(), pcmf32.size(),
-                              params.n_processors) != 0) {
-      std::string error_resp = "Failed to process audio";
-      LOG_ERROR << error_resp;
-      whisper_mutex.unlock();
-      throw std::runtime_error(error_resp);
+    std::chrono::steady_clock::duration busy{0};
+    std::unique_ptr<AudioPreprocessor> preprocessor;
+    if (reader && req.preprocess.Enabled()) {
+      preprocessor = std::make_unique<AudioPreprocessor>(req.preprocess,
+                                                         WHISPER_SAMPLE_RATE);
     }
-  }
-
-  // return results to user
-  std::string result;
-  if (params.response_format == text_format) {
-    result = output_str(ctx, params, pcmf32s);
-  } else if (params.response_format == srt_format) {
-    std::stringstream ss;
-    const int n_segments = whisper_full_n_segments(ctx);
-    for (int i = 0; i < n_segments; ++i) {
-      const char* text = whisper_full_get_segment_text(ctx, i);
-      const int64_t t0 = whisper_full_get_segment_t0(ctx, i);
-      const int64_t t1 = whisper_full_get_segment_t1(ctx, i);
-      std::string speaker = "";
 
-      if (params.diarize && pcmf32s.size() == 2) {
-        speaker = estimate_diarization_speaker(pcmf32s, t0, t1);
+    size_t offset = 0;
+    do {
+      // samples of this chunk, and the stereo PCM they are part of
+      const float* samples = nullptr;
+      size_t n_samples = 0;
+      int64_t pcmf32s_t0 = 0;
+      if (reader) {
+        n_samples = reader->Read(chunk_samples, audio);
+        if (n_samples == 0) {
+          break;
+        }
+        if (preprocessor) {
+          preprocessor->Process(audio.pcmf32.data(), n_samples);
+        }
+        samples = audio.pcmf32.data();
+        pcmf32s_t0 = offset * 100 / WHISPER_SAMPLE_RATE;
+      } else {
+        n_samples = (std::min)(chunk_samples, total_samples - offset);
+        samples = audio.pcmf32.data() + offset;
       }
-
-      ss << i + 1 + params.offset_n << "\n";
-      ss << to_timestamp(t0, true) << " --> " << to_timestamp(t1, true) << "\n";
-      ss << speaker << text << "\n\n";
-    }
-    result = ss.str();
-  } else if (params.response_format == vtt_format) {
-    std::stringstream ss;
-
-    ss << "WEBVTT\n\n";
-
-    const int n_segments = whisper_full_n_segments(ctx);
-    for (int i = 0; i < n_segments; ++i) {
-      const char* text = whisper_full_get_segment_text(ctx, i);
-      const int64_t t0 = whisper_full_get_segment_t0(ctx, i);
-      const int64_t t1 = whisper_full_get_segment_t1(ctx, i);
-      std::string speaker = "";
-
-      if (params.diarize && pcmf32s.size() == 2) {
-        speaker = estimate_diarization_speaker(pcmf32s, t0, t1, true);
-        speaker.insert(0, "<v Speaker");
-        speaker.append(">");
+      if (offset > 0 || !prompt_tokens.empty()) {
+        wparams.initial_prompt = nullptr;
+        wparams.prompt_tokens = prompt_tokens.data();
+        wparams.prompt_n_tokens = static_cast<int>(prompt_tokens.size());
       }
 
-      ss << to_timestamp(t0) << " --> " << to_timestamp(t1) << "\n";
-      ss << speaker << text << "\n\n";
-    }
-    result = ss.str();
-  } else if (params.response_format == vjson_format) {
-    /* try to match openai/whisper's Python format */
-    std::string results = output_str(ctx, params, pcmf32s);
-    json jres = json{{"text", results}};
-    const int n_segments = whisper_full_n_segments(ctx);
-    for (int i = 0; i < n_segments; ++i) {
-      json segment = json{
-          {"id", i},
-          {"text", whisper_full_get_segment_text(ctx, i)},
-      };
-
-      if (!params.no_timestamps) {
-        segment["start"] = whisper_full_get_segment_t0(ctx, i) * 0.01;
-        segment["end"] = whisper_full_get_segment_t1(ctx, i) * 0.01;
+      auto start = std::chrono::steady_clock::now();
+      int ret = 0;
+      if (mel_frontend) {
+        int n_audio_frames = 0;
+        const int n_frames = mel_frontend->Compute(
+            samples, static_cast<int>(n_samples), params.n_threads, mel,
+            &n_audio_frames);
+        // whisper_set_mel counts the silence the spectrogram is padded
+        // with as audio, the duration keeps whisper_full out of it
+        if (params.duration_ms == 0) {
+          wparams.duration_ms =
+              (std::max)(1, n_audio_frames - params.offset_t_ms / 10) * 10;
+        }
+        ret = whisper_set_mel_with_state(model, state, mel.data(), n_frames,
+                                         mel_frontend->n_mels());
+        if (ret == 0) {
+          // without samples whisper_full starts from the spectrogram set
+          ret = whisper_full_with_state(model, state, wparams, samples, 0);
+        }
+        wparams.duration_ms = params.duration_ms;
+      } else {
+        ret = whisper_full_with_state(model, state, wparams, samples,
+                                      static_cast<int>(n_samples));
+      }
+      fallback_tracker.Finish();
+      busy += std::chrono::steady_clock::now() - start;
+      if (deadline_state.expired) {
+        std::string error_resp = "Deadline exceeded while processing " +
+                                 input_file_path + " with model " + model_id;
+        LOG_WARN << error_resp;
+        throw DeadlineExceededError(error_resp, /*admitted*/ true);
+      }
+      if (ret != 0) {
+        std::string error_resp = "Failed to process audio";
+        LOG_ERROR << error_resp;
+        throw std::runtime_error(error_resp);
       }
 
-      const int n_tokens = whisper_full_n_tokens(ctx, i);
-      for (int j = 0; j < n_tokens; ++j) {
-        whisper_token_data token = whisper_full_get_token_data(ctx, i, j);
-        if (token.id >= whisper_token_eot(ctx)) {
-          continue;
+      const size_t first_new = segments.size();
+      collect_segments(model, state, params, audio.pcmf32s, pcmf32s_t0,
+                       offset * 100 / WHISPER_SAMPLE_RATE, segments);
+
+      if (chunked && offset + chunk_samples < total_samples) {
+        prompt_tokens.clear();
+        for (size_t i = first_new; i < segments.size(); i++) {
+          for (const auto& token : segments[i].tokens) {
+            prompt_tokens.push_back(token.data.id);
+          }
+        }
+        if (prompt_tokens.size() > max_prompt) {
+          prompt_tokens.erase(prompt_tokens.begin(),
+                              prompt_tokens.end() - max_prompt);
         }
 
-        segment["tokens"].push_back(token.id);
-        json word = json{{"word", whisper_full_get_token_text(ctx, i, j)}};
-        if (!params.no_timestamps) {
-          word["start"] = token.t0 * 0.01;
-          word["end"] = token.t1 * 0.01;
+        if (batch) {
+          scheduler->RunPreemptors(worker_id, kWindowMs);
         }
-        word["probability"] = token.p;
-        segment["words"].push_back(word);
       }
-      jres["segments"].push_back(segment);
+      offset += n_samples;
+    } while (offset < total_samples);
+
+    if (!req.session_id.empty()) {
+      std::vector<whisper_token> tokens;
+      for (const auto& segment : segments) {
+        for (const auto& token : segment.tokens) {
+          tokens.push_back(token.data.id);
+        }
+      }
+      sessions->Update(req.tenant, req.session_id, session_tokens, tokens,
+                       model, max_prompt);
     }
-    result = jres.dump(-1, ' ', false, json::error_handler_t::replace);
-  } else {
-    std::string results = output_str(ctx, params, pcmf32s);
-    json jres = json{{"text", results}};
-    result = jres.dump(-1, ' ', false, json::error_handler_t::replace);
-  }
 
-  // reset params to thier defaults
-  params = default_params;
+    FallbackStats fallback_stats = fallback_tracker.stats();
+    fallback_stats.decode_ms =
+        std::chrono::duration_cast<std::chrono::milliseconds>(busy).count();
+    fallback_policy->Record(
+        req.tenant, fallback_stats,
+        wparams.temperature_inc == params.temperature_inc &&
+            params.temperature_inc > 0.0f);
+    if (fallback_stats.fallback_windows > 0) {
+      LOG_INFO << "Model " << model_id << " decoded "
+               << fallback_stats.fallback_windows << " of "
+               << fallback_stats.windows << " windows again at higher "
+               << "temperatures: " << fallback_stats.fallback_passes
+               << " passes, " << fallback_stats.recovered << " recovered, "
+               << fallback_stats.fallback_ms << " of "
+               << fallback_stats.decode_ms << " ms";
+    }
+    if (fallback != nullptr) {
+      *fallback = fallback_stats;
+    }
+    if (preprocessor) {
+      preprocessing->Add(preprocessor->timings(), offset);
+      log_preprocessing(model_id, preprocessor->timings(), offset,
+                        req.preprocess.normalize);
+    }
+    if (audio_ms > 0) {
+      auto busy_ms =
+          std::chrono::duration_cast<std::chrono::milliseconds>(busy).count();
+      // exponential moving average, seeded with the first measurement
+      const float sample = float(busy_ms) / float(audio_ms);
+      const float prev = rtf.load();
+      rtf = prev == 0.0f ? sample : 0.8f * prev + 0.2f * sample;
+    }
+  }
 
-  // return whisper model mutex lock
-  whisper_mutex.unlock();
+  // return results to user
+  std::string result = format_segments(segments, params);
   LOG_INFO << "Successfully processed " << input_file_path << ": " << result;
 
   return result;
@@ -1,10 +1,25 @@
 #pragma once
+#include <atomic>
+#include <memory>
 #include <mutex>
+#include <stdexcept>
 #include <vector>
 #include <utility>
 #include <string>
 #include <thread>
 
+#include "audio_buffer_pool.h"
+#include "audio_preprocessor.h"
+#include "converted_audio_cache.h"
+#include "cpu_topology.h"
+#include "fallback_policy.h"
+#include "ffmpeg_decoder_pool.h"
+#include "inference_scheduler.h"
+#include "mel_frontend.h"
+#include "model_quantizer.h"
+#include "session_cache.h"
+#include "thread_tuner.h"
+#include "transcription_request.h"
 #include "whisper.h"
 
 // Terminal color map. 10 colors grouped in ranges [0.0, 0.1, ..., 0.9]
@@ -36,6 +51,9 @@ struct WhisperParams {
   int32_t max_len = 0;
   int32_t best_of = 2;
   int32_t beam_size = -1;
+  // WAV files at least this long are decoded from disk window by window
+  // instead of as a whole, 0 disables
+  int32_t stream_decode_min_ms = 10 * 60 * 1000;
 
   float word_thold = 0.01f;
   float entropy_thold = 2.40f;
@@ -81,12 +99,58 @@ struct WhisperParams {
 bool read_wav(const std::string& fname, std::vector<float>& pcmf32,
               std::vector<std::vector<float>>& pcmf32s, bool stereo);
 
-std::string output_str(struct whisper_context* ctx,
-                       const WhisperParams& params,
-                       std::vector<std::vector<float>> pcmf32s);
+// Same as above, decoding into (and reusing the capacity of) |buffers|
+bool read_wav(const std::string& fname, AudioBuffers& buffers, bool stereo);
+
+// Same as read_wav, for a WAV file that is already in memory
+bool read_wav_from_memory(const void* data, size_t size,
+                          std::vector<float>& pcmf32,
+                          std::vector<std::vector<float>>& pcmf32s,
+                          bool stereo);
+
+// A decoded segment copied out of the whisper state, so results survive
+// further whisper_full calls on the same context (chunked or preempted jobs).
+struct WhisperSegment {
+  struct Token {
+    whisper_token_data data;
+    std::string text;
+  };
+
+  int64_t t0 = 0;  // centiseconds from the start of the audio
+  int64_t t1 = 0;
+  std::string text;
+  // "0", "1" or "?" when diarizing stereo audio, empty otherwise
+  std::string speaker;
+  bool speaker_turn_next = false;
+  // text tokens only, special tokens are skipped
+  std::vector<Token> tokens;
+};
+
+// Copies the segments of the last whisper_full run on |state|, shifting
+// timestamps by |t_offset| centiseconds. Speakers are estimated from
+// |pcmf32s| if set, whose first sample is at |pcmf32s_t0| centiseconds.
+void collect_segments(struct whisper_context* ctx, struct whisper_state* state,
+                      const WhisperParams& params,
+                      const std::vector<std::vector<float>>& pcmf32s,
+                      int64_t pcmf32s_t0, int64_t t_offset,
+                      std::vector<WhisperSegment>& segments);
+
+// Reads only the WAV header of |fname| and returns the audio duration.
+// Returns false if the file is not a readable WAV file.
+bool get_wav_duration_ms(const std::string& fname, int64_t& duration_ms);
+
+std::string output_str(const std::vector<WhisperSegment>& segments,
+                       const WhisperParams& params);
+
+// Renders |segments| in params.response_format
+std::string format_segments(const std::vector<WhisperSegment>& segments,
+                            const WhisperParams& params);
+
+// MIME type of a result rendered in |response_format|
+std::string content_type_for(const std::string& response_format);
 
 std::string estimate_diarization_speaker(
-    std::vector<std::vector<float>> pcmf32s, int64_t t0, int64_t t1,
+    const std::vector<std::vector<float>>& pcmf32s, int64_t t0, int64_t t1,
     bool id_only = false);
 
 //  500 -> 00:05.000
@@ -104,16 +168,40 @@ bool WhisperParams_parse(int argc, char** argv, WhisperParams& params);
 
 void check_ffmpeg_availibility();
 
-bool convert_to_wav(const std::string& temp_filename, std::string& error_resp);
+// Converts |input_filename| to 16 kHz mono PCM WAV at |output_filename|
+// with ffmpeg, leaving the input as it is. Runs ffmpeg through the shell;
+// FfmpegDecoderPool does the same without, where it is supported.
+bool convert_to_wav(const std::string& input_filename,
+                    const std::string& output_filename,
+                    std::string& error_resp);
 
 void whisper_print_progress_callback(struct whisper_context* /*ctx*/,
                                      struct whisper_state* /*state*/,
                                      int progress, void* user_data);
 
 void whisper_print_segment_callback(struct whisper_context* ctx,
-                                    struct whisper_state* /*state*/, int n_new,
+                                    struct whisper_state* state, int n_new,
                                     void* user_data);
 
+// Thrown by Inference when a request cannot finish within its deadline.
+// |admitted| is false when the request was rejected before any work started,
+// true when it was aborted while waiting for or running the model.
+struct DeadlineExceededError : public std::runtime_error {
+  DeadlineExceededError(const std::string& msg, bool admitted)
+      : std::runtime_error(msg), admitted(admitted) {}
+  bool admitted;
+};
+
+// Result of WhisperServerContext::DetectLanguage
+struct LanguageDetection {
+  // (language code, probability), most likely first
+  std::vector<std::pair<std::string, float>> languages;
+  // audio looked at, at most one 30 s window
+  int64_t audio_ms = 0;
+  // decoding, queueing and detection
+  int64_t processing_ms = 0;
+};
+
 struct WhisperPrintUserData {
   const WhisperParams* params;
 
@@ -121,14 +209,87 @@ struct WhisperPrintUserData {
   int progress_prev;
 };
 
+class WavWindowReader;
+
 struct WhisperServerContext {
   WhisperParams params;
   WhisperParams default_params;
   std::mutex whisper_mutex;
   std::string model_id;
 
+  // Orders requests in front of the model's worker; created by LoadModel.
+  std::unique_ptr<InferenceScheduler> scheduler;
+  // Moving average of the measured real-time factor (processing time / audio
+  // time), used for admission control.
+  std::atomic<float> rtf = 0.0f;
+
   struct whisper_context_params cparams;
   struct whisper_context* ctx = nullptr;
+  // One state per scheduler worker, so requests run in parallel on the
+  // shared model weights.
+  std::vector<struct whisper_state*> states;
+  int n_states = 1;
+
+  // Set before LoadModel, 0 means not set. Whatever is not set is derived
+  // from the other override, measured when |auto_tune_threads| is on, or
+  // left at the defaults.
+  int n_parallel_override = 0;
+  int n_threads_override = 0;
+  bool auto_tune_threads = false;
+  // The split LoadModel settled on
+  ThreadTuning thread_tuning;
+
+  // Type to requantize the weight matrices to at load ("q8_0", "q5_1",
+  // "q4_0"), set before LoadModel; empty loads the model file as it is.
+  // The requantized copy is cached on disk next to the model file.
+  std::string weights_type;
+  // What LoadModel loaded
+  ModelQuantization quantization;
+
+  // NUMA placement, set before LoadModel. On hosts with more than one node
+  // the states are spread round robin over the nodes, each pinned with its
+  // worker and compute threads to its node. With |numa_replicate_weights|
+  // every node gets its own copy of the weights instead of reading node 0's
+  // copy across the interconnect.
+  bool numa_enabled = true;
+  bool numa_replicate_weights = false;
+  // Nodes in use, empty when placement is off or the host has a single node
+  std::vector<cpu_topology::NumaNode> numa_nodes;
+  // Index into |numa_nodes| of every state
+  std::vector<int> state_nodes;
+  // Weights of nodes 1.. when replicated, node 0 uses |ctx|
+  std::vector<struct whisper_context*> replicas;
+
+  // CPUs reserved for inference, set before LoadModel; empty means every
+  // CPU of the process. Workers and their compute threads are pinned to
+  // this set (their node's share of it with NUMA placement), so they do
+  // not compete with I/O and request handling for cores.
+  std::vector<int> inference_cpus;
+  // What LoadModel resolved: the workers' CPUs, and the process CPUs left
+  // for I/O, which is empty when no inference set was configured
+  std::vector<int> worker_cpus;
+  std::vector<int> io_cpus;
+  // Compute the mel spectrogram with MelFrontend instead of whisper, set
+  // before LoadModel; off by default. LoadModel keeps the front end only if
+  // it matches the model's own spectrogram.
+  bool mel_frontend_enabled = false;
+  std::unique_ptr<MelFrontend> mel_frontend;
+  // Decoded audio of requests in flight, reused across requests
+  std::unique_ptr<AudioBufferPool> buffer_pool =
+      std::make_unique<AudioBufferPool>();
+  // Conversions of non-WAV inputs when params.ffmpeg_converter is on; the
+  // engine shares one cache, fed by its decoder pool, between its models
+  std::shared_ptr<ConvertedAudioCache> audio_cache =
+      std::make_shared<ConvertedAudioCache>(convert_to_wav);
+  // Time spent conditioning the audio of requests that asked for it
+  std::unique_ptr<PreprocessingStats> preprocessing =
+      std::make_unique<PreprocessingStats>();
+  // Temperature fallback of the requests, and when adaptive, the fallback
+  // each tenant gets
+  std::unique_ptr<FallbackPolicy> fallback_policy =
+      std::make_unique<FallbackPolicy>();
+  // Prompt tokens of the sessions requests name
+  std::unique_ptr<SessionCache> sessions = std::make_unique<SessionCache>();
 
   WhisperServerContext() = default;  // add this line
 
@@ -149,17 +310,77 @@ struct WhisperServerContext {
         whisper_mutex()  // std::mutex is not movable, so we initialize a new one
         ,
         model_id(std::move(other.model_id)),
+        scheduler(std::move(other.scheduler)),
+        rtf(other.rtf.load()),
         cparams(std::move(other.cparams)),
         ctx(std::exchange(
             other.ctx,
-            nullptr))  // ctx is a raw pointer, so we use std::exchange
-  {}
+            nullptr)),  // ctx is a raw pointer, so we use std::exchange
+        states(std::move(other.states)),
+        n_states(other.n_states),
+        n_parallel_override(other.n_parallel_override),
+        n_threads_override(other.n_threads_override),
+        auto_tune_threads(other.auto_tune_threads),
+        thread_tuning(std::move(other.thread_tuning)),
+        weights_type(std::move(other.weights_type)),
+        quantization(std::move(other.quantization)),
+        numa_enabled(other.numa_enabled),
+        numa_replicate_weights(other.numa_replicate_weights),
+        numa_nodes(std::move(other.numa_nodes)),
+        state_nodes(std::move(other.state_nodes)),
+        replicas(std::move(other.replicas)),
+        inference_cpus(std::move(other.inference_cpus)),
+        worker_cpus(std::move(other.worker_cpus)),
+        io_cpus(std::move(other.io_cpus)),
+        mel_frontend_enabled(other.mel_frontend_enabled),
+        mel_frontend(std::move(other.mel_frontend)),
+        buffer_pool(std::move(other.buffer_pool)),
+        audio_cache(std::move(other.audio_cache)),
+        preprocessing(std::move(other.preprocessing)),
+        fallback_policy(std::move(other.fallback_policy)),
+        sessions(std::move(other.sessions)) {}
 
   bool LoadModel(std::string& model_path);
 
-  std::string Inference(std::string& input_file_path, std::string languague,
-                        std::string prompt, std::string response_format,
-                        float temperature, bool translate);
+  // Estimated time to finish |audio_ms| of audio of |priority| behind the
+  // current queue. Returns 0 until the real-time factor has been measured.
+  int64_t EstimateCompletionMs(
+      int64_t audio_ms, audio::inferences::RequestPriority priority) const;
+
+  // Decodes the audio on the calling thread, then queues the request on the
+  // scheduler and blocks until a worker has processed it. |fallback|, if
+  // given, receives the request's temperature fallback.
+  std::string Inference(const audio::inferences::TranscriptionRequest& req,
+                        FallbackStats* fallback = nullptr);
+
+  // Identifies the spoken language from the first window of the audio: one
+  // mel window, one encoder pass and a single decoder step instead of a
+  // transcription. Queued like Inference. Throws std::invalid_argument for
+  // English-only models.
+  LanguageDetection DetectLanguage(
+      const audio::inferences::TranscriptionRequest& req);
 
   ~WhisperServerContext();
+
+ private:
+  // Picks n_states and params.n_threads, see n_parallel_override. With NUMA
+  // placement the split is made for one node and repeated on every node.
+  void ResolveThreads();
+  // Frees the states and every copy of the weights
+  void FreeModel();
+  // Weights used by the state of |worker_id|
+  struct whisper_context* ContextFor(int worker_id) const;
+  // CPUs of the workers on |node|
+  const std::vector<int>& CpusFor(int node) const;
+  // Resolves worker_cpus, io_cpus and numa_nodes
+  void ResolveCpus();
+
+  // Runs on a scheduler worker. |audio| holds the whole file, or when
+  // |reader| is set, receives one window of it at a time.
+  std::string RunInference(const audio::inferences::TranscriptionRequest& req,
+                           AudioBuffers& audio, WavWindowReader* reader,
+                           int worker_id, FallbackStats* fallback);
+  // Runs on a scheduler worker, |audio| holds at most one window
+  LanguageDetection RunLanguageDetection(const AudioBuffers& audio,
+                                         int worker_id);
 };
\ No newline at end of file
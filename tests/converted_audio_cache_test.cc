@@ -0,0 +1,162 @@
+#include "converted_audio_cache.h"
+
+#include <gtest/gtest.h>
+
+#include <atomic>
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace {
+namespace fs = std::filesystem;
+
+// Bytes of every converted file
+constexpr uint64_t kFileBytes = 100;
+
+class ConvertedAudioCacheTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    dir_ = fs::path(::testing::TempDir()) /
+           ("converted_audio_cache_test_" +
+            std::string(::testing::UnitTest::GetInstance()
+                            ->current_test_info()
+                            ->name()));
+    fs::remove_all(dir_);
+    fs::create_directories(dir_ / "cache");
+  }
+  void TearDown() override { fs::remove_all(dir_); }
+
+  // Stands in for ffmpeg: writes kFileBytes, after |delay_|
+  ConvertedAudioCache::Converter Converter() {
+    return [this](const std::string& input, const std::string& output,
+                  std::string& error) {
+      conversions_++;
+      std::this_thread::sleep_for(delay_);
+      std::ofstream(output, std::ios::binary)
+          << std::string(kFileBytes, 'w');
+      return true;
+    };
+  }
+
+  std::unique_ptr<ConvertedAudioCache> Cache(uint64_t max_bytes) {
+    return std::make_unique<ConvertedAudioCache>(
+        Converter(), (dir_ / "cache").string(), max_bytes);
+  }
+
+  // A source file holding |content|
+  std::string Input(const std::string& name, const std::string& content) {
+    const std::string path = (dir_ / name).string();
+    std::ofstream(path, std::ios::binary) << content;
+    return path;
+  }
+
+  fs::path dir_;
+  std::atomic<int> conversions_ = 0;
+  std::chrono::milliseconds delay_{0};
+};
+}  // namespace
+
+TEST_F(ConvertedAudioCacheTest, ConvertsEachContentOnce) {
+  auto cache = Cache(ConvertedAudioCache::kDefaultMaxBytes);
+  const auto first = cache->Get(Input("a.mp3", "some audio"));
+  // another file with the same content
+  const auto second = cache->Get(Input("b.mp3", "some audio"));
+  EXPECT_EQ(*first, *second);
+  EXPECT_TRUE(fs::exists(*first));
+  cache->Get(Input("c.mp3", "other audio"));
+
+  const auto stats = cache->GetStats();
+  EXPECT_EQ(conversions_, 2);
+  EXPECT_EQ(stats.hits, 1);
+  EXPECT_EQ(stats.misses, 2);
+  EXPECT_EQ(stats.entries, 2);
+  EXPECT_EQ(stats.bytes, int64_t(2 * kFileBytes));
+}
+
+TEST_F(ConvertedAudioCacheTest, EvictsTheLeastRecentlyUsedFile) {
+  auto cache = Cache(2 * kFileBytes);
+  const std::string a = *cache->Get(Input("a.mp3", "a"));
+  const std::string b = *cache->Get(Input("b.mp3", "b"));
+  cache->Get(Input("a.mp3", "a"));
+  const std::string c = *cache->Get(Input("c.mp3", "c"));
+
+  EXPECT_TRUE(fs::exists(a));
+  EXPECT_FALSE(fs::exists(b));
+  EXPECT_TRUE(fs::exists(c));
+  EXPECT_EQ(cache->GetStats().bytes, int64_t(2 * kFileBytes));
+}
+
+TEST_F(ConvertedAudioCacheTest, KeepsFilesThatAreRead) {
+  auto cache = Cache(kFileBytes);
+  auto a = cache->Get(Input("a.mp3", "a"));
+  auto b = cache->Get(Input("b.mp3", "b"));
+  // over the limit, but both are read
+  EXPECT_TRUE(fs::exists(*a));
+  EXPECT_TRUE(fs::exists(*b));
+  EXPECT_EQ(cache->GetStats().entries, 2);
+
+  // a is the least recently used, and goes once released
+  const std::string a_path = *a;
+  a.reset();
+  EXPECT_FALSE(fs::exists(a_path));
+  EXPECT_TRUE(fs::exists(*b));
+
+  // the limit lowered to 0 keeps b until it is released
+  cache->SetMaxBytes(0);
+  EXPECT_TRUE(fs::exists(*b));
+  const std::string b_path = *b;
+  b.reset();
+  EXPECT_FALSE(fs::exists(b_path));
+  EXPECT_EQ(cache->GetStats().entries, 0);
+}
+
+TEST_F(ConvertedAudioCacheTest, ConvertsConcurrentRequestsOnce) {
+  auto cache = Cache(ConvertedAudioCache::kDefaultMaxBytes);
+  delay_ = std::chrono::milliseconds(100);
+  const std::string input = Input("a.mp3", "some audio");
+  constexpr int kThreads = 8;
+  std::vector<std::string> paths(kThreads);
+  std::vector<std::thread> threads;
+  for (int i = 0; i < kThreads; i++) {
+    threads.emplace_back([&, i] { paths[i] = *cache->Get(input); });
+  }
+  for (auto& t : threads) {
+    t.join();
+  }
+
+  EXPECT_EQ(conversions_, 1);
+  for (const auto& path : paths) {
+    EXPECT_EQ(path, paths[0]);
+  }
+  const auto stats = cache->GetStats();
+  EXPECT_EQ(stats.misses, 1);
+  EXPECT_EQ(stats.hits, kThreads - 1);
+}
+
+TEST_F(ConvertedAudioCacheTest, RemovesOnlyStaleConversions) {
+  const fs::path stale = dir_ / "cache" / "x.1234.tmp";
+  const fs::path recent = dir_ / "cache" / "y.5678.tmp";
+  std::ofstream(stale) << "half";
+  std::ofstream(recent) << "half";
+  fs::last_write_time(stale, fs::file_time_type::clock::now() -
+                                 ConvertedAudioCache::kStaleTmpAge -
+                                 std::chrono::minutes(1));
+
+  auto cache = Cache(ConvertedAudioCache::kDefaultMaxBytes);
+  cache->Get(Input("a.mp3", "a"));
+  EXPECT_FALSE(fs::exists(stale));
+  // may still be written by another process
+  EXPECT_TRUE(fs::exists(recent));
+}
+
+TEST_F(ConvertedAudioCacheTest, MovesOnlyBeforeFirstUse) {
+  auto cache = Cache(ConvertedAudioCache::kDefaultMaxBytes);
+  const std::string other = (dir_ / "other").string();
+  ASSERT_TRUE(cache->SetDir(other));
+  const auto converted = cache->Get(Input("a.mp3", "a"));
+  EXPECT_EQ(fs::path(*converted).parent_path(), fs::path(other));
+  EXPECT_FALSE(cache->SetDir((dir_ / "cache").string()));
+}
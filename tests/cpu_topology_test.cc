@@ -0,0 +1,40 @@
+#include "cpu_topology.h"
+
+#include <gtest/gtest.h>
+
+#include <vector>
+
+using cpu_topology::kMaxCpus;
+using cpu_topology::ParseCpuList;
+
+TEST(ParseCpuListTest, ExpandsRangesAndSingleCpus) {
+  EXPECT_EQ(ParseCpuList("0-3,8,10-11"),
+            (std::vector<int>{0, 1, 2, 3, 8, 10, 11}));
+}
+
+TEST(ParseCpuListTest, SortsAndRemovesDuplicates) {
+  EXPECT_EQ(ParseCpuList("6,2-4,3,0"), (std::vector<int>{0, 2, 3, 4, 6}));
+}
+
+TEST(ParseCpuListTest, ReadsSysfsLines) {
+  EXPECT_EQ(ParseCpuList("0-1\n"), (std::vector<int>{0, 1}));
+  EXPECT_TRUE(ParseCpuList("").empty());
+  EXPECT_TRUE(ParseCpuList("\n").empty());
+}
+
+TEST(ParseCpuListTest, SkipsMalformedRanges) {
+  EXPECT_EQ(ParseCpuList("x,1,-3,2-y,4"), (std::vector<int>{1, 4}));
+}
+
+TEST(ParseCpuListTest, SkipsReversedRanges) {
+  EXPECT_EQ(ParseCpuList("5-2,7"), (std::vector<int>{7}));
+}
+
+TEST(ParseCpuListTest, StopsAtTheLargestPinnableCpu) {
+  auto cpus = ParseCpuList("0-2147483647");
+  ASSERT_EQ(cpus.size(), size_t(kMaxCpus));
+  EXPECT_EQ(cpus.back(), kMaxCpus - 1);
+  EXPECT_EQ(ParseCpuList("1,4000"), (std::vector<int>{1}));
+  // does not fit an int
+  EXPECT_EQ(ParseCpuList("1,0-99999999999"), (std::vector<int>{1}));
+}
@@ -0,0 +1,184 @@
+#include "fallback_policy.h"
+
+#include <gtest/gtest.h>
+
+#include <string>
+
+namespace {
+using Mode = FallbackPolicy::Mode;
+
+constexpr float kTemperatureInc = 0.2f;
+
+FallbackStats Stats(int64_t fallback_windows, int64_t recovered,
+                    int64_t decode_ms, int64_t fallback_ms) {
+  FallbackStats stats;
+  stats.windows = fallback_windows * 2;
+  stats.fallback_windows = fallback_windows;
+  stats.recovered = recovered;
+  stats.exhausted = fallback_windows - recovered;
+  stats.decode_ms = decode_ms;
+  stats.fallback_ms = fallback_ms;
+  return stats;
+}
+
+Mode ModeOf(const FallbackPolicy& policy, const std::string& tenant) {
+  for (const auto& t : policy.Tenants()) {
+    if (t.tenant == tenant) {
+      return t.mode;
+    }
+  }
+  ADD_FAILURE() << "no tenant " << tenant;
+  return Mode::kFull;
+}
+}  // namespace
+
+TEST(FallbackTrackerTest, CountsWindowsAndPasses) {
+  // temperatures 0.0, 0.2, ..., 1.0: six passes at most
+  FallbackTracker tracker(0.0f, kTemperatureInc);
+  // decoded at once
+  tracker.OnEncoderBegin();
+  tracker.OnPassStart();
+  // recovered at the second temperature
+  tracker.OnEncoderBegin();
+  tracker.OnPassStart();
+  tracker.OnPassStart();
+  // every temperature
+  tracker.OnEncoderBegin();
+  for (int i = 0; i < 6; i++) {
+    tracker.OnPassStart();
+  }
+  tracker.Finish();
+
+  const FallbackStats& stats = tracker.stats();
+  EXPECT_EQ(stats.windows, 3);
+  EXPECT_EQ(stats.fallback_windows, 2);
+  EXPECT_EQ(stats.fallback_passes, 6);
+  EXPECT_EQ(stats.recovered, 1);
+  EXPECT_EQ(stats.exhausted, 1);
+}
+
+TEST(FallbackTrackerTest, IgnoresEncoderRunsWithoutDecoding) {
+  FallbackTracker tracker(0.0f, kTemperatureInc);
+  tracker.OnEncoderBegin();
+  tracker.Finish();
+  EXPECT_EQ(tracker.stats().windows, 0);
+}
+
+TEST(FallbackPolicyTest, KeepsTheConfiguredFallbackUnlessAdaptive) {
+  FallbackPolicy policy;
+  policy.Record("a", Stats(20, 0, 100, 80), true);
+  EXPECT_FLOAT_EQ(policy.TemperatureInc("a", true, 0.0f, kTemperatureInc),
+                  kTemperatureInc);
+  // counted, but nothing is kept per tenant
+  EXPECT_EQ(policy.Totals().fallback_windows, 20);
+  EXPECT_TRUE(policy.Tenants().empty());
+}
+
+TEST(FallbackPolicyTest, TurnsFallbackOffWhenItNeverRecovers) {
+  FallbackPolicy policy;
+  policy.SetAdaptive(true);
+  policy.Record("a", Stats(20, 0, 100, 80), true);
+  EXPECT_EQ(ModeOf(policy, "a"), Mode::kOff);
+  EXPECT_FLOAT_EQ(policy.TemperatureInc("a", true, 0.0f, kTemperatureInc),
+                  0.0f);
+  // requests that are not latency sensitive keep it
+  EXPECT_FLOAT_EQ(policy.TemperatureInc("a", false, 0.0f, kTemperatureInc),
+                  kTemperatureInc);
+  // as do other tenants
+  EXPECT_FLOAT_EQ(policy.TemperatureInc("b", true, 0.0f, kTemperatureInc),
+                  kTemperatureInc);
+}
+
+TEST(FallbackPolicyTest, LimitsFallbackThatRarelyRecovers) {
+  FallbackPolicy policy;
+  policy.SetAdaptive(true);
+  policy.Record("a", Stats(20, 5, 100, 50), true);
+  EXPECT_EQ(ModeOf(policy, "a"), Mode::kLimited);
+  // halfway to 1.0, then 1.0
+  EXPECT_FLOAT_EQ(policy.TemperatureInc("a", true, 0.0f, kTemperatureInc),
+                  0.5f);
+
+  // cheap fallback is kept even when it rarely recovers
+  policy.Record("b", Stats(20, 5, 100, 10), true);
+  EXPECT_EQ(ModeOf(policy, "b"), Mode::kFull);
+}
+
+TEST(FallbackPolicyTest, WaitsForEnoughFallbackWindows) {
+  FallbackPolicy policy;
+  policy.SetAdaptive(true);
+  policy.Record("a", Stats(5, 0, 100, 80), true);
+  EXPECT_EQ(ModeOf(policy, "a"), Mode::kFull);
+  policy.Record("a", Stats(5, 0, 100, 80), true);
+  EXPECT_EQ(ModeOf(policy, "a"), Mode::kOff);
+}
+
+TEST(FallbackPolicyTest, ProbesWithTheConfiguredFallback) {
+  FallbackPolicy policy;
+  policy.SetAdaptive(true);
+  policy.Record("a", Stats(20, 0, 100, 80), true);
+  for (int i = 1; i < FallbackPolicy::kProbeEvery; i++) {
+    EXPECT_FLOAT_EQ(policy.TemperatureInc("a", true, 0.0f, kTemperatureInc),
+                    0.0f)
+        << "request " << i;
+  }
+  EXPECT_FLOAT_EQ(policy.TemperatureInc("a", true, 0.0f, kTemperatureInc),
+                  kTemperatureInc);
+  EXPECT_FLOAT_EQ(policy.TemperatureInc("a", true, 0.0f, kTemperatureInc),
+                  0.0f);
+}
+
+TEST(FallbackPolicyTest, LearnsOnlyFromMeasuredRequests) {
+  FallbackPolicy policy;
+  policy.SetAdaptive(true);
+  policy.Record("a", Stats(20, 0, 100, 80), false);
+  EXPECT_EQ(ModeOf(policy, "a"), Mode::kFull);
+
+  const FallbackStats totals = policy.Totals();
+  EXPECT_EQ(totals.fallback_windows, 20);
+  EXPECT_EQ(totals.exhausted, 20);
+  EXPECT_EQ(policy.Tenants()[0].requests, 1);
+}
+
+TEST(FallbackPolicyTest, RestoresFallbackOnceItRecoversAgain) {
+  FallbackPolicy policy;
+  policy.SetAdaptive(true);
+  policy.Record("a", Stats(10, 0, 100, 80), true);
+  EXPECT_EQ(ModeOf(policy, "a"), Mode::kOff);
+  policy.Record("a", Stats(10, 10, 100, 10), true);
+  EXPECT_EQ(ModeOf(policy, "a"), Mode::kFull);
+  EXPECT_GT(policy.Tenants()[0].recovery_rate,
+            FallbackPolicy::kLimitBelowRecovery);
+}
+
+TEST(FallbackPolicyTest, ForgetsTheLeastRecentlySeenTenants) {
+  FallbackPolicy policy;
+  policy.SetAdaptive(true);
+  policy.Record("first", Stats(20, 0, 100, 80), true);
+  for (size_t i = 1; i < FallbackPolicy::kMaxTenants; i++) {
+    policy.Record("t" + std::to_string(i), Stats(1, 1, 100, 10), true);
+  }
+  EXPECT_EQ(policy.Tenants().size(), FallbackPolicy::kMaxTenants);
+  // seen again, so it is not the oldest any more
+  EXPECT_FLOAT_EQ(
+      policy.TemperatureInc("first", true, 0.0f, kTemperatureInc), 0.0f);
+  policy.Record("last", Stats(1, 1, 100, 10), true);
+
+  const auto tenants = policy.Tenants();
+  EXPECT_LE(tenants.size(), FallbackPolicy::kMaxTenants / 2 + 1);
+  EXPECT_EQ(ModeOf(policy, "first"), Mode::kOff);
+  EXPECT_EQ(ModeOf(policy, "last"), Mode::kFull);
+  for (const auto& t : tenants) {
+    EXPECT_NE(t.tenant, "t1");
+  }
+}
+
+TEST(FallbackPolicyTest, ForgetsTenantsWhenNoLongerAdaptive) {
+  FallbackPolicy policy;
+  policy.SetAdaptive(true);
+  policy.Record("a", Stats(20, 0, 100, 80), true);
+  policy.SetAdaptive(false);
+  policy.SetAdaptive(true);
+  EXPECT_TRUE(policy.Tenants().empty());
+  EXPECT_FLOAT_EQ(policy.TemperatureInc("a", true, 0.0f, kTemperatureInc),
+                  kTemperatureInc);
+}
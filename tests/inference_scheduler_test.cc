@@ -0,0 +1,243 @@
+#include "inference_scheduler.h"
+
+#include <gtest/gtest.h>
+
+#include <atomic>
+#include <chrono>
+#include <future>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace {
+using Priority = audio::inferences::RequestPriority;
+
+InferenceScheduler::Job MakeJob(Priority priority, const std::string& tenant,
+                                int64_t cost, InferenceScheduler::Task task) {
+  InferenceScheduler::Job job;
+  job.priority = priority;
+  job.tenant = tenant;
+  job.cost = cost;
+  job.task = std::move(task);
+  return job;
+}
+
+// Keeps the only worker of a scheduler busy until Release, so jobs queue up
+// behind it.
+class BlockedWorker {
+ public:
+  explicit BlockedWorker(InferenceScheduler& scheduler) {
+    auto started = std::make_shared<std::promise<void>>();
+    auto started_future = started->get_future();
+    scheduler.Submit(MakeJob(Priority::kStandard, "blocker", 1,
+                             [started, gate = gate_](int) {
+                               started->set_value();
+                               gate->get_future().wait();
+                             }));
+    started_future.wait();
+  }
+  ~BlockedWorker() { Release(); }
+
+  void Release() {
+    if (!released_) {
+      released_ = true;
+      gate_->set_value();
+    }
+  }
+
+ private:
+  std::shared_ptr<std::promise<void>> gate_ =
+      std::make_shared<std::promise<void>>();
+  bool released_ = false;
+};
+
+// Records the order jobs run in
+class RunLog {
+ public:
+  InferenceScheduler::Task Record(const std::string& name) {
+    return [this, name](int) {
+      std::lock_guard<std::mutex> l(mtx_);
+      order_.push_back(name);
+    };
+  }
+  std::vector<std::string> order() {
+    std::lock_guard<std::mutex> l(mtx_);
+    return order_;
+  }
+
+ private:
+  std::mutex mtx_;
+  std::vector<std::string> order_;
+};
+
+// Waits until every submitted job has run
+void Drain(InferenceScheduler& scheduler) {
+  while (scheduler.PendingCost(Priority::kBatch) > 0) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+}
+}  // namespace
+
+TEST(InferenceSchedulerTest, ServesClassesByPriority) {
+  InferenceScheduler scheduler;
+  scheduler.Start(1, "test");
+  RunLog log;
+  {
+    BlockedWorker blocked(scheduler);
+    scheduler.Submit(MakeJob(Priority::kBatch, "a", 10, log.Record("batch")));
+    scheduler.Submit(
+        MakeJob(Priority::kStandard, "a", 10, log.Record("standard")));
+    scheduler.Submit(
+        MakeJob(Priority::kInteractive, "a", 10, log.Record("interactive")));
+  }
+  Drain(scheduler);
+  EXPECT_EQ(log.order(),
+            (std::vector<std::string>{"interactive", "standard", "batch"}));
+}
+
+TEST(InferenceSchedulerTest, SharesWorkersFairlyBetweenTenants) {
+  InferenceScheduler scheduler;
+  scheduler.Start(1, "test");
+  RunLog log;
+  {
+    BlockedWorker blocked(scheduler);
+    for (int i = 0; i < 3; i++) {
+      scheduler.Submit(MakeJob(Priority::kStandard, "busy", 10,
+                               log.Record("busy" + std::to_string(i))));
+    }
+    scheduler.Submit(
+        MakeJob(Priority::kStandard, "quiet", 10, log.Record("quiet")));
+  }
+  Drain(scheduler);
+  EXPECT_EQ(log.order(), (std::vector<std::string>{"busy0", "quiet", "busy1",
+                                                   "busy2"}));
+}
+
+TEST(InferenceSchedulerTest, WeightsShiftTheShare) {
+  InferenceScheduler scheduler;
+  scheduler.SetTenantWeight("heavy", 3.0);
+  scheduler.Start(1, "test");
+  RunLog log;
+  {
+    BlockedWorker blocked(scheduler);
+    for (int i = 0; i < 3; i++) {
+      scheduler.Submit(MakeJob(Priority::kStandard, "light", 30,
+                               log.Record("light" + std::to_string(i))));
+      scheduler.Submit(MakeJob(Priority::kStandard, "heavy", 30,
+                               log.Record("heavy" + std::to_string(i))));
+    }
+  }
+  Drain(scheduler);
+  // finish tags: heavy 10, 20, 30 and light 30, 60, 90
+  EXPECT_EQ(log.order(),
+            (std::vector<std::string>{"heavy0", "heavy1", "light0", "heavy2",
+                                      "light1", "light2"}));
+}
+
+TEST(InferenceSchedulerTest, PendingCostCountsSameAndHigherClasses) {
+  InferenceScheduler scheduler;
+  scheduler.Start(1, "test");
+  BlockedWorker blocked(scheduler);
+  scheduler.Submit(MakeJob(Priority::kInteractive, "a", 100, [](int) {}));
+  scheduler.Submit(MakeJob(Priority::kStandard, "a", 200, [](int) {}));
+  scheduler.Submit(MakeJob(Priority::kBatch, "a", 400, [](int) {}));
+  // the blocking job costs 1
+  EXPECT_EQ(scheduler.PendingCost(Priority::kInteractive), 101);
+  EXPECT_EQ(scheduler.PendingCost(Priority::kStandard), 301);
+  EXPECT_EQ(scheduler.PendingCost(Priority::kBatch), 701);
+  blocked.Release();
+  Drain(scheduler);
+  EXPECT_EQ(scheduler.PendingCost(Priority::kBatch), 0);
+}
+
+TEST(InferenceSchedulerTest, RunsShortInteractiveJobsBetweenChunks) {
+  InferenceScheduler scheduler;
+  scheduler.Start(1, "test");
+  RunLog log;
+  std::promise<void> started;
+  std::promise<void> queued;
+  auto queued_future = queued.get_future();
+  scheduler.Submit(MakeJob(Priority::kBatch, "a", 1000,
+                           [&](int worker_id) {
+                             started.set_value();
+                             queued_future.wait();
+                             log.Record("chunk1")(worker_id);
+                             scheduler.RunPreemptors(worker_id, 50);
+                             log.Record("chunk2")(worker_id);
+                           }));
+  started.get_future().wait();
+  scheduler.Submit(
+      MakeJob(Priority::kInteractive, "b", 10, log.Record("short")));
+  scheduler.Submit(
+      MakeJob(Priority::kInteractive, "b", 100, log.Record("long")));
+  queued.set_value();
+  Drain(scheduler);
+  EXPECT_EQ(log.order(),
+            (std::vector<std::string>{"chunk1", "short", "chunk2", "long"}));
+}
+
+TEST(InferenceSchedulerTest, StopFailsQueuedJobs) {
+  InferenceScheduler scheduler;
+  scheduler.Start(1, "test");
+  std::atomic<bool> ran = false;
+  std::atomic<int> dropped = 0;
+  {
+    BlockedWorker blocked(scheduler);
+    for (int i = 0; i < 3; i++) {
+      auto job = MakeJob(Priority::kStandard, "a", 10,
+                         [&ran](int) { ran = true; });
+      job.on_dropped = [&dropped] { dropped++; };
+      scheduler.Submit(std::move(job));
+    }
+    // the queued jobs are failed before Stop waits for the running one
+    std::thread stopper([&scheduler] { scheduler.Stop(); });
+    while (dropped < 3) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    blocked.Release();
+    stopper.join();
+  }
+  EXPECT_FALSE(ran);
+  EXPECT_EQ(dropped, 3);
+  EXPECT_EQ(scheduler.PendingCost(Priority::kBatch), 0);
+}
+
+TEST(InferenceSchedulerTest, DropsJobsSubmittedWhileStopped) {
+  InferenceScheduler scheduler;
+  scheduler.Start(1, "test");
+  scheduler.Stop();
+  bool dropped = false;
+  auto job = MakeJob(Priority::kStandard, "a", 10, [](int) {});
+  job.on_dropped = [&dropped] { dropped = true; };
+  scheduler.Submit(std::move(job));
+  EXPECT_TRUE(dropped);
+
+  // a restarted scheduler runs jobs again
+  scheduler.Start(1, "test");
+  Drain(scheduler);
+}
+
+TEST(InferenceSchedulerTest, KeepsOrderAfterForgettingIdleTenants) {
+  InferenceScheduler scheduler;
+  scheduler.Start(1, "test");
+  // enough one-off tenants to trigger pruning several times
+  for (int i = 0; i < 5000; i++) {
+    scheduler.Submit(
+        MakeJob(Priority::kStandard, "t" + std::to_string(i), 1, [](int) {}));
+  }
+  Drain(scheduler);
+
+  RunLog log;
+  {
+    BlockedWorker blocked(scheduler);
+    for (int i = 0; i < 2; i++) {
+      scheduler.Submit(MakeJob(Priority::kStandard, "busy", 10,
+                               log.Record("busy" + std::to_string(i))));
+    }
+    scheduler.Submit(
+        MakeJob(Priority::kStandard, "quiet", 10, log.Record("quiet")));
+  }
+  Drain(scheduler);
+  EXPECT_EQ(log.order(), (std::vector<std::string>{"busy0", "quiet", "busy1"}));
+}
@@ -0,0 +1,279 @@
+#include "model_quantizer.h"
+
+#include <gtest/gtest.h>
+
+#include <cmath>
+#include <filesystem>
+#include <fstream>
+#include <string>
+#include <vector>
+
+namespace {
+namespace fs = std::filesystem;
+
+constexpr int kNumHparams = 11;
+
+struct Tensor {
+  std::string name;
+  std::vector<int32_t> ne;
+  enum ggml_type type = GGML_TYPE_F32;
+  std::vector<char> data;
+};
+
+template <typename T>
+void Put(std::ostream& out, const T& value) {
+  out.write(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+template <typename T>
+T Get(std::istream& in) {
+  T value{};
+  in.read(reinterpret_cast<char*>(&value), sizeof(value));
+  return value;
+}
+
+Tensor F32Tensor(const std::string& name, std::vector<int32_t> ne) {
+  Tensor t;
+  t.name = name;
+  t.ne = std::move(ne);
+  size_t n = 1;
+  for (int32_t d : t.ne) {
+    n *= d;
+  }
+  std::vector<float> values(n);
+  for (size_t i = 0; i < n; i++) {
+    values[i] = std::sin(0.37f * i) * (1.0f + i % 7);
+  }
+  t.data.resize(n * sizeof(float));
+  std::copy_n(reinterpret_cast<const char*>(values.data()), t.data.size(),
+              t.data.data());
+  return t;
+}
+
+// A whisper model file as far as the quantizer reads it: hyperparameters,
+// mel filters, vocabulary and tensors
+void WriteModel(const std::string& path, int32_t ftype,
+                const std::vector<Tensor>& tensors) {
+  std::ofstream out(path, std::ios::binary | std::ios::trunc);
+  Put(out, uint32_t(GGML_FILE_MAGIC));
+  for (int i = 0; i < kNumHparams - 1; i++) {
+    Put(out, int32_t(i + 1));
+  }
+  Put(out, ftype);
+  Put(out, int32_t(2));  // n_mel
+  Put(out, int32_t(3));  // n_fft
+  for (int i = 0; i < 6; i++) {
+    Put(out, float(i) / 6);
+  }
+  const std::vector<std::string> vocab = {"hello", " world"};
+  Put(out, int32_t(vocab.size()));
+  for (const auto& word : vocab) {
+    Put(out, uint32_t(word.size()));
+    out.write(word.data(), word.size());
+  }
+  for (const auto& t : tensors) {
+    Put(out, int32_t(t.ne.size()));
+    Put(out, int32_t(t.name.size()));
+    Put(out, int32_t(t.type));
+    for (int32_t d : t.ne) {
+      Put(out, d);
+    }
+    out.write(t.name.data(), t.name.size());
+    out.write(t.data.data(), t.data.size());
+  }
+}
+
+// Reads back the tensors of a model file written by WriteModel or the
+// quantizer; |ftype| is the last hyperparameter
+std::vector<Tensor> ReadModel(const std::string& path, int32_t& ftype) {
+  std::ifstream in(path, std::ios::binary);
+  EXPECT_EQ(Get<uint32_t>(in), uint32_t(GGML_FILE_MAGIC));
+  for (int i = 0; i < kNumHparams; i++) {
+    ftype = Get<int32_t>(in);
+  }
+  const int32_t n_mel = Get<int32_t>(in);
+  const int32_t n_fft = Get<int32_t>(in);
+  in.seekg(int64_t(n_mel) * n_fft * sizeof(float), std::ios::cur);
+  const int32_t n_vocab = Get<int32_t>(in);
+  for (int32_t i = 0; i < n_vocab; i++) {
+    in.seekg(Get<uint32_t>(in), std::ios::cur);
+  }
+  std::vector<Tensor> tensors;
+  while (true) {
+    const int32_t n_dims = Get<int32_t>(in);
+    const int32_t name_len = Get<int32_t>(in);
+    const int32_t ttype = Get<int32_t>(in);
+    if (!in) {
+      break;
+    }
+    Tensor t;
+    t.type = static_cast<enum ggml_type>(ttype);
+    int64_t n = 1;
+    for (int i = 0; i < n_dims; i++) {
+      t.ne.push_back(Get<int32_t>(in));
+      n *= t.ne.back();
+    }
+    t.name.resize(name_len);
+    in.read(t.name.data(), name_len);
+    t.data.resize(n * ggml_type_size(t.type) / ggml_blck_size(t.type));
+    in.read(t.data.data(), t.data.size());
+    tensors.push_back(std::move(t));
+  }
+  return tensors;
+}
+
+std::vector<float> ToFloats(const Tensor& t) {
+  size_t n = 1;
+  for (int32_t d : t.ne) {
+    n *= d;
+  }
+  std::vector<float> values(n);
+  if (t.type == GGML_TYPE_F32) {
+    std::copy_n(reinterpret_cast<const float*>(t.data.data()), n,
+                values.data());
+  } else {
+    ggml_get_type_traits(t.type)->to_float(t.data.data(), values.data(), n);
+  }
+  return values;
+}
+
+class ModelQuantizerTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    dir_ = fs::path(::testing::TempDir()) /
+           ("model_quantizer_test_" +
+            std::string(::testing::UnitTest::GetInstance()
+                            ->current_test_info()
+                            ->name()));
+    fs::remove_all(dir_);
+    fs::create_directories(dir_);
+    tensors_ = {
+        F32Tensor("encoder.blocks.0.attn.query.weight", {64, 4}),
+        F32Tensor("encoder.conv1.bias", {1, 64}),
+        F32Tensor("decoder.positional_embedding", {64, 2}),
+        F32Tensor("decoder.ln.weight", {64}),
+    };
+    model_ = (dir_ / "model.bin").string();
+    WriteModel(model_, GGML_FTYPE_ALL_F32, tensors_);
+  }
+  void TearDown() override { fs::remove_all(dir_); }
+
+  fs::path dir_;
+  std::vector<Tensor> tensors_;
+  std::string model_;
+};
+}  // namespace
+
+TEST_F(ModelQuantizerTest, ParsesTypeNames) {
+  enum ggml_type type;
+  ASSERT_TRUE(ParseQuantizationType("q8_0", type));
+  EXPECT_EQ(type, GGML_TYPE_Q8_0);
+  ASSERT_TRUE(ParseQuantizationType("q4_1", type));
+  EXPECT_EQ(type, GGML_TYPE_Q4_1);
+  EXPECT_FALSE(ParseQuantizationType("f16", type));
+  EXPECT_FALSE(ParseQuantizationType("Q8_0", type));
+}
+
+TEST_F(ModelQuantizerTest, CachesCopiesNextToTheSource) {
+  EXPECT_EQ(QuantizedModelPath("/models/ggml-base.en.bin", "q5_1"),
+            "/models/ggml-base.en.q5_1.bin");
+}
+
+TEST_F(ModelQuantizerTest, RoundTripsWeights) {
+  const std::string dst = (dir_ / "model.q8_0.bin").string();
+  ModelQuantization result;
+  std::string error;
+  ASSERT_TRUE(QuantizeModelFile(model_, dst, GGML_TYPE_Q8_0, result, error))
+      << error;
+  EXPECT_EQ(result.source_type, "f32");
+  EXPECT_LT(result.weights_bytes, result.source_weights_bytes);
+
+  int32_t ftype = 0;
+  const auto tensors = ReadModel(dst, ftype);
+  EXPECT_EQ(ftype, GGML_QNT_VERSION * GGML_QNT_VERSION_FACTOR +
+                       GGML_FTYPE_MOSTLY_Q8_0);
+  ASSERT_EQ(tensors.size(), tensors_.size());
+  for (size_t i = 0; i < tensors.size(); i++) {
+    SCOPED_TRACE(tensors_[i].name);
+    EXPECT_EQ(tensors[i].name, tensors_[i].name);
+    EXPECT_EQ(tensors[i].ne, tensors_[i].ne);
+    if (i > 0) {
+      // biases, positional embeddings and 1D tensors are copied
+      EXPECT_EQ(tensors[i].type, GGML_TYPE_F32);
+      EXPECT_EQ(tensors[i].data, tensors_[i].data);
+      continue;
+    }
+    EXPECT_EQ(tensors[i].type, GGML_TYPE_Q8_0);
+    const auto expected = ToFloats(tensors_[i]);
+    const auto actual = ToFloats(tensors[i]);
+    ASSERT_EQ(actual.size(), expected.size());
+    for (size_t j = 0; j < actual.size(); j++) {
+      // q8_0 keeps 8 bits per value of a block scaled to at most 7
+      EXPECT_NEAR(actual[j], expected[j], 7.0f / 127) << "at " << j;
+    }
+  }
+
+  ModelQuantization inspected;
+  ASSERT_TRUE(InspectModelFile(dst, inspected));
+  EXPECT_EQ(inspected.source_type, "q8_0");
+  EXPECT_EQ(inspected.weights_bytes, result.weights_bytes);
+}
+
+TEST_F(ModelQuantizerTest, RefusesQuantizedSources) {
+  const std::string dst = (dir_ / "model.q8_0.bin").string();
+  ModelQuantization result;
+  std::string error;
+  ASSERT_TRUE(QuantizeModelFile(model_, dst, GGML_TYPE_Q8_0, result, error));
+
+  result = ModelQuantization();
+  EXPECT_FALSE(QuantizeModelFile(dst, (dir_ / "again.bin").string(),
+                                 GGML_TYPE_Q4_0, result, error));
+  EXPECT_NE(error.find("already quantized (q8_0)"), std::string::npos)
+      << error;
+}
+
+TEST_F(ModelQuantizerTest, ReusesTheCachedCopy) {
+  ModelQuantization first;
+  std::string error;
+  ASSERT_TRUE(PrepareQuantizedModel(model_, "q8_0", first, error)) << error;
+  EXPECT_FALSE(first.cache_hit);
+  EXPECT_EQ(first.path, QuantizedModelPath(model_, "q8_0"));
+  EXPECT_FALSE(fs::exists(first.path + ".tmp"));
+
+  ModelQuantization second;
+  ASSERT_TRUE(PrepareQuantizedModel(model_, "q8_0", second, error)) << error;
+  EXPECT_TRUE(second.cache_hit);
+  EXPECT_EQ(second.path, first.path);
+  EXPECT_EQ(second.source_type, "f32");
+  EXPECT_EQ(second.weights_bytes, first.weights_bytes);
+  EXPECT_EQ(second.source_weights_bytes, first.source_weights_bytes);
+}
+
+TEST_F(ModelQuantizerTest, IgnoresCopiesNotMadeFromTheSource) {
+  ModelQuantization result;
+  std::string error;
+  const std::string path = QuantizedModelPath(model_, "q8_0");
+  // a copy of some other model, planted where the cached one goes
+  ASSERT_TRUE(QuantizeModelFile(model_, path, GGML_TYPE_Q8_0, result, error));
+  ASSERT_TRUE(PrepareQuantizedModel(model_, "q8_0", result, error)) << error;
+  EXPECT_FALSE(result.cache_hit);
+
+  // the source changing invalidates the copy made from it
+  tensors_.pop_back();
+  WriteModel(model_, GGML_FTYPE_ALL_F32, tensors_);
+  ASSERT_TRUE(PrepareQuantizedModel(model_, "q8_0", result, error)) << error;
+  EXPECT_FALSE(result.cache_hit);
+  ASSERT_TRUE(PrepareQuantizedModel(model_, "q8_0", result, error)) << error;
+  EXPECT_TRUE(result.cache_hit);
+}
+
+TEST_F(ModelQuantizerTest, RejectsFilesThatAreNotModels) {
+  const std::string path = (dir_ / "notes.txt").string();
+  std::ofstream(path) << "not a model";
+  ModelQuantization result;
+  EXPECT_FALSE(InspectModelFile(path, result));
+  std::string error;
+  EXPECT_FALSE(QuantizeModelFile(path, (dir_ / "out.bin").string(),
+                                 GGML_TYPE_Q8_0, result, error));
+  EXPECT_NE(error.find("is not a whisper model file"), std::string::npos);
+}
@@ -0,0 +1,148 @@
+#include "session_cache.h"
+
+#include <gtest/gtest.h>
+
+#include <chrono>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Stands in for whisper's tokenizer, so the tests need no model: every word
+// is a token, spelled with the space in front of it.
+struct whisper_context {
+  std::vector<std::string> vocab;
+};
+
+extern "C" {
+int whisper_tokenize(struct whisper_context* ctx, const char* text,
+                     whisper_token* tokens, int n_max_tokens) {
+  std::istringstream words(text);
+  int n = 0;
+  for (std::string word; words >> word;) {
+    if (n == n_max_tokens) {
+      return -1;
+    }
+    ctx->vocab.push_back(" " + word);
+    tokens[n++] = static_cast<whisper_token>(ctx->vocab.size() - 1);
+  }
+  return n;
+}
+
+const char* whisper_token_to_str(struct whisper_context* ctx,
+                                 whisper_token token) {
+  return ctx->vocab[token].c_str();
+}
+}
+
+namespace {
+constexpr size_t kMaxTokens = 8;
+
+class SessionCacheTest : public ::testing::Test {
+ protected:
+  // Tokens of |words|, as the decoder would have produced them
+  std::vector<whisper_token> Decoded(const std::string& words) {
+    std::vector<whisper_token> tokens(words.size() + 1);
+    tokens.resize(whisper_tokenize(&ctx_, words.c_str(), tokens.data(),
+                                   static_cast<int>(tokens.size())));
+    return tokens;
+  }
+
+  std::string Text(const std::vector<whisper_token>& tokens) {
+    std::string text;
+    for (whisper_token token : tokens) {
+      text += whisper_token_to_str(&ctx_, token);
+    }
+    return text;
+  }
+
+  // Runs a request of |tenant|'s |session_id| prompted with |prompt| that
+  // decodes |words|; returns the text it was prompted with.
+  std::string Request(const std::string& tenant,
+                      const std::string& session_id,
+                      const std::string& prompt, const std::string& words) {
+    const auto prompt_tokens =
+        cache_.PromptTokens(tenant, session_id, prompt, &ctx_, kMaxTokens);
+    cache_.Update(tenant, session_id, prompt_tokens, Decoded(words), &ctx_,
+                  kMaxTokens);
+    return Text(prompt_tokens);
+  }
+
+  whisper_context ctx_;
+  SessionCache cache_;
+};
+}  // namespace
+
+TEST_F(SessionCacheTest, PromptsWithWhatTheSessionDecoded) {
+  EXPECT_EQ(Request("t", "s", "Names: Ana", "hello there"), " Names: Ana");
+  EXPECT_EQ(Request("t", "s", "", "how are you"),
+            " Names: Ana hello there");
+  EXPECT_EQ(Request("t", "s", "", "fine"),
+            " Names: Ana hello there how are you");
+
+  const auto stats = cache_.GetStats();
+  EXPECT_EQ(stats.misses, 1);
+  EXPECT_EQ(stats.hits, 2);
+  EXPECT_EQ(stats.sessions, 1);
+}
+
+TEST_F(SessionCacheTest, KeepsTheTailOfLongSessions) {
+  Request("t", "s", "", "one two three four five six");
+  EXPECT_EQ(Request("t", "s", "", "seven eight nine"),
+            " one two three four five six");
+  // at most kMaxTokens, the oldest dropped
+  EXPECT_EQ(Request("t", "s", "", "ten"),
+            " two three four five six seven eight nine");
+}
+
+TEST_F(SessionCacheTest, ReusesTheContextWhenTheClientSendsItBack) {
+  Request("t", "s", "Names: Ana", "hello there");
+  // spacing aside
+  EXPECT_EQ(Request("t", "s", "Names: Ana hello there ", "bye"),
+            " Names: Ana hello there");
+  EXPECT_EQ(cache_.GetStats().hits, 1);
+}
+
+TEST_F(SessionCacheTest, UsesOtherPromptsVerbatim) {
+  Request("t", "s", "", "hello there how are you");
+  // the end of the context, but not all of it
+  EXPECT_EQ(Request("t", "s", "how are you", "fine"), " how are you");
+  // more than the context: its leading text is kept
+  EXPECT_EQ(Request("t", "s", "Ana said: how are you fine", "good"),
+            " Ana said: how are you fine");
+  // the prompt the session started from is not what it produced since
+  Request("t", "x", "Names: Ana", "hello");
+  EXPECT_EQ(Request("t", "x", "Names: Ana", "bye"), " Names: Ana");
+  EXPECT_EQ(cache_.GetStats().hits, 0);
+}
+
+TEST_F(SessionCacheTest, NamespacesSessionsByTenant) {
+  Request("a", "s", "", "some words");
+  EXPECT_EQ(Request("b", "s", "", "anything"), "");
+  EXPECT_EQ(Request("a", "s", "", "more"), " some words");
+  // the tenant does not run into the session id
+  Request("ab", "c", "", "first");
+  EXPECT_EQ(Request("a", "bc", "", "second"), "");
+  EXPECT_EQ(cache_.GetStats().sessions, 4);
+}
+
+TEST_F(SessionCacheTest, EvictsTheLeastRecentlyUsedSession) {
+  cache_.SetLimits(2, SessionCache::kDefaultTtl);
+  Request("t", "a", "", "one");
+  Request("t", "b", "", "two");
+  Request("t", "a", "", "three");
+  Request("t", "c", "", "four");
+  EXPECT_EQ(cache_.GetStats().evicted, 1);
+  EXPECT_EQ(Request("t", "a", "", "five"), " one three");
+  EXPECT_EQ(Request("t", "b", "", "six"), "");
+}
+
+TEST_F(SessionCacheTest, ExpiresIdleSessions) {
+  cache_.SetLimits(SessionCache::kDefaultMaxSessions,
+                   std::chrono::seconds(0));
+  Request("t", "s", "", "hello");
+  // a session not used for 0 s expires as soon as time moves on
+  std::this_thread::sleep_for(std::chrono::milliseconds(2));
+  EXPECT_EQ(Request("t", "s", "", "again"), "");
+  EXPECT_GE(cache_.GetStats().expired, 1);
+}